@@ -19,6 +19,7 @@
 
 #include "hass_mqtt_device/core/device_base.h"
 #include "hass_mqtt_device/core/mqtt_connector.h"
+#include "hass_mqtt_device/core/one_wire_reader.h"
 #include "hass_mqtt_device/devices/hvac.h"
 #include "hass_mqtt_device/functions/sensor.h"
 #include "hass_mqtt_device/functions/sensor_attributes_factory.hpp"
@@ -29,7 +30,6 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <list>
 #include <memory>
 #include <string>
 #include <thread> // for std::this_thread::sleep_for
@@ -192,67 +192,16 @@ void heaterThread()
 // Will be updated on every read cycle. Should be reset by the user in order to detect when a new read has happened
 bool has_read_temp = false;
 
-// Temperature reading thread
-void tempReadingLoop()
+// Store a temperature reading. Called on the network loop by the 1w reader
+void storeTemperature(const std::string& sensor, double temp)
 {
-    LOG_INFO("Starting temp sensor thread");
-    const std::string base_path = "/sys/bus/w1/devices";
-    int temp_read_counter = 0;
-    int valve_control_counter = 0;
-    while(!stop_threads)
+    auto sensor_name = temp_sensors.find(sensor);
+    if(sensor_name == temp_sensors.end())
     {
-        if(std::filesystem::is_directory(base_path))
-        {
-            LOG_DEBUG("Reading files");
-            std::list<std::string> paths;
-            // List all sensors
-            for(const auto& entry : std::filesystem::directory_iterator(base_path))
-            {
-                if(!stop_threads && std::filesystem::is_directory(entry.path()) &&
-                   std::filesystem::is_regular_file(entry.path() / "temperature"))
-                {
-                    // Get sensor id
-                    if(entry.path().end() != entry.path().begin())
-                    {
-                        std::string sensor = *std::prev(entry.path().end());
-                        // Read sensor values and store
-                        std::ifstream infile(entry.path() / "temperature");
-                        double temp = NAN;
-                        infile >> temp;
-                        if(infile.good())
-                        {
-                            temp /= 1000;
-                            if(temp == 85)
-                            {
-                                LOG_ERROR("Failed to read temperature from {}", sensor);
-                                continue;
-                            }
-                            auto sensor_name = temp_sensors.find(sensor);
-                            if(sensor_name == temp_sensors.end())
-                            {
-                                LOG_WARN("Unknown sensor {}", sensor);
-                                continue;
-                            }
-                            temp_temperatures[sensor_name->second] = temp;
-                            LOG_DEBUG("Sensor: {} Temp: {}", sensor, temp);
-                        }
-                    }
-                }
-            }
-        }
-        else
-        {
-            LOG_DEBUG("No 1w directory exist");
-        }
-        // Give the system 30 seconds to create the 1W system folder before sending default data
-        if(temp_read_counter++ > 3)
-        {
-            has_read_temp = true;
-        }
-        // Sleep for 10 seconds
-        std::this_thread::sleep_for(std::chrono::seconds(10));
+        LOG_WARN("Unknown sensor {}", sensor);
+        return;
     }
-    LOG_INFO("Ending thread");
+    temp_temperatures[sensor_name->second] = temp;
 }
 
 // Sanitize the config
@@ -376,7 +325,18 @@ int main(int argc, char* argv[])
     // Start the threads
     std::thread electric_heater_thread(electricHeaterThread);
     std::thread heater_thread(heaterThread);
-    std::thread temp_thread(tempReadingLoop);
+
+    // Read the temperature probes in the background, the readings are stored from the network loop
+    auto temperature_reader = std::make_shared<OneWireReader>(connector);
+    temperature_reader->setReadingCallback(storeTemperature);
+    temperature_reader->setCycleCallback([read_cycles = 0]() mutable {
+        // Give the system 30 seconds to create the 1W system folder before sending default data
+        if(read_cycles++ > 3)
+        {
+            has_read_temp = true;
+        }
+    });
+    temperature_reader->start(std::chrono::seconds(10));
 
     // Create the ventilator device
     auto thermostat = std::make_shared<HvacDevice>("Floor heating setpoint", "floor_heating_setpoint");
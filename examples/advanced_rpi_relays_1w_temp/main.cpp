@@ -18,13 +18,12 @@
  * sudo apt-get install wiringpi
  */
 
+#include "hass_mqtt_device/core/configured_device.h"
 #include "hass_mqtt_device/core/device_base.h"
 #include "hass_mqtt_device/core/mqtt_connector.h"
-#include "hass_mqtt_device/devices/hvac.h"
-#include "hass_mqtt_device/functions/number.h"
-#include "hass_mqtt_device/functions/sensor.h"
-#include "hass_mqtt_device/functions/sensor_attributes_factory.hpp"
-#include "hass_mqtt_device/functions/switch.h"
+#include "hass_mqtt_device/core/one_wire_reader.h"
+#include "hass_mqtt_device/core/slow_pwm.h"
+#include "hass_mqtt_device/core/state_store.h"
 #include "hass_mqtt_device/logger/logger.hpp"
 #include "math.h"
 
@@ -33,10 +32,8 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <list>
 #include <memory>
 #include <string>
-#include <thread> // for std::this_thread::sleep_for
 #if defined(ARM_ARCH) || defined(ARM64_ARCH)
 #include <wiringPi.h>
 #else
@@ -73,84 +70,15 @@ void pullUpDnControl(int pin, int mode)
 #endif
 
 const int tick_size_ms = 1000;
-bool stop_threads = false;
 nlohmann::json config;
 
-// Will be updated on every read cycle. Should be reset by the user in order to detect when a new read has happened
-bool has_read_temp = false;
+// The functions built from the config, with their state
+std::shared_ptr<ConfiguredDevice> functions;
 
-// Temperature reading thread
-void tempReadingLoop()
-{
-    LOG_TRACE("Starting temp sensor thread");
-    const std::string base_path = "/sys/bus/w1/devices";
-    int temp_read_counter = 0;
-    while(!stop_threads)
-    {
-        if(std::filesystem::is_directory(base_path))
-        {
-            LOG_DEBUG("Reading files");
-            std::list<std::string> paths;
-            // List all sensors
-            for(const auto& entry : std::filesystem::directory_iterator(base_path))
-            {
-                if(!stop_threads && std::filesystem::is_directory(entry.path()) &&
-                   std::filesystem::is_regular_file(entry.path() / "temperature"))
-                {
-                    // Get sensor id
-                    if(entry.path().end() != entry.path().begin())
-                    {
-                        std::string sensor = *std::prev(entry.path().end());
-                        // Read sensor values and store
-                        std::ifstream infile(entry.path() / "temperature");
-                        double temp = NAN;
-                        infile >> temp;
-                        if(!infile.good())
-                        {
-                            LOG_ERROR("Failed to read temperature from {}", sensor);
-                            continue;
-                        }
-                        temp /= 1000;
-                        if(temp == 85)
-                        {
-                            LOG_ERROR("Failed to read temperature from {}", sensor);
-                            continue;
-                        }
-                        // Find function and store the value
-                        for(auto& function : config["functions"])
-                        {
-                            if(function["type"] != "temp" || function["usage"]["type"] != "1w" ||
-                               function["usage"]["id"] != sensor)
-                            {
-                                continue;
-                            }
-                            if(!function.contains("value") || (function.contains("value") && function["value"] != temp))
-                            {
-                                function["updated"] = true;
-                            }
-                            function["value"] = temp;
-                            LOG_DEBUG("Sensor: {} Temp: {}", sensor, temp);
-                            break;
-                        }
-                    }
-                }
-            }
-            temp_read_counter++;
-        }
-        else
-        {
-            LOG_DEBUG("No 1w directory exist");
-        }
-        // Sleep for 10 seconds
-        std::this_thread::sleep_for(std::chrono::seconds(10));
-    }
-    LOG_INFO("Ending thread");
-}
-
-// Sanitize the config
+// Sanitize the config. The functions are validated when they are built
 int sanitizeConfig()
 {
-    // First check that the required fields are present
+    // Check that the required fields are present
     if(!config.contains("ip") || !config.contains("port") || !config.contains("username") ||
        !config.contains("password") || !config.contains("functions") || !config.contains("status_file")
        || !config.contains("unique_id"))
@@ -158,135 +86,40 @@ int sanitizeConfig()
         LOG_ERROR("Config file does not contain the required fields");
         return 1;
     }
-    // Check that the functions are valid
-    for(const auto& function : config["functions"])
-    {
-        // Make sure that type, parameters, usage and name are present
-        if(!function.contains("type") || !function.contains("parameters") || !function.contains("usage") ||
-           !function.contains("name"))
-        {
-            LOG_ERROR("Function does not contain the required fields");
-            return 1;
-        }
-        // If type is number, make sure that min, max and step is set in parameters, also make sure that usage type is either pwm or analog
-        if(function["type"] == "number")
-        {
-            if(!function["parameters"].contains("min") || !function["parameters"].contains("max") ||
-               !function["parameters"].contains("step"))
-            {
-                LOG_ERROR("Function of type number does not contain the required parameters");
-                return 1;
-            }
-            if(!function["usage"].contains("gpio"))
-            {
-                LOG_ERROR("Function of type number does not contain the required gpio");
-                return 1;
-            }
-            if(!function["usage"].contains("type") ||
-               !(function["usage"]["type"] == "pwm" || function["usage"]["type"] == "analog"))
-            {
-                LOG_ERROR("Function of type number does not contain the required usage type");
-                return 1;
-            }
-        }
-        // If type is switch, make sure that usage type is gpio
-        else if(function["type"] == "switch")
-        {
-            if(!function["usage"].contains("gpio"))
-            {
-                LOG_ERROR("Function of type switch does not contain the required gpio");
-                return 1;
-            }
-            if(!function["usage"].contains("type") || function["usage"]["type"] != "onoff")
-            {
-                LOG_ERROR("Function of type switch does not contain the required usage type");
-                return 1;
-            }
-        }
-        // If type is temp, make sure that usage type is 1w, and that the usage id is set
-        else if(function["type"] == "temp")
-        {
-            if(!function["usage"].contains("type") || function["usage"]["type"] != "1w")
-            {
-                LOG_ERROR("Function of type temp does not contain the required usage type");
-                return 1;
-            }
-            if(!function["usage"].contains("id"))
-            {
-                LOG_ERROR("Function of type temp does not contain the required usage id");
-                return 1;
-            }
-        }
-    }
     return 0;
 }
 
-// Save the status to the status file if any of the values have changed
-void saveStatus()
+// Get the path of the state journal, next to the old status file unless set in the config
+std::string getJournalPath()
 {
-    bool changed = false;
-    for(const auto& function : config["functions"])
+    if(config.contains("state_journal"))
     {
-        if(!function.contains("value_saved") ||
-           (function.contains("value") && function["value"] != function["value_saved"]))
-        {
-            changed = true;
-            break;
-        }
-    }
-    if(!changed)
-    {
-        LOG_DEBUG("No changes to save");
-        return;
+        return config.at("state_journal").get<std::string>();
     }
-    LOG_DEBUG("Saving state");
-    auto status_file_name = config.at("status_file").get<std::string>();
-    // Check if the folder exists, if not create it. If it fails, print error
-    auto folder = status_file_name.substr(0, status_file_name.find_last_of("/"));
+    return config.at("status_file").get<std::string>() + ".journal";
+}
+
+// Create the folder of a file if it does not exist
+bool createFolderOf(const std::string& file_name)
+{
+    auto folder = file_name.substr(0, file_name.find_last_of("/"));
     try
     {
-        if(!std::filesystem::exists(folder))
+        if(!std::filesystem::exists(folder) && !std::filesystem::create_directories(folder))
         {
-            if(!std::filesystem::create_directories(folder))
-            {
-                LOG_ERROR("Folder for the status file does not exist. Could not create folder {}", folder);
-                return;
-            }
+            LOG_ERROR("Could not create folder {}", folder);
+            return false;
         }
     }
     catch(const std::exception& e)
     {
-        LOG_ERROR("Error creating folder for status file: {}", e.what());
-        return;
-    }
-    std::ofstream status_file(status_file_name);
-    if(status_file.is_open())
-    {
-        nlohmann::json status_json;
-        for(auto& function : config["functions"])
-        {
-            if(!function.contains("value"))
-            {
-                continue;
-            }
-            function["value_saved"] = function["value"];
-            nlohmann::json function_json;
-            function_json["name"] = function["name"];
-            if(function.contains("value"))
-            {
-                function_json["value"] = function["value"];
-            }
-            status_json["functions"].push_back(function_json);
-        }
-        status_file << status_json.dump(4);
-        status_file.close();
-    }
-    else
-    {
-        LOG_ERROR("Could not open status file for writing");
+        LOG_ERROR("Error creating folder {}: {}", folder, e.what());
+        return false;
     }
+    return true;
 }
 
+// Read the values from the status file written by older versions, they are stored in the state journal from now on
 void readStatus()
 {
     LOG_TRACE("readStatus start");
@@ -299,22 +132,18 @@ void readStatus()
             nlohmann::json status_json = nlohmann::json::parse(status_file);
             for(const auto& function : status_json["functions"])
             {
-                if(function.contains("value") && function.contains("name"))
+                if(!function.contains("value") || !function.contains("name"))
+                {
+                    continue;
+                }
+                auto index = functions->find(function["name"].get<std::string>());
+                if(!index)
                 {
-                    LOG_DEBUG("Setting value for {} to {}", function["name"].get<std::string>(), function["value"].get<std::string>());
-
-                    // Find name in config, and set value
-                    for(auto& config_function : config["functions"])
-                    {
-                        if(config_function["name"] == function["name"])
-                        {
-                            config_function["value"] = function["value"];
-                            config_function["value_saved"] = function["value"];
-                            config_function["updated"] = true;
-                            break;
-                        }
-                    }
+                    LOG_WARN("Status file has a value for unknown function {}", function["name"].dump());
+                    continue;
                 }
+                LOG_DEBUG("Setting value for {} to {}", function["name"].dump(), function["value"].dump());
+                functions->setValue(*index, function["value"].get<double>());
             }
         }
         catch(const nlohmann::json::exception& e)
@@ -325,102 +154,45 @@ void readStatus()
     }
     else
     {
-        std::cerr << "Could not open status file" << std::endl;
+        LOG_DEBUG("No status file to read");
     }
     LOG_TRACE("readStatus end");
 }
 
-void controlNumberCallback(int index, double number)
-{
-    if(number != config["functions"][index]["value"])
-    {
-        config["functions"][index]["value"] = number;
-        config["functions"][index]["updated"] = true;
-        LOG_INFO("number for index {} changed to {}", index, number);
-    }
-    else
-    {
-        LOG_INFO("number for index {} already set to {}", index, number);
-    }
-}
-
-void controlSwitchCallback(int index, bool state)
-{
-    if(state != config["functions"][index]["value"])
-    {
-        config["functions"][index]["value"] = state;
-        config["functions"][index]["updated"] = true;
-        LOG_INFO("number for index {} changed to {}", index, state);
-
-        bool value = config["functions"][index]["value"].get<bool>();
-        // If an active state has been defined and it is false, invert the value
-        if(config["functions"][index]["usage"].contains("active_state") &&
-           !config["functions"][index]["usage"]["active_state"])
-        {
-            value = !value;
-        }
-        digitalWrite(config["functions"][index]["usage"]["gpio"], value);
-    }
-    else
-    {
-        LOG_INFO("number for index {} already set to {}", index, state);
-    }
-}
-
-void updateNumberPwmOutputs()
+// To help with debugging, we write the status of the pwm outputs to a file
+void writePwmStatus()
 {
-    static int loop_count = 0;
-    loop_count++;
-
-    // To help with debugging, we write the status of the pwm outputs to a file
     std::ofstream status("/tmp/hass_mqtt_pwm");
     if(!status.good())
     {
         LOG_WARN("Could not open /tmp/hass_mqtt_pwm");
+        return;
     }
 
-    int i = 0;
-    for(auto& function : config["functions"])
+    for(size_t i = 0; i < functions->size(); ++i)
     {
-        // We only care about number functions here
-        if(function["type"] != "number" || function["usage"]["type"] != "pwm")
+        // We only care about pwm outputs here
+        const auto& function = functions->getConfig(i);
+        if(function.usage != FunctionConfig::Usage::PWM)
         {
             continue;
         }
-        if(function["value"] > 0)
-        {
-            int count_offset = function["usage"]["offset"].get<int>() / tick_size_ms;
-            int period = function["usage"]["period"].get<int>() / tick_size_ms;
-            if((loop_count + count_offset) % period <
-               (function["value"].get<double>() * period) / function["parameters"]["max"].get<double>())
-            {
-                digitalWrite(function["usage"]["gpio"], function["usage"]["active_state"]);
-                function["state"] = true;
-            }
-            else
-            {
-                digitalWrite(function["usage"]["gpio"], !function["usage"]["active_state"]);
-                function["state"] = false;
-            }
-        }
-        else
-        {
-            digitalWrite(function["usage"]["gpio"], !function["usage"]["active_state"]);
-            function["state"] = false;
-        }
-        if(status.good())
-        {
-            status << function["usage"]["gpio"] << " " << function["state"] << " " << function["name"] << std::endl;
-        }
-        ++i;
-    }
-
-    if(status.is_open())
-    {
-        status.close();
+        status << function.gpio << " " << (functions->getState(i).output ? "true" : "false") << " \"" << function.name
+               << "\"" << std::endl;
     }
+    status.close();
 }
 
+// The functions used by the special handling, looked up once
+struct SpecialFunctions
+{
+    std::optional<size_t> to_houses_combined;
+    std::optional<size_t> solar_to_collectors;
+    std::optional<size_t> solar_from_collectors;
+    std::optional<size_t> heat_pump;
+    std::optional<size_t> use_solar;
+} special;
+
 // Forward declare the special handling function
 void specialHandling();
 
@@ -446,7 +218,6 @@ int main(int argc, char* argv[])
     if(!config_file.is_open())
     {
         LOG_ERROR("Could not open /etc/hass_mqtt.json");
-        stop_threads = true;
         return 1;
     }
     try
@@ -457,7 +228,6 @@ int main(int argc, char* argv[])
     catch(const nlohmann::json::exception& e)
     {
         LOG_ERROR("Error parsing JSON: {}", e.what());
-        stop_threads = true;
         return 1;
     }
     config_file.close();
@@ -467,74 +237,51 @@ int main(int argc, char* argv[])
     if(ret != 0)
     {
         LOG_ERROR("Config file is not valid");
-        stop_threads = true;
         return ret;
     }
 
-    // Read the status file if there is one
-    readStatus();
+    // Validate the functions, and turn them into typed state
+    try
+    {
+        functions = std::make_shared<ConfiguredDevice>(config["functions"]);
+    }
+    catch(const std::invalid_argument& e)
+    {
+        LOG_ERROR("Config file is not valid: {}", e.what());
+        return 1;
+    }
+    special.to_houses_combined = functions->find("To houses combined");
+    special.solar_to_collectors = functions->find("Solar to collectors");
+    special.solar_from_collectors = functions->find("Solar from collectors");
+    special.heat_pump = functions->find("Varmepumpe");
+    special.use_solar = functions->find("Use solar");
+
+    // Restore the values from the state journal, every change is written to it. Without a journal yet, start from
+    // the status file of older versions
+    auto journal_path = getJournalPath();
+    auto state_store = std::make_shared<StateStore>(journal_path);
+    if(!createFolderOf(journal_path) || !state_store->open())
+    {
+        LOG_ERROR("Could not open the state journal {}, changes will not be kept", journal_path);
+    }
+    if(state_store->size() == 0)
+    {
+        readStatus();
+    }
+    functions->setStateStore(state_store);
 
     // Set the pinModes for the gpio pins
     LOG_DEBUG("Setting pin modes");
 
     wiringPiSetup();
-    for(const auto& function : config["functions"])
+    for(size_t i = 0; i < functions->size(); ++i)
     {
-        // If gpio is in the usage, set the pin mode
-        if(function["usage"].contains("gpio"))
+        if(functions->getConfig(i).gpio >= 0)
         {
-            // If the type is not input or analoginput, set the pin to output
-            if(function["usage"]["type"] != "input")
-            {
-                pinMode(function["usage"]["gpio"], OUTPUT);
-                // If pwm, set to !active_state
-                if(function["usage"]["type"] == "pwm")
-                {
-                    digitalWrite(function["usage"]["gpio"], !function["usage"]["active_state"]);
-                }
-                // If switch, set to value xor active_state
-                else if(function["usage"]["type"] == "onoff")
-                {
-                    if(function.contains("value") && function["value"].is_boolean())
-                    {
-                        bool value = function["value"].get<bool>();
-                        // If an active state has been defined and it is false, invert the value
-                        if(function["usage"].contains("active_state") && !function["usage"]["active_state"])
-                        {
-                            value = !value;
-                        }
-                        digitalWrite(function["usage"]["gpio"], value);
-                    }
-                    else
-                    {
-                        digitalWrite(function["usage"]["gpio"], !function["usage"]["active_state"]);
-                    }
-                }
-                continue;
-            }
-            // If the type is input or analoginput, set the pin to input
-            pinMode(function["usage"]["gpio"], INPUT);
-            // If pull is defined and set to up or down, set it
-            if(function["usage"].contains("pull"))
-            {
-                if(function["usage"]["pull"] == "up")
-                {
-                    pullUpDnControl(function["usage"]["gpio"], PUD_UP);
-                }
-                else if(function["usage"]["pull"] == "down")
-                {
-                    pullUpDnControl(function["usage"]["gpio"], PUD_DOWN);
-                }
-                else
-                {
-                    LOG_WARN("Unknown pull type {}", function["usage"]["pull"].get<std::string>());
-                }
-            }
+            pinMode(functions->getConfig(i).gpio, OUTPUT);
         }
     }
-
-    // Start the threads
-    std::thread temp_thread(tempReadingLoop);
+    functions->setOutputWriter([](int gpio, bool level) { digitalWrite(gpio, level); });
 
     // Get a unique ID
     std::string unique_id;
@@ -547,7 +294,6 @@ int main(int argc, char* argv[])
     else
     {
         LOG_ERROR("Could not open /etc/machine-id");
-        stop_threads = true;
         return 1;
     }
     unique_id += "_rpi_relays_1w_temp";
@@ -559,227 +305,109 @@ int main(int argc, char* argv[])
                                                      config.at("password").get<std::string>(),
                                                      unique_id);
 
-    // Create the device
-    auto device = std::make_shared<DeviceBase>("Heating controls", config.at("unique_id").get<std::string>());
+    // The PWM engine switches the relays from the network loop, at the edges of the duty cycles
+    auto pwm = std::make_shared<SlowPwm>(connector);
 
-    // Create the functions
-    int index = 0;
-    for(auto& function : config["functions"])
-    {
-        if(function["type"] == "number")
-        {
-            std::shared_ptr<NumberFunction> func_ptr = std::make_shared<NumberFunction>(
-                function["name"],
-                [index](double state) { controlNumberCallback(index, state); },
-                function["parameters"]["max"].get<double>(),
-                function["parameters"]["min"].get<double>(),
-                function["parameters"]["step"].get<double>());
-            auto value = function["parameters"]["min"].get<double>();
-            if(function.contains("value"))
-            {
-                value = function["value"].get<double>();
-            }
-            else
-            {
-                // Making sure that there at least is a value
-                function["value"] = value;
-            }
-            func_ptr->update(value);
-            device->registerFunction(func_ptr);
-        }
-        else if(function["type"] == "switch")
-        {
-            std::shared_ptr<SwitchFunction> func_ptr =
-                std::make_shared<SwitchFunction>(function["name"],
-                                                 [index](bool state) { controlSwitchCallback(index, state); });
-            bool value = false;
-            if(function.contains("value"))
-            {
-                value = function["value"].get<bool>();
-            }
-            else
-            {
-                // Making sure that there at least is a value
-                function["value"] = value;
-            }
-            func_ptr->update(value);
-            device->registerFunction(func_ptr);
-        }
-        else if(function["type"] == "temp")
-        {
-            std::shared_ptr<SensorFunction<double>> func_ptr =
-                std::make_shared<SensorFunction<double>>(function["name"], getTemperatureSensorAttributes());
-            if(function.contains("value"))
-            {
-                func_ptr->update(function["value"].get<double>());
-            }
-            device->registerFunction(func_ptr);
-        }
-        else
+    // Create the device and its functions. This writes the initial outputs
+    auto device = functions->build("Heating controls", config.at("unique_id").get<std::string>(), pwm);
+
+    // New readings run the special handling. The outputs, the published values and the state journal are updated by
+    // the functions themselves
+    functions->setChangeListener([](size_t index, const FunctionState&) {
+        if(functions->getConfig(index).type == FunctionConfig::Type::TEMPERATURE)
         {
-            LOG_WARN("Unknown function type {}", function["type"].get<std::string>());
-            return 1;
+            specialHandling();
         }
-        ++index;
-    }
+    });
 
     // Register the device
     LOG_TRACE("Registering device");
     connector->registerDevice(device);
     connector->connect();
 
+    // Read the temperature probes in the background, the readings are stored from the network loop
+    auto temperature_reader = std::make_shared<OneWireReader>(connector);
+    temperature_reader->setReadingCallback([](const std::string& sensor, double temp) {
+        if(auto index = functions->findProbe(sensor))
+        {
+            functions->setValue(*index, temp);
+        }
+    });
+    temperature_reader->start(std::chrono::seconds(10));
+
     // Send the status
     LOG_TRACE("Sending intial status");
     device->sendStatus();
 
     // Run the device
-    // Here we loop forever, and basically handle incoming messages and update
-    // the output registers. Every second we also update the outputs accordingly.
-    // Every 2 minutes we check if any of the settings have changed, and if so
-    // we save the state to the status file.
-    int loop_count = 0;
+    // Here we loop forever, and basically handle incoming messages. The functions
+    // update their outputs when they change, and the PWM engine switches the pwm
+    // outputs on its own.
     while(true)
     {
-        ++loop_count;
-
-        // If we have been running for 2 minutes, save the state (if changed)
-        if(loop_count % (2 * 60 * (1000 / tick_size_ms)) == 0)
-        {
-            saveStatus();
-        }
-
-        // Update the number pwm outputs
-        updateNumberPwmOutputs();
-
-        // Check if any values are updated, send the updated values on mqtt
-        int i = 0;
-        for(const auto& function : device->getFunctions())
-        {
-            if(config["functions"][i].contains("value") && config["functions"][i].contains("updated") &&
-               config["functions"][i]["updated"] == true)
-            {
-                config["functions"][i]["updated"] = false;
-                LOG_DEBUG("Updating function {} to {}", function->getName(), config["functions"][i].dump());
-                // For number types, we need to update the value as a double
-                if(config["functions"][i]["type"] == "number")
-                {
-                    std::dynamic_pointer_cast<NumberFunction>(function)->update(
-                        config["functions"][i]["value"].get<double>());
-                }
-                // For switch types, we need to update the value as a bool
-                else if(config["functions"][i]["type"] == "switch")
-                {
-                    std::dynamic_pointer_cast<SwitchFunction>(function)->update(
-                        config["functions"][i]["value"].get<bool>());
-                }
-                // For temperature readings, we need to update the value as a double
-                else if(config["functions"][i]["type"] == "temp")
-                {
-                    std::dynamic_pointer_cast<SensorFunction<double>>(function)->update(
-                        config["functions"][i]["value"].get<double>());
-                }
-            }
-            ++i;
-        }
-
-        specialHandling();
-
-        // LOG_DEBUG("Config: {}", config.dump());
+        // Write the state of the pwm outputs, the PWM engine switches them on its own
+        writePwmStatus();
 
         // Process messages from the MQTT server for 1 second
         connector->processMessages(tick_size_ms);
     }
 }
 
-void specialHandling()
+// Get the value of a function, or NAN if it does not exist or has no value yet
+double getValue(const std::optional<size_t>& index)
 {
-    // Find the "To houses combined" temperature. If above 43, turn off the switch named Varmepumpe. If below 40, turn on the switch named Varmepumpe
-    double to_houses_combined = NAN;
-    for(const auto& function : config["functions"])
+    if(!index || !functions->getState(*index).has_value)
     {
-        if(function["type"] == "temp" && function["name"] == "To houses combined" && function.contains("value") &&
-           function["value"].is_number())
-        {
-            to_houses_combined = function["value"].get<double>();
-            break;
-        }
+        return NAN;
     }
+    return functions->getState(*index).value;
+}
+
+void specialHandling()
+{
+    // Find the "To houses combined" temperature. If above 43, turn off the switch named Varmepumpe. If below 40, turn on the switch named Varmepumpe
+    double to_houses_combined = getValue(special.to_houses_combined);
     if(std::isnan(to_houses_combined))
     {
-        LOG_ERROR("Could not find the temperature sensor named To houses combined");
+        LOG_DEBUG("No temperature from the sensor named To houses combined yet");
     }
-    else
+    else if(special.heat_pump)
     {
         LOG_DEBUG("To houses combined: {}", to_houses_combined);
-        for(auto& function : config["functions"])
-        {
-            if(function["type"] == "switch" && function["name"] == "Varmepumpe")
-            {
-                bool value = function["value"].get<bool>();
-                if(to_houses_combined > 43 && value)
-                {
-                    function["value"] = false;
-                    function["updated"] = true;
-                    LOG_DEBUG("Turning off Varmepumpe");
-                }
-                else if(to_houses_combined < 40 && !value)
-                {
-                    function["value"] = true;
-                    function["updated"] = true;
-                    LOG_DEBUG("Turning off Varmepumpe");
-                }
-                break;
-            }
-        }
-    }
-    // Check if the temperature "Solar to collectors" against "Solar from collectors".
-    // If it is more than 3 degrees warmer turn on the switch called Use solar, unless the To houses combined is above 75
-    double temp_solar_to_collectors = NAN;
-    double temp_solar_from_collectors = NAN;
-    for(const auto& function : config["functions"])
-    {
-        if(function["type"] == "temp" && function["name"] == "Solar to collectors" && function.contains("value") &&
-           function["value"].is_number())
+        bool value = getValue(special.heat_pump) != 0;
+        if(to_houses_combined > 43 && value)
         {
-            temp_solar_to_collectors = function["value"].get<double>();
+            LOG_DEBUG("Turning off Varmepumpe");
+            functions->setValue(*special.heat_pump, false);
         }
-        else if(function["type"] == "temp" && function["name"] == "Solar from collectors" &&
-                function.contains("value") && function["value"].is_number())
+        else if(to_houses_combined < 40 && !value)
         {
-            temp_solar_from_collectors = function["value"].get<double>();
-        }
-        if(!std::isnan(temp_solar_to_collectors) && !std::isnan(temp_solar_from_collectors))
-        {
-            break;
+            LOG_DEBUG("Turning on Varmepumpe");
+            functions->setValue(*special.heat_pump, true);
         }
     }
+    // Check if the temperature "Solar to collectors" against "Solar from collectors".
+    // If it is more than 3 degrees warmer turn on the switch called Use solar, unless the To houses combined is above 75
+    double temp_solar_to_collectors = getValue(special.solar_to_collectors);
+    double temp_solar_from_collectors = getValue(special.solar_from_collectors);
     if(std::isnan(temp_solar_to_collectors) || std::isnan(temp_solar_from_collectors) || std::isnan(to_houses_combined))
     {
-        LOG_ERROR("Could not find the temperature sensors named To houses combined, Solar to collectors and/or Solar "
-                  "from collectors");
+        LOG_DEBUG("No temperatures from the sensors named To houses combined, Solar to collectors and/or Solar "
+                  "from collectors yet");
     }
-    else
+    else if(special.use_solar)
     {
         LOG_DEBUG("Solar to collectors:{} from:{}", temp_solar_to_collectors, temp_solar_from_collectors);
-        for(auto& function : config["functions"])
+        bool value = getValue(special.use_solar) != 0;
+        if(temp_solar_to_collectors - temp_solar_from_collectors > 3 && to_houses_combined < 75 && !value)
         {
-            if(function["type"] == "switch" && function["name"] == "Use solar")
-            {
-                bool value = function["value"].get<bool>();
-                if(temp_solar_to_collectors - temp_solar_from_collectors > 3 && to_houses_combined < 75 && !value)
-                {
-                    function["value"] = true;
-                    function["updated"] = true;
-                    LOG_DEBUG("Turning on Use solar");
-                }
-                else if(temp_solar_to_collectors - temp_solar_from_collectors <= 3 && value)
-                {
-                    function["value"] = false;
-                    function["updated"] = true;
-                    LOG_DEBUG("Turning off Use solar");
-                }
-                break;
-            }
+            LOG_DEBUG("Turning on Use solar");
+            functions->setValue(*special.use_solar, true);
+        }
+        else if(temp_solar_to_collectors - temp_solar_from_collectors <= 3 && value)
+        {
+            LOG_DEBUG("Turning off Use solar");
+            functions->setValue(*special.use_solar, false);
         }
     }
 }
@@ -14,10 +14,13 @@
  * sudo apt-get install wiringpi
  */
 
+#include "hass_mqtt_device/core/configured_device.h"
+#include "hass_mqtt_device/core/device_base.h"
 #include "hass_mqtt_device/core/mqtt_connector.h"
-#include "hass_mqtt_device/functions/number.h"
+#include "hass_mqtt_device/core/slow_pwm.h"
 #include "hass_mqtt_device/logger/logger.hpp"
 
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <memory>
@@ -62,23 +65,12 @@ const int tick_size_ms = 1000;
 // Making the config global to avoid passing it around
 nlohmann::json config;
 
-bool _updated = false;
+// The functions built from the config, with their state
+std::shared_ptr<ConfiguredDevice> functions;
 
-void controlNumberCallback(int index, double number)
-{
-    if(number != config["functions"][index]["value"])
-    {
-        config["functions"][index]["value"] = number;
-        _updated = true;
-        LOG_INFO("number for index {} changed to {}", index, number);
-    }
-    else
-    {
-        LOG_INFO("number for index {} already set to {}", index, number);
-    }
-}
+bool _updated = false;
 
-void updateNumberPwmOutputs();
+void writePwmStatus();
 
 // The main function.
 int main(int argc, char* argv[])
@@ -126,6 +118,17 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    // Validate the functions, and turn them into typed state
+    try
+    {
+        functions = std::make_shared<ConfiguredDevice>(config["functions"]);
+    }
+    catch(const std::invalid_argument& e)
+    {
+        LOG_ERROR("Config file is not valid: {}", e.what());
+        return 1;
+    }
+
     // Read the status file
     {
         LOG_DEBUG("Reading status file");
@@ -133,15 +136,15 @@ int main(int argc, char* argv[])
         std::ifstream status_file(status_file_name);
         if(status_file.good())
         {
-            int i = 0;
+            size_t i = 0;
             try
             {
                 nlohmann::json status_json = nlohmann::json::parse(status_file);
                 for(const auto& function : status_json["functions"])
                 {
-                    if(function.contains("value"))
+                    if(function.contains("value") && i < functions->size())
                     {
-                        config["functions"][i]["value"] = function["value"];
+                        functions->setValue(i, function["value"].get<double>());
                     }
                     ++i;
                 }
@@ -180,42 +183,20 @@ int main(int argc, char* argv[])
                                                      config.at("password").get<std::string>(),
                                                      unique_id);
 
-    // Create the device
-    auto device = std::make_shared<DeviceBase>("Slow PWM outputs");
+    // The PWM engine switches the relays from the network loop, at the edges of the duty cycles
+    auto pwm = std::make_shared<SlowPwm>(connector);
 
-    // Create the functions
-    int index = 0;
-    for(auto& function : config["functions"])
+    // Create the device and its functions
+    for(size_t i = 0; i < functions->size(); ++i)
     {
-        if(function["type"] == "number")
-        {
-            pinMode(function["usage"]["gpio"].get<int>(), OUTPUT);
-            std::shared_ptr<NumberFunction> func_ptr = std::make_shared<NumberFunction>(
-                function["name"],
-                [index](double state) { controlNumberCallback(index, state); },
-                function["parameters"]["max"].get<double>(),
-                function["parameters"]["min"].get<double>(),
-                function["parameters"]["step"].get<double>());
-            auto value = function["parameters"]["min"].get<double>();
-            if(function.contains("value"))
-            {
-                value = function["value"].get<double>();
-            }
-            else
-            {
-                // Making sure that there at least is a value
-                function["value"] = value;
-            }
-            func_ptr->update(value);
-            device->registerFunction(func_ptr);
-        }
-        else
+        if(functions->getConfig(i).gpio >= 0)
         {
-            LOG_WARN("Unknown function type {}", function["type"].get<std::string>());
-            return 1;
+            pinMode(functions->getConfig(i).gpio, OUTPUT);
         }
-        ++index;
     }
+    functions->setOutputWriter([](int gpio, bool level) { digitalWrite(gpio, level); });
+    auto device = functions->build("Slow PWM outputs", "", pwm);
+    functions->setChangeListener([](size_t, const FunctionState&) { _updated = true; });
 
     // Register the device
     connector->registerDevice(device);
@@ -224,136 +205,67 @@ int main(int argc, char* argv[])
     device->sendStatus();
 
     // Run the device
-    // Here we loop forever, and basically handle incoming messages and update
-    // the output registers. Every second we also update the outputs accordingly.
-    // Every 2 minutes we check if any of the settings have changed, and if so
+    // Here we loop forever, and basically handle incoming messages. The PWM engine
+    // switches the outputs on its own, and every second we write their state to a
+    // file for debugging. Every 2 minutes we check if any of the settings have changed, and if so
     // we save the state to the status file.
     int loop_count = 0;
     while(true)
     {
         ++loop_count;
         // If we have been running for 2 minutes, save the state (if changed)
-        if(loop_count % (2 * 60 * (1000 / tick_size_ms)) == 0)
+        if(loop_count % (2 * 60 * (1000 / tick_size_ms)) == 0 && _updated)
         {
-            bool changed = false;
-            for(const auto& function : config["functions"])
+            LOG_DEBUG("Saving state");
+            auto status_file_name = config.at("status_file").get<std::string>();
+            std::ofstream status_file(status_file_name);
+            if(status_file.is_open())
             {
-                if(!function.contains("value_saved") ||
-                   (function.contains("value") && function["value"] != function["value_saved"]))
+                nlohmann::json status_json;
+                for(size_t i = 0; i < functions->size(); ++i)
                 {
-                    changed = true;
-                    break;
+                    nlohmann::json function_json;
+                    function_json["name"] = functions->getConfig(i).name;
+                    function_json["value"] = functions->getState(i).value;
+                    status_json["functions"].push_back(function_json);
                 }
+                status_file << status_json.dump(4);
+                status_file.close();
+                _updated = false;
             }
-            if(changed)
-            {
-                LOG_DEBUG("Saving state");
-                auto status_file_name = config.at("status_file").get<std::string>();
-                std::ofstream status_file(status_file_name);
-                if(status_file.is_open())
-                {
-                    nlohmann::json status_json;
-                    for(auto& function : config["functions"])
-                    {
-                        function["value_saved"] = function["value"];
-                        nlohmann::json function_json;
-                        function_json["name"] = function["name"];
-                        if(function.contains("value"))
-                        {
-                            function_json["value"] = function["value"];
-                        }
-                        status_json["functions"].push_back(function_json);
-                    }
-                    status_file << status_json.dump(4);
-                    status_file.close();
-                }
-                else
-                {
-                    std::cerr << "Could not open status file" << std::endl;
-                }
-            }
-        }
-
-        // Every loop, check if there is an update
-        if(_updated)
-        {
-            // Send status for all functions
-            _updated = false;
-
-            int i = 0;
-            for(const auto& function : device->getFunctions())
+            else
             {
-                if(config["functions"][i].contains("value"))
-                {
-                    LOG_INFO("Updating function {} to {}", function->getName(), config["functions"][i].dump());
-                    // For number types, we need to update the value as a double
-                    if(config["functions"][i]["type"] == "number")
-                    {
-                        std::dynamic_pointer_cast<NumberFunction>(function)->update(
-                            config["functions"][i]["value"].get<double>());
-                    }
-                }
-                ++i;
+                std::cerr << "Could not open status file" << std::endl;
             }
         }
 
-        // Update the outputs
-        updateNumberPwmOutputs();
+        // Write the state of the outputs
+        writePwmStatus();
 
         // Process messages from the MQTT server for 1 second
         connector->processMessages(tick_size_ms);
     }
 }
 
-void updateNumberPwmOutputs()
+void writePwmStatus()
 {
-    static int loop_count = 0;
-    loop_count++;
-
     std::ofstream status("/tmp/hass_mqtt_pwm");
     if(!status.good())
     {
         LOG_WARN("Could not open /tmp/hass_mqtt_pwm");
+        return;
     }
 
-    int i = 0;
-    for(auto& function : config["functions"])
+    for(size_t i = 0; i < functions->size(); ++i)
     {
-        // We only care about number functions here
-        if(function["type"] != "number" || function["usage"]["type"] != "pwm")
+        // We only care about pwm outputs here
+        const auto& function = functions->getConfig(i);
+        if(function.usage != FunctionConfig::Usage::PWM)
         {
             continue;
         }
-        if(function["value"] > 0)
-        {
-            int count_offset = function["usage"]["offset"].get<int>() / tick_size_ms;
-            int period = function["usage"]["period"].get<int>() / tick_size_ms;
-            if((loop_count + count_offset) % period <
-               (function["value"].get<double>() * period) / function["parameters"]["max"].get<double>())
-            {
-                digitalWrite(function["usage"]["gpio"], function["usage"]["active_state"]);
-                function["state"] = true;
-            }
-            else
-            {
-                digitalWrite(function["usage"]["gpio"], !function["usage"]["active_state"]);
-                function["state"] = false;
-            }
-        }
-        else
-        {
-            digitalWrite(function["usage"]["gpio"], !function["usage"]["active_state"]);
-            function["state"] = false;
-        }
-        if(status.good())
-        {
-            status << function["usage"]["gpio"] << " " << function["state"] << " " << function["name"] << std::endl;
-        }
-        ++i;
-    }
-
-    if(status.is_open())
-    {
-        status.close();
+        status << function.gpio << " " << (functions->getState(i).output ? "true" : "false") << " \"" << function.name
+               << "\"" << std::endl;
     }
+    status.close();
 }
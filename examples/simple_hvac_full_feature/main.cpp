@@ -125,6 +125,8 @@ int main(int argc, char* argv[])
 
     auto connector = std::make_shared<MQTTConnector>(ip, port, username, password, unique_id);
     connector->registerDevice(sw);
+    // Start from the setpoints and modes the user had set, not the defaults
+    connector->enableStateRestore();
     connector->connect();
 
     // Run the device
@@ -12,6 +12,7 @@
 #include "hass_mqtt_device/core/mqtt_connector.h"
 #include "hass_mqtt_device/devices/temp_sensor.h"
 #include "hass_mqtt_device/logger/logger.hpp"
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <memory>
@@ -67,19 +68,18 @@ int main(int argc, char* argv[])
     connector->registerDevice(temp);
     connector->connect();
 
+    // Change the temperature every 11 seconds, from the network loop instead of a thread of its own
+    int update_count = 0;
+    connector->callEvery(std::chrono::seconds(11), [temp, &update_count]() {
+        LOG_DEBUG("Update count: {}", update_count);
+        temp->update((update_count * 11 % 200) / 10.0);
+        update_count++;
+    });
+
     // Run the device
-    int loop_count = 0;
     while(1)
     {
-        // Process messages from the MQTT server for 1 second
+        // Process messages from the MQTT server, and run the timers, for 1 second
         connector->processMessages(1000);
-
-        // Every 10 seconds, change the state of the light
-        if(loop_count % 11 == 0)
-        {
-        LOG_DEBUG("Loop count: {}", loop_count);
-            temp->update((loop_count % 200)/10.0);
-        }
-        loop_count++;
     }
 }
@@ -0,0 +1,136 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief How the control callbacks of the functions are run
+ */
+enum class ExecutorMode
+{
+    INLINE, // Run right away on the thread handling the MQTT message, the default
+    DEDICATED_THREAD, // Run one at a time on a single thread of their own
+    WORKER_POOL // Run on a pool of threads, callbacks for the same function never run concurrently
+};
+
+/**
+ * @brief Runs the control callbacks of the functions, so slow hardware handlers
+ * do not have to stall the MQTT loop
+ *
+ * Tasks are posted with a key, normally the function they belong to. Tasks with
+ * the same key are always run one at a time and in order, tasks with different
+ * keys may run concurrently in WORKER_POOL mode.
+ *
+ * @note Unless the mode is INLINE, the callbacks run on other threads than the
+ * network loop. Their publishes are queued by MQTTConnector, and sent by the
+ * thread running the network loop
+ */
+
+class CallbackExecutor
+{
+public:
+    /**
+     * @brief Construct a new CallbackExecutor object
+     *
+     * @param mode How the callbacks are run
+     * @param worker_count The number of threads used in WORKER_POOL mode
+     */
+    explicit CallbackExecutor(ExecutorMode mode = ExecutorMode::INLINE, size_t worker_count = 2);
+
+    /**
+     * @brief Destroy the CallbackExecutor object, running the tasks that are still queued first
+     */
+    ~CallbackExecutor();
+
+    /**
+     * @brief Run the tasks that are still queued, and stop the threads
+     *
+     * Tasks posted by the running tasks are run too. Safe to call more than once, but not from a task of this executor
+     */
+    void shutdown();
+
+    CallbackExecutor(const CallbackExecutor&) = delete;
+    CallbackExecutor& operator=(const CallbackExecutor&) = delete;
+
+    /**
+     * @brief Run a task according to the mode
+     *
+     * @param key Tasks with the same key are run one at a time, in the order they were posted
+     * @param task The task to run
+     * @return true if the task was run or queued, false if the threads have stopped after shutdown()
+     */
+    bool post(const void* key, std::function<void()> task);
+
+    /**
+     * @brief Get the mode of this executor
+     *
+     * @return The mode of this executor
+     */
+    ExecutorMode getMode() const
+    {
+        return m_mode;
+    }
+
+    /**
+     * @brief Get the number of tasks waiting to be run
+     *
+     * @return The number of queued tasks
+     */
+    size_t getQueueDepth() const;
+
+    /**
+     * @brief Get the highest number of tasks that have been waiting at the same time
+     *
+     * @return The high-water mark of the queue depth
+     */
+    size_t getMaxQueueDepth() const;
+
+    /**
+     * @brief Get the number of tasks that have been run
+     *
+     * @return The number of tasks run
+     */
+    size_t getExecutedCount() const
+    {
+        return m_executed;
+    }
+
+private:
+    /**
+     * @brief The queued tasks of one key
+     */
+    struct Strand
+    {
+        std::deque<std::function<void()>> tasks;
+    };
+
+    /**
+     * @brief Run queued tasks until stopped
+     */
+    void workerLoop();
+
+    ExecutorMode m_mode;
+    std::vector<std::thread> m_workers;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+    // A key is in m_strands while it has tasks queued or running, and in m_ready while it is waiting for a worker
+    std::unordered_map<const void*, Strand> m_strands;
+    std::deque<const void*> m_ready;
+    size_t m_queue_depth = 0;
+    size_t m_max_queue_depth = 0;
+    std::atomic<size_t> m_executed{0};
+    bool m_stopping = false;
+    size_t m_running_workers = 0; // Workers that have not returned, they run what is queued before stopping
+};
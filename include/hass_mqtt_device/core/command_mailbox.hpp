@@ -0,0 +1,120 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+/**
+ * @brief Holds the newest pending command of a function, so that bursts of
+ * commands, e.g. from dragging a slider in Home Assistant, are collapsed into
+ * one delivery
+ *
+ * Commands posted while a delivery is already scheduled replace the pending
+ * value. Deliveries are at least the minimum interval apart.
+ */
+
+template<typename T>
+class CommandMailbox
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @brief Construct a new CommandMailbox object
+     *
+     * @param min_interval The minimum time between two deliveries
+     */
+    explicit CommandMailbox(std::chrono::milliseconds min_interval)
+        : m_min_interval(min_interval)
+    {
+    }
+
+    /**
+     * @brief Store a command, replacing any command that has not been delivered yet
+     *
+     * @param value The command
+     * @return true if the caller must schedule a delivery at getDeliveryTime(), false if one is already scheduled
+     */
+    bool post(T value)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_pending)
+        {
+            ++m_coalesced;
+        }
+        m_pending = std::move(value);
+        if(m_delivery_scheduled)
+        {
+            return false;
+        }
+        m_delivery_scheduled = true;
+        return true;
+    }
+
+    /**
+     * @brief Get the command waiting for delivery, without taking it
+     *
+     * @return The newest pending command, or nothing if there is none
+     */
+    std::optional<T> peek() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_pending;
+    }
+
+    /**
+     * @brief Get the earliest time the next delivery may happen
+     *
+     * @return The time of the last delivery plus the minimum interval
+     */
+    Clock::time_point getDeliveryTime() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_last_delivery + m_min_interval;
+    }
+
+    /**
+     * @brief Take the newest command for delivery
+     *
+     * @return The command, or nothing if there is none pending
+     */
+    std::optional<T> take()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_delivery_scheduled = false;
+        if(!m_pending)
+        {
+            return std::nullopt;
+        }
+        m_last_delivery = Clock::now();
+        std::optional<T> value = std::move(m_pending);
+        m_pending.reset();
+        return value;
+    }
+
+    /**
+     * @brief Get the number of commands that were replaced by a newer one before being delivered
+     *
+     * @return The number of dropped commands
+     */
+    size_t getCoalescedCount() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_coalesced;
+    }
+
+private:
+    std::chrono::milliseconds m_min_interval;
+    mutable std::mutex m_mutex;
+    std::optional<T> m_pending;
+    bool m_delivery_scheduled = false;
+    Clock::time_point m_last_delivery{};
+    size_t m_coalesced = 0;
+};
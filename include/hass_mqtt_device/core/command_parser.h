@@ -0,0 +1,143 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+#include <array>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+#include <string_view>
+
+using json = nlohmann::json;
+
+/**
+ * @brief Reads the members of a command payload like {"state":"ON","brightness":128}
+ *
+ * The commands from Home Assistant are small flat objects, so building a json document for each of them is mostly
+ * wasted work. Flat objects with plain strings, numbers, booleans and null are scanned in place without allocating,
+ * and the values are views into the payload. Anything else, like escaped strings or nested values, is handed to
+ * json::parse, so the result is the same either way.
+ *
+ * @note The payload must outlive the parser
+ *
+ * Example usage:
+ * @code{.cpp}
+ * CommandParser command(payload);
+ * if(!command.isValid())
+ * {
+ *     LOG_ERROR("JSON error in payload: {}. Error: {}", payload, command.getError());
+ *     return;
+ * }
+ * bool state = command.getString("state") == "ON";
+ * @endcode
+ */
+
+class CommandParser
+{
+public:
+    /**
+     * @brief Parse a command payload
+     *
+     * @param payload The payload of the command
+     */
+    explicit CommandParser(std::string_view payload);
+
+    /**
+     * @brief Check if the payload is a valid JSON object
+     *
+     * @return true if the payload could be parsed, false otherwise
+     */
+    bool isValid() const
+    {
+        return m_valid;
+    }
+
+    /**
+     * @brief Get the reason the payload could not be parsed
+     *
+     * @return The parse error, empty if the payload is valid
+     */
+    const std::string& getError() const
+    {
+        return m_error;
+    }
+
+    /**
+     * @brief Check if the payload has a member
+     *
+     * @param key The name of the member
+     * @return true if the member exists, false otherwise
+     */
+    bool contains(std::string_view key) const;
+
+    /**
+     * @brief Get a string member
+     *
+     * @param key The name of the member
+     * @return The value, or nothing if the member is missing or not a string
+     */
+    std::optional<std::string_view> getString(std::string_view key) const;
+
+    /**
+     * @brief Get a number member
+     *
+     * @param key The name of the member
+     * @return The value, or nothing if the member is missing or not a number
+     */
+    std::optional<double> getNumber(std::string_view key) const;
+
+    /**
+     * @brief Check if the payload was read without json::parse
+     *
+     * @return true if the payload was scanned in place, false otherwise
+     */
+    bool isScanned() const
+    {
+        return m_scanned;
+    }
+
+private:
+    /**
+     * @brief Scan a flat object in place
+     *
+     * @param payload The payload to scan
+     * @return true if the payload was a flat object that could be scanned, false if it needs json::parse
+     */
+    bool scan(std::string_view payload);
+
+    enum class MemberType
+    {
+        STRING,
+        NUMBER,
+        LITERAL
+    };
+
+    struct Member
+    {
+        std::string_view key;
+        std::string_view value;
+        MemberType type;
+    };
+
+    /**
+     * @brief Find a scanned member, the last one wins like in json::parse
+     *
+     * @param key The name of the member
+     * @return The member, or nullptr if it is missing
+     */
+    const Member* findMember(std::string_view key) const;
+
+    // Commands with more members than this are handed to json::parse
+    static constexpr size_t max_members = 8;
+
+    std::array<Member, max_members> m_members;
+    size_t m_member_count = 0;
+    bool m_scanned = false;
+    bool m_valid = false;
+    json m_document; // Only used when the payload could not be scanned
+    std::string m_error;
+};
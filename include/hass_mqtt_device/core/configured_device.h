@@ -0,0 +1,262 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class DeviceBase;
+class FunctionBase;
+class NumberFunction;
+class SlowPwm;
+class StateStore;
+class SwitchFunction;
+template<typename T>
+class SensorFunction;
+
+/**
+ * @brief The settings of one function in a device config, validated and typed
+ */
+struct FunctionConfig
+{
+    enum class Type
+    {
+        NUMBER,
+        SWITCH,
+        TEMPERATURE
+    };
+
+    enum class Usage
+    {
+        PWM, // A number driving a relay with time-proportioning PWM
+        ANALOG, // A number used by the application itself
+        ONOFF, // A switch driving a relay
+        ONE_WIRE // A temperature read from a 1-wire probe
+    };
+
+    Type type;
+    Usage usage;
+    std::string name;
+
+    // Numbers
+    double min = 0;
+    double max = 100;
+    double step = 1;
+
+    // Outputs
+    int gpio = -1; // -1 when the function has no output
+    bool active_state = true; // The level that switches the output on
+    std::chrono::milliseconds period{0}; // The PWM period
+    std::optional<std::chrono::milliseconds> offset; // The PWM phase, nullopt to spread the channels evenly
+
+    // Temperatures
+    std::string probe_id; // The 1-wire id, e.g. "28-0417503c19ff"
+};
+
+/**
+ * @brief The runtime state of one function
+ */
+struct FunctionState
+{
+    double value = 0; // Switches are 0 or 1
+    bool has_value = false; // Temperatures have no value until the first reading
+    bool output = false; // The state last written to the output, true for on
+};
+
+/**
+ * @brief A device built from a JSON config, with the state of its functions in plain structs
+ *
+ * The config is validated once, and compiled into typed number, switch and temperature sensor functions. After that
+ * the functions are addressed by index, and no JSON is touched while running. Commands from Home Assistant, readings
+ * and values set by the application all go through setValue(), which updates the state, drives the output, publishes
+ * the new value and tells the change listener.
+ *
+ * The config is an array of functions, each like one of these:
+ * @code{.json}
+ * { "type":"number", "name":"Room 1", "parameters":{"min":0, "max":100, "step":1},
+ *   "usage":{"type":"pwm", "gpio":21, "period":600000, "offset":0, "active_state":false} }
+ * { "type":"switch", "name":"Pump", "parameters":{}, "usage":{"type":"onoff", "gpio":22, "active_state":true} }
+ * { "type":"temp", "name":"Return", "parameters":{}, "usage":{"type":"1w", "id":"28-0417503c19ff"} }
+ * @endcode
+ *
+ * Example usage:
+ * @code{.cpp}
+ * auto configured = std::make_shared<ConfiguredDevice>(config["functions"]);
+ * configured->setOutputWriter([](int gpio, bool level) { digitalWrite(gpio, level); });
+ * auto device = configured->build("Heating controls", "heating", pwm);
+ * auto pump = configured->find("Pump");
+ * configured->setStateStore(store);
+ * configured->setChangeListener([](size_t index, const FunctionState& state) { ... });
+ * @endcode
+ *
+ * @note Must be created with std::make_shared. Not thread safe, use it from the thread running the network loop, where
+ * the commands arrive unless the device is given another executor
+ */
+
+class ConfiguredDevice : public std::enable_shared_from_this<ConfiguredDevice>
+{
+public:
+    /**
+     * @brief Construct a new ConfiguredDevice object, validating the config
+     *
+     * @param functions The array of functions of the config
+     * @throws std::invalid_argument if the config is not valid
+     */
+    explicit ConfiguredDevice(const nlohmann::json& functions);
+
+    ConfiguredDevice(const ConfiguredDevice&) = delete;
+    ConfiguredDevice& operator=(const ConfiguredDevice&) = delete;
+
+    /**
+     * @brief Validate the config of one function
+     *
+     * @param function The config of the function
+     * @return The typed config
+     * @throws std::invalid_argument if the config is not valid
+     */
+    static FunctionConfig parseFunction(const nlohmann::json& function);
+
+    /**
+     * @brief Set the function writing the outputs, e.g. digitalWrite()
+     *
+     * The writer is given the level of the pin, the active state of the function is already applied
+     *
+     * @param writer Called with the gpio and the level to write
+     */
+    void setOutputWriter(std::function<void(int gpio, bool level)> writer);
+
+    /**
+     * @brief Get told every time the value of a function changes
+     *
+     * @param listener Called with the index and the new state of the function
+     */
+    void setChangeListener(std::function<void(size_t index, const FunctionState& state)> listener);
+
+    /**
+     * @brief Keep the values of the numbers and switches in a state store, keyed by their names
+     *
+     * The stored values are restored right away, values set before that and not in the store are written to it, and
+     * every change after is written to the store. Temperatures are not stored, they are read again at startup. May be
+     * called before or after build(), and before the device is registered
+     *
+     * @param store The opened state store
+     */
+    void setStateStore(std::shared_ptr<StateStore> store);
+
+    /**
+     * @brief Create the device and its functions, and write the initial outputs
+     *
+     * Values set before this are used as the initial values, e.g. restored from a status file. Numbers without a
+     * value start at their minimum, and switches off.
+     *
+     * @param device_name The name of the device
+     * @param id The id of the device
+     * @param pwm The PWM engine driving the outputs of the pwm numbers. Required if there are any
+     * @return The device, ready to be registered with the connector
+     */
+    std::shared_ptr<DeviceBase> build(const std::string& device_name,
+                                      const std::string& id = "",
+                                      const std::shared_ptr<SlowPwm>& pwm = nullptr);
+
+    /**
+     * @brief Set the value of a function, updating its output and publishing it if it changed
+     *
+     * @param index The index of the function
+     * @param value The new value. Non-zero switches a switch on
+     */
+    void setValue(size_t index, double value);
+
+    /**
+     * @brief Find a function by name
+     *
+     * @param name The name of the function
+     * @return The index of the function, or nullopt if there is none with that name
+     */
+    std::optional<size_t> find(const std::string& name) const;
+
+    /**
+     * @brief Find the temperature function reading a 1-wire probe
+     *
+     * @param probe_id The id of the probe
+     * @return The index of the function, or nullopt if no function reads the probe
+     */
+    std::optional<size_t> findProbe(const std::string& probe_id) const;
+
+    /**
+     * @brief Get the number of functions
+     *
+     * @return The number of functions
+     */
+    size_t size() const
+    {
+        return m_configs.size();
+    }
+
+    /**
+     * @brief Get the config of a function
+     *
+     * @param index The index of the function
+     * @return The typed config of the function
+     */
+    const FunctionConfig& getConfig(size_t index) const
+    {
+        return m_configs.at(index);
+    }
+
+    /**
+     * @brief Get the state of a function
+     *
+     * @param index The index of the function
+     * @return The state of the function
+     */
+    const FunctionState& getState(size_t index) const
+    {
+        return m_states.at(index);
+    }
+
+    /**
+     * @brief Get the function object of a function, once built
+     *
+     * @param index The index of the function
+     * @return The function, or nullptr before build()
+     */
+    std::shared_ptr<FunctionBase> getFunction(size_t index) const;
+
+private:
+    /**
+     * @brief The typed function objects of a function, only the one of its type is set
+     */
+    struct Functions
+    {
+        std::shared_ptr<NumberFunction> number;
+        std::shared_ptr<SwitchFunction> on_off;
+        std::shared_ptr<SensorFunction<double>> sensor;
+    };
+
+    /**
+     * @brief Write the output of a function, applying its active state
+     *
+     * @param index The index of the function
+     * @param on true to switch the output on
+     */
+    void writeOutput(size_t index, bool on);
+
+    std::vector<FunctionConfig> m_configs;
+    std::vector<FunctionState> m_states;
+    std::vector<Functions> m_functions;
+    std::unordered_map<std::string, size_t> m_names;
+    std::unordered_map<std::string, size_t> m_probes;
+    std::function<void(int, bool)> m_output_writer;
+    std::function<void(size_t, const FunctionState&)> m_change_listener;
+    std::shared_ptr<StateStore> m_state_store;
+};
@@ -0,0 +1,263 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+// The library itself is C++17, this header is only available to applications built as C++20
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include "hass_mqtt_device/core/function_base.h"
+#include "hass_mqtt_device/core/mqtt_connector.h"
+#include "hass_mqtt_device/logger/logger.hpp" // For logging
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <string>
+
+/**
+ * @brief A control loop written as a coroutine
+ *
+ * The coroutine starts running right away, and owns itself until it returns. After its first co_await it runs on
+ * the thread running the network loop, so any number of control loops can share that thread instead of sleeping on
+ * threads of their own.
+ *
+ * @note Coroutines waiting for a connector that is destroyed, or for a function whose device is unregistered, are
+ * never resumed
+ *
+ * Example usage:
+ * @code{.cpp}
+ * ControlTask valveLoop(MQTTConnector& connector, std::shared_ptr<SwitchFunction> valve)
+ * {
+ *     while(true)
+ *     {
+ *         auto command = co_await nextCommand(connector, *valve);
+ *         co_await sleepFor(connector, std::chrono::seconds(30)); // Let the motor run
+ *         valve->update(command.payload.find("ON") != std::string::npos);
+ *     }
+ * }
+ * @endcode
+ */
+class ControlTask
+{
+public:
+    struct promise_type
+    {
+        ControlTask get_return_object() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() noexcept
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            try
+            {
+                std::rethrow_exception(std::current_exception());
+            }
+            catch(const std::exception& e)
+            {
+                LOG_ERROR("Control task failed: {}", e.what());
+            }
+            catch(...)
+            {
+                LOG_ERROR("Control task failed with an unknown exception");
+            }
+        }
+    };
+};
+
+/**
+ * @brief Resumes the coroutine at a given time
+ */
+class SleepAwaiter
+{
+public:
+    SleepAwaiter(MQTTConnector& connector, std::chrono::steady_clock::time_point when)
+        : m_connector(connector)
+        , m_when(when)
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        m_connector.callAt(m_when, [handle]() { handle.resume(); });
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+
+private:
+    MQTTConnector& m_connector;
+    std::chrono::steady_clock::time_point m_when;
+};
+
+/**
+ * @brief Wait for a while without blocking the thread
+ *
+ * @param connector The connector whose network loop resumes the coroutine
+ * @param duration How long to wait
+ * @return The awaiter
+ */
+inline SleepAwaiter sleepFor(MQTTConnector& connector, std::chrono::steady_clock::duration duration)
+{
+    return SleepAwaiter(connector, std::chrono::steady_clock::now() + duration);
+}
+
+/**
+ * @brief Wait until a given time without blocking the thread
+ *
+ * @param connector The connector whose network loop resumes the coroutine
+ * @param when The time to wait for
+ * @return The awaiter
+ */
+inline SleepAwaiter sleepUntil(MQTTConnector& connector, std::chrono::steady_clock::time_point when)
+{
+    return SleepAwaiter(connector, when);
+}
+
+/**
+ * @brief A command received by a function
+ */
+struct Command
+{
+    std::string topic;
+    std::string payload;
+};
+
+/**
+ * @brief Resumes the coroutine with the next command for a function
+ */
+class CommandAwaiter
+{
+public:
+    CommandAwaiter(MQTTConnector& connector, const FunctionBase& function)
+        : m_connector(connector)
+        , m_function(function)
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        m_connector.waitForCommand(m_function, [this, handle](const std::string& topic, const std::string& payload) {
+            m_command = Command{topic, payload};
+            handle.resume();
+        });
+    }
+
+    Command await_resume()
+    {
+        return std::move(m_command);
+    }
+
+private:
+    MQTTConnector& m_connector;
+    const FunctionBase& m_function;
+    Command m_command;
+};
+
+/**
+ * @brief Wait for the next command for a function
+ *
+ * The function has processed the command, and called its control callback, before the coroutine is resumed
+ *
+ * @param connector The connector the device of the function is registered with
+ * @param function The function to wait for
+ * @return The awaiter, giving the command
+ */
+inline CommandAwaiter nextCommand(MQTTConnector& connector, const FunctionBase& function)
+{
+    return CommandAwaiter(connector, function);
+}
+
+/**
+ * @brief Resumes the coroutine when the MQTT server has acknowledged a message
+ */
+class PublishAwaiter
+{
+public:
+    PublishAwaiter(MQTTConnector& connector, std::string topic, std::string payload, PublishPolicy policy)
+        : m_connector(connector)
+        , m_topic(std::move(topic))
+        , m_payload(std::move(payload))
+        , m_policy(policy)
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        m_connector.publishRawMessage(
+            m_topic,
+            m_payload,
+            [this, handle](bool acknowledged) {
+                m_acknowledged = acknowledged;
+                // A failed publish is reported right away, possibly before await_suspend returns, so resume from the
+                // loop instead of from here
+                m_connector.callAt(std::chrono::steady_clock::now(), [handle]() { handle.resume(); });
+            },
+            m_policy);
+    }
+
+    bool await_resume() const noexcept
+    {
+        return m_acknowledged;
+    }
+
+private:
+    MQTTConnector& m_connector;
+    std::string m_topic;
+    std::string m_payload;
+    PublishPolicy m_policy;
+    bool m_acknowledged = false;
+};
+
+/**
+ * @brief Publish a message and wait for the MQTT server to acknowledge it
+ *
+ * @param connector The connector to publish with
+ * @param topic The topic to publish to
+ * @param payload The payload to publish
+ * @param policy The QoS and retain flag, not retained by default
+ * @return The awaiter, giving true if the message was acknowledged, false if it failed, the connection was lost or it
+ * was held back, see MQTTConnector::publishRawMessage()
+ */
+inline PublishAwaiter publishAcknowledged(MQTTConnector& connector,
+                                          std::string topic,
+                                          std::string payload,
+                                          PublishPolicy policy = {1, false})
+{
+    return PublishAwaiter(connector, std::move(topic), std::move(payload), policy);
+}
+
+#endif
@@ -7,6 +7,8 @@
 #pragma once
 
 #include "hass_mqtt_device/core/mqtt_connector.h"
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <nlohmann/json.hpp>
 #include <string>
@@ -46,37 +48,51 @@ public:
      *
      * @return The MQTT topic for this device
      */
-    std::string getId() const;
+    const std::string& getId() const;
 
     /**
      * @brief Get the name of this device
      *
      * @return The name of this device
      */
-    std::string getName() const;
+    const std::string& getName() const;
 
     /**
      * @brief Get a clean version of the name of this device
      *
      * @return A cleaned up name of this device
      */
-    std::string getCleanName() const;
+    const std::string& getCleanName() const;
 
     /**
      * @brief Get the unique id of this device
      *
+     * @note Computed when the device is registered with the MQTTConnector
+     *
      * @return The unique id of this device, this includes the connection unique id too
      */
-    std::string getUniqueId() const;
+    const std::string& getUniqueId() const;
 
     /**
      * @brief Get the id_name of this device
      *
      * Used for the MQTT topic by the functions of this device
      *
+     * @note Computed when the device is registered with the MQTTConnector
+     *
      * @return The name of this device
      */
-    std::string getFullId() const;
+    const std::string& getFullId() const;
+
+    /**
+     * @brief Check if this device is registered with a connector that is still alive
+     *
+     * @return true if registered, false otherwise
+     */
+    bool isRegistered() const
+    {
+        return !m_connector.expired();
+    }
 
     /**
      * @brief Get the MQTT topic to subscribe to for this device
@@ -125,17 +141,74 @@ public:
      * @param topic The topic to publish to. This will be concatenated with the
      * device name and base topic
      * @param payload The payload to publish
+     * @param policy The QoS and retain flag
      */
-    void publishMessage(const std::string& topic, const json& payload);
+    void publishMessage(const std::string& topic, const json& payload, PublishPolicy policy = {});
+
+    /**
+     * @brief Publish an already serialized MQTT message
+     *
+     * @param topic The topic to publish to
+     * @param payload The serialized payload to publish
+     * @param policy The QoS and retain flag
+     */
+    void publishRawMessage(const std::string& topic, const std::string& payload, PublishPolicy policy = {});
+
+    /**
+     * @brief Publish a telemetry message that is not retained, buffered while offline if enabled on the connector
+     *
+     * @param topic The topic to publish to
+     * @param payload The serialized payload to publish
+     * @param policy The QoS and retain flag, not retained by default
+     */
+    void publishTelemetry(const std::string& topic, const std::string& payload, PublishPolicy policy = {1, false});
+
+    /**
+     * @brief Run a control callback through the callback executor of the connector
+     *
+     * @param key Callbacks with the same key are run one at a time, in order
+     * @param task The callback to run. Run right away if the device is not registered
+     */
+    void dispatchControl(const void* key, std::function<void()> task);
+
+    /**
+     * @brief Run a control callback through the callback executor of the connector, but not before a given time
+     *
+     * @param key Callbacks with the same key are run one at a time, in order
+     * @param when The earliest time to run the callback
+     * @param task The callback to run. Run right away if the device is not registered
+     */
+    void dispatchControlAt(const void* key, std::chrono::steady_clock::time_point when, std::function<void()> task);
+
+    /**
+     * @brief Get the topic of the device discovery message, used in the PER_DEVICE discovery mode
+     *
+     * @return The discovery topic for this device
+     */
+    std::string getDiscoveryTopic() const;
 
     /**
      * @brief Send the home assistant discovery message for this device
      *
+     * Depending on the discovery mode of the connector, this is one message per function, or one message for the
+     * whole device with the functions as components
+     *
      * @note This method should be called after the device has been registered
      * with the MQTTConnector
      */
     void sendDiscovery();
 
+    /**
+     * @brief Clear the home assistant discovery messages for this device
+     *
+     * Publishes an empty retained message to the discovery topic of every
+     * function, which makes Home Assistant remove the entities
+     *
+     * @note This method should be called while the device is still registered
+     * with the MQTTConnector
+     */
+    void clearDiscovery();
+
     /**
      * @brief Send an update message for this device.
      *
@@ -162,8 +235,10 @@ protected:
 
 private:
     friend void MQTTConnector::registerDevice(std::shared_ptr<DeviceBase> device);
-    void setParentConnector(std::weak_ptr<MQTTConnector> connector)
-    {
-        m_connector = connector;
-    };
+    void setParentConnector(std::weak_ptr<MQTTConnector> connector);
+
+    // Cached identity strings, these are used on every publish and incoming message
+    std::string m_clean_name;
+    std::string m_unique_id; // Set when registered with a connector
+    std::string m_full_id; // Set when registered with a connector
 };
@@ -0,0 +1,27 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+#include <nlohmann/json.hpp>
+#include <string>
+
+using json = nlohmann::json;
+
+/**
+ * @brief Shrink a discovery payload using the key abbreviations Home Assistant accepts
+ *
+ * Known keys are replaced by their abbreviations, including the keys of the device and origin blocks, and topics
+ * starting with the base topic are shortened to start with "~", which is then set to the base topic. Keys without a
+ * known abbreviation are left as they are, so the result is always understood by Home Assistant.
+ *
+ * See https://www.home-assistant.io/integrations/mqtt/#using-abbreviations-and-base-topic
+ *
+ * @param discovery The discovery payload with full keys
+ * @param base_topic The topic prefix to replace with "~", or empty to not use a base topic
+ * @return The abbreviated discovery payload
+ */
+json abbreviateDiscoveryJson(const json& discovery, const std::string& base_topic);
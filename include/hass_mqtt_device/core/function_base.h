@@ -6,9 +6,16 @@
 
 #pragma once
 
+#include "hass_mqtt_device/core/command_mailbox.hpp"
 #include "hass_mqtt_device/core/device_base.h"
+#include "hass_mqtt_device/core/payload_writer.hpp"
+#include "hass_mqtt_device/core/publish_policy.hpp"
+#include <array>
+#include <chrono>
+#include <functional>
 #include <nlohmann/json.hpp>
 #include <string>
+#include <string_view>
 #include <vector>
 
 using json = nlohmann::json;
@@ -51,21 +58,23 @@ public:
      *
      * @return The name of this function
      */
-    std::string getName() const;
+    const std::string& getName() const;
 
     /**
      * @brief Get a clean version of the name of this function
      *
      * @return A cleaned up name of this function
      */
-    std::string getCleanName() const;
+    const std::string& getCleanName() const;
 
     /**
      * @brief Get the unique ID of this function
      *
+     * @note Empty until the parent device is registered with the MQTTConnector
+     *
      * @return The name of this function
      */
-    std::string getId() const;
+    const std::string& getId() const;
 
     /**
      * @brief Get the MQTT topics to subscribe to for this function
@@ -81,6 +90,15 @@ public:
      */
     virtual std::string getDiscoveryTopic() const = 0;
 
+    /**
+     * @brief Get the Home Assistant platform of this function, e.g. "switch"
+     *
+     * Used in device based discovery. The default takes it from the discovery topic
+     *
+     * @return The platform of this function
+     */
+    virtual std::string getPlatform() const;
+
     /**
      * @brief Get the discovery payload for this function
      *
@@ -103,17 +121,177 @@ public:
      */
     virtual void sendStatus() const = 0;
 
+    /**
+     * @brief Get the topics this function publishes its state to, and can restore its state from
+     *
+     * Used by MQTTConnector::enableStateRestore(). The default has none, e.g. for sensors that are measured again
+     *
+     * @return The state topics to restore from
+     */
+    virtual std::vector<std::string> getRestoreTopics() const;
+
+    /**
+     * @brief Restore the state from a retained state message, published before the program was restarted
+     *
+     * The state is set without publishing it, and the control callback is called with the restored value just like
+     * for a command, so the application can apply it. The default does nothing
+     *
+     * @param topic One of the topics from getRestoreTopics()
+     * @param payload The retained payload
+     */
+    virtual void restoreState(const std::string& topic, const std::string& payload);
+
+    /**
+     * @brief Set the QoS and retain flag of the messages published to a kind of topic
+     *
+     * The defaults are QoS 1 and retained for discovery and state, and QoS 1 and not retained for telemetry. Set before
+     * the device is registered with the MQTTConnector. Discovery and state topics that are not retained are lost when
+     * Home Assistant or the broker restarts, and a state that is not retained can not be restored from
+     *
+     * @param kind The kind of topic
+     * @param policy The policy
+     * @throw std::invalid_argument if the QoS is not 0, 1 or 2
+     */
+    void setPublishPolicy(TopicKind kind, PublishPolicy policy);
+
+    /**
+     * @brief Get the QoS and retain flag of the messages published to a kind of topic
+     *
+     * @param kind The kind of topic
+     * @return The policy
+     */
+    PublishPolicy getPublishPolicy(TopicKind kind) const
+    {
+        return m_publish_policies[static_cast<size_t>(kind)];
+    }
+
+    /**
+     * @brief Set the QoS of the subscriptions to the command topics of this function
+     *
+     * Also given to Home Assistant in the discovery message when not 0, so it publishes the commands with it. Set
+     * before the device is registered with the MQTTConnector
+     *
+     * @param qos The QoS, 0 by default
+     * @throw std::invalid_argument if the QoS is not 0, 1 or 2
+     */
+    void setSubscribeQos(int qos);
+
+    /**
+     * @brief Get the QoS of the subscriptions to the command topics of this function
+     *
+     * @return The QoS
+     */
+    int getSubscribeQos() const
+    {
+        return m_subscribe_qos;
+    }
+
 protected:
-    std::string getBaseTopic() const;
+    /**
+     * @brief Get the base MQTT topic of this function, ending with a slash
+     *
+     * @note Empty until the parent device is registered with the MQTTConnector
+     *
+     * @return The base topic of this function
+     */
+    const std::string& getBaseTopic() const;
+
+    /**
+     * @brief Check if a topic is the base topic of this function followed by a sub topic
+     *
+     * @param topic The topic to check
+     * @param sub_topic The sub topic, e.g. "set"
+     * @return true if the topic matches, false otherwise
+     */
+    bool isTopic(const std::string& topic, std::string_view sub_topic) const;
+
+    /**
+     * @brief Publish a serialized state payload to the state topic of this function
+     *
+     * Does nothing until the parent device is registered with the MQTTConnector, which sends the status then
+     *
+     * @param payload The payload, usually formatted with PayloadWriter
+     */
+    void publishState(const std::string& payload) const;
+
+    /**
+     * @brief Publish a serialized state payload to the state topic of this function without retaining it
+     *
+     * Buffered while offline if MQTTConnector::enableOfflineBuffer() is used
+     *
+     * @param payload The payload, usually formatted with PayloadWriter
+     */
+    void publishTelemetryState(const std::string& payload) const;
+
+    /**
+     * @brief Run a control callback through the callback executor of the connector
+     *
+     * Callbacks of the same function are run one at a time, in the order the commands arrived
+     *
+     * @param task The callback to run
+     */
+    void dispatchControl(std::function<void()> task) const;
+
+    /**
+     * @brief Run a control callback through the callback executor of the connector, but not before a given time
+     *
+     * @param when The earliest time to run the callback
+     * @param task The callback to run
+     */
+    void dispatchControlAt(std::chrono::steady_clock::time_point when, std::function<void()> task) const;
+
+    /**
+     * @brief Post a command to a mailbox, and schedule its delivery if none is pending
+     *
+     * Only the newest command is delivered, and not sooner than the minimum interval of the mailbox after the
+     * previous delivery
+     *
+     * @param mailbox The mailbox of this function
+     * @param value The command
+     * @param control_cb The callback receiving the command, called with the value
+     */
+    template<typename T, typename Callback>
+    void dispatchCoalesced(const std::shared_ptr<CommandMailbox<T>>& mailbox, T value, Callback control_cb) const
+    {
+        if(!mailbox->post(std::move(value)))
+        {
+            return;
+        }
+        dispatchControlAt(mailbox->getDeliveryTime(), [mailbox, control_cb]() {
+            if(auto pending = mailbox->take())
+            {
+                control_cb(*pending);
+            }
+        });
+    }
 
     std::string m_function_name;
     std::weak_ptr<DeviceBase> m_parent_device;
 
 private:
-    friend void DeviceBase::registerFunction(std::shared_ptr<FunctionBase> function);
+    friend class DeviceBase;
     void setParentDevice(std::weak_ptr<DeviceBase> parent_device)
     {
         m_parent_device = parent_device;
+        refreshIdentity();
         init();
     };
+
+    /**
+     * @brief Recompute the cached identity strings from the parent device
+     *
+     * Called when the parent device or its connector changes
+     */
+    void refreshIdentity();
+
+    // Cached identity strings, these are used on every publish and incoming message
+    std::string m_clean_name;
+    std::string m_id; // Set when the parent device is registered with a connector
+    std::string m_base_topic; // Set when the parent device is registered with a connector
+    std::string m_state_topic; // Set when the parent device is registered with a connector
+
+    // Indexed by TopicKind
+    std::array<PublishPolicy, 3> m_publish_policies{
+        PublishPolicy{1, true}, PublishPolicy{1, true}, PublishPolicy{1, false}};
+    int m_subscribe_qos = 0;
 };
@@ -7,7 +7,11 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <string_view>
 
 inline std::string getValidHassString(const std::string& value)
 {
@@ -36,3 +40,57 @@ inline std::string getValidHassString(const std::string& value)
 
     return return_value;
 }
+
+/**
+ * @brief Compute the 64 bit FNV-1a hash of a string
+ *
+ * Cheap and good enough to detect if a payload has changed, not for anything security related
+ *
+ * @param value The string to hash
+ * @return The hash of the string
+ */
+inline uint64_t fnv1aHash(std::string_view value)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for(char character : value)
+    {
+        hash ^= static_cast<unsigned char>(character);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Compute the CRC-32 (IEEE 802.3) of a block of data
+ *
+ * Used to detect records torn by a power loss. Pass the CRC of the data before to continue it, so that the CRC of two
+ * blocks in a row is crc32(second, size, crc32(first, size))
+ *
+ * @param data The data
+ * @param size The size of the data in bytes
+ * @param crc The CRC of the data before, 0 to start
+ * @return The CRC of the data
+ */
+inline uint32_t crc32(const void* data, size_t size, uint32_t crc = 0)
+{
+    static const auto table = []() {
+        std::array<uint32_t, 256> table{};
+        for(uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t value = i;
+            for(int bit = 0; bit < 8; ++bit)
+            {
+                value = (value & 1) ? (value >> 1) ^ 0xEDB88320u : value >> 1;
+            }
+            table[i] = value;
+        }
+        return table;
+    }();
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    crc ^= 0xFFFFFFFFu;
+    for(size_t i = 0; i < size; ++i)
+    {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
@@ -0,0 +1,130 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+/**
+ * @brief Bounded lock-free queue for many producers and a single consumer
+ *
+ * Each cell carries a sequence number that tells producers and the consumer whose turn it is, so pushing only needs
+ * one compare-and-swap on the enqueue position and popping needs no read-modify-write at all. The capacity is rounded
+ * up to a power of two.
+ *
+ * @note tryPop() must only be called from one thread at a time
+ */
+
+template<typename T>
+class BoundedMpscQueue
+{
+public:
+    /**
+     * @brief Construct a new BoundedMpscQueue object
+     *
+     * @param capacity The minimum number of elements the queue can hold
+     */
+    explicit BoundedMpscQueue(size_t capacity)
+    {
+        size_t size = 2;
+        while(size < capacity)
+        {
+            size <<= 1;
+        }
+        m_mask = size - 1;
+        m_cells = std::make_unique<Cell[]>(size);
+        for(size_t i = 0; i < size; ++i)
+        {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedMpscQueue(const BoundedMpscQueue&) = delete;
+    BoundedMpscQueue& operator=(const BoundedMpscQueue&) = delete;
+
+    /**
+     * @brief Add an element to the queue. Safe to call from any thread
+     *
+     * @param value The element to add, moved from on success
+     * @return true if added, false if the queue is full
+     */
+    bool tryPush(T&& value)
+    {
+        Cell* cell = nullptr;
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        while(true)
+        {
+            cell = &m_cells[pos & m_mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if(diff == 0)
+            {
+                if(m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if(diff < 0)
+            {
+                // The consumer has not freed this cell yet, so the queue is full
+                return false;
+            }
+            else
+            {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Take the oldest element from the queue. Only call from the consumer thread
+     *
+     * @param value Set to the element if one was available
+     * @return true if an element was taken, false if the queue is empty
+     */
+    bool tryPop(T& value)
+    {
+        Cell& cell = m_cells[m_dequeue_pos & m_mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        if(static_cast<intptr_t>(sequence) - static_cast<intptr_t>(m_dequeue_pos + 1) < 0)
+        {
+            return false;
+        }
+        value = std::move(cell.value);
+        cell.sequence.store(m_dequeue_pos + m_mask + 1, std::memory_order_release);
+        ++m_dequeue_pos;
+        return true;
+    }
+
+    /**
+     * @brief Get the number of elements the queue can hold
+     *
+     * @return The capacity of the queue
+     */
+    size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> m_cells;
+    size_t m_mask;
+    alignas(64) std::atomic<size_t> m_enqueue_pos{0};
+    alignas(64) size_t m_dequeue_pos{0};
+};
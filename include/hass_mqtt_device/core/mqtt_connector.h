@@ -6,22 +6,57 @@
 
 #pragma once
 
+#include "hass_mqtt_device/core/callback_executor.h"
+#include "hass_mqtt_device/core/mpsc_queue.hpp"
+#include "hass_mqtt_device/core/offline_buffer.h"
+#include "hass_mqtt_device/core/publish_policy.hpp"
+#include "hass_mqtt_device/core/timer_wheel.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <memory> // For std::shared_ptr
 #include <mosquitto.h>
+#include <mutex>
 #include <nlohmann/json.hpp>
+#include <random>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 using json = nlohmann::json;
 
 class DeviceBase;
+class FunctionBase;
+
+/**
+ * @brief How the Home Assistant discovery messages are sent
+ */
+enum class DiscoveryMode
+{
+    PER_FUNCTION, // One message per function, each repeating the device info. The default
+    PER_DEVICE // One message per device, with the functions as components. Needs Home Assistant 2024.11 or newer
+};
+
+/**
+ * @brief The state of the connection to the MQTT server
+ */
+enum class ConnectionState
+{
+    DISCONNECTED, // Not connected, and not trying to connect
+    CONNECTING, // Waiting for the server to accept the connection
+    CONNECTED, // Connected, and the topics are subscribed
+    WAITING_TO_RECONNECT // The connection failed or was lost, waiting for the next attempt
+};
 
 /**
  * @brief Class for connecting to an MQTT server and registering devices to
  * listen for their MQTT topics
  *
- * @note This class is not thread-safe, so it should only be used from one
- * thread
+ * @note By default this class is not thread-safe, so it should only be used from
+ * one thread. Call startNetworkThread() to run the network loop on its own thread,
+ * after which messages can be published from any thread
  */
 
 class MQTTConnector : public std::enable_shared_from_this<MQTTConnector>
@@ -43,12 +78,17 @@ public:
                   const std::string& password,
                   const std::string& unique_id);
 
+    /**
+     * @brief Destroy the MQTTConnector object, stopping the network thread if running
+     */
+    ~MQTTConnector();
+
     /**
      * @brief Get the unique id of the connection
      *
      * @return The unique id of the connection
      */
-    std::string getId() const
+    const std::string& getId() const
     {
         return m_unique_id;
     };
@@ -58,15 +98,48 @@ public:
      *
      * @return The unique id of the connection
      */
-    std::string getAvailabilityTopic() const;
+    const std::string& getAvailabilityTopic() const;
+
+    /**
+     * @brief Set the QoS and retain flag of the availability messages, and of the last will
+     *
+     * The availability topic is shared by all devices of the connection, so this is set here rather than per
+     * function. Call before connect()
+     *
+     * @param policy The policy, QoS 1 and retained by default
+     * @throw std::invalid_argument if the QoS is not 0, 1 or 2
+     */
+    void setAvailabilityPolicy(PublishPolicy policy)
+    {
+        validateQos(policy.qos);
+        m_availability_policy = policy;
+    }
+
+    /**
+     * @brief Get the QoS and retain flag of the availability messages
+     *
+     * @return The policy
+     */
+    PublishPolicy getAvailabilityPolicy() const
+    {
+        return m_availability_policy;
+    }
 
     /**
-     * @brief Connect to the MQTT server
+     * @brief Start connecting to the MQTT server
+     *
+     * The connection is made without blocking, and completes in processMessages() or on the network thread. If it
+     * fails or is lost later, it is retried with a jittered exponential backoff until disconnect() is called.
+     *
+     * @note The host name is still resolved by libmosquitto on the calling thread, use an IP address if the name
+     * lookup can be slow
+     *
+     * @return true if the connection attempt was started, false if it failed right away and will be retried
      */
     bool connect();
 
     /**
-     * @brief Disconnect from the MQTT server
+     * @brief Disconnect from the MQTT server, and stop reconnecting
      */
     void disconnect();
 
@@ -77,9 +150,33 @@ public:
      */
     bool isConnected() const;
 
+    /**
+     * @brief Get the state of the connection to the MQTT server
+     *
+     * @return The connection state
+     */
+    ConnectionState getConnectionState() const
+    {
+        return m_connection_state;
+    }
+
+    /**
+     * @brief Set how long to wait between attempts to reconnect to the MQTT server
+     *
+     * The wait doubles after every failed attempt, from the shortest to the longest wait. A random part of up to half
+     * the wait is taken off, so devices that lost the server at the same time do not all come back at once
+     *
+     * @param min_delay The wait after the first failed attempt, 1 second by default
+     * @param max_delay The longest wait, 30 seconds by default
+     */
+    void setReconnectDelay(std::chrono::milliseconds min_delay, std::chrono::milliseconds max_delay);
+
     /**
      * @brief Register a device to listen for its MQTT topics
      *
+     * If already connected, only the topics of this device are subscribed to, and only its discovery and status
+     * messages are sent
+     *
      * @param device The device to register
      */
     void registerDevice(std::shared_ptr<DeviceBase> device);
@@ -87,6 +184,9 @@ public:
     /**
      * @brief Unregister a device to stop listening for its MQTT topics
      *
+     * If connected, the topics of this device are unsubscribed from, and its discovery messages are cleared so Home
+     * Assistant removes its entities
+     *
      * @param device_name The device to unregister
      */
     void unregisterDevice(const std::string& device_name);
@@ -102,7 +202,9 @@ public:
      * @brief Process incoming MQTT messages. Needs to be called regularly with a
      * timeout
      *
-     * @note This method should be called in the main loop
+     * @note This method should be called in the main loop. From the first call, the calling thread owns the mosquitto
+     * instance, and publishes from other threads, like control callbacks run by a WORKER_POOL executor, are queued and
+     * sent from the next call
      *
      * @param timeout The timeout in milliseconds
      * @param exit_on_event If true, the method will return immediately if a
@@ -110,20 +212,709 @@ public:
      */
     void processMessages(int timeout, bool exit_on_event = false);
 
+    /**
+     * @brief Get the socket of the connection, for driving the connector from an external event loop
+     *
+     * Instead of calling processMessages(), an application with its own event loop (epoll, poll, libuv, ...) can
+     * wait on this socket, call onReadable() and onWritable() when it is ready, and call onTick() when the timeout
+     * from getNextTimeout() expires or getWakeFd() is readable. Do not mix this with processMessages() or
+     * startNetworkThread().
+     *
+     * @note The socket changes when the connector reconnects, and is -1 while not connected. Check it again after
+     * each call to the hooks, and update the event loop registration when it changes
+     *
+     * Example usage:
+     * @code{.cpp}
+     * connector->connect();
+     * while(running)
+     * {
+     *     int socket = connector->getSocket();
+     *     // Register the socket for reading, and for writing if connector->wantsWrite()
+     *     // Register connector->getWakeFd() for reading, it does not change
+     *     // Wait for events with the timeout from connector->getNextTimeout()
+     *     if(readable) connector->onReadable();
+     *     if(writable) connector->onWritable();
+     *     connector->onTick();
+     * }
+     * @endcode
+     *
+     * @return The socket, or -1 if there is none
+     */
+    int getSocket() const;
+
+    /**
+     * @brief Get the descriptor that becomes readable when another thread queues work for the network loop
+     *
+     * Timers added with callAt() or callEvery(), tasks and publishes from other threads make it readable, so an
+     * external event loop can call onTick() right away instead of when its timeout expires. onTick() clears it.
+     *
+     * @return The descriptor, or -1 if it could not be created
+     */
+    int getWakeFd() const
+    {
+        return m_wake_fd;
+    }
+
+    /**
+     * @brief Check if the connector has data waiting to be written to the socket
+     *
+     * @return true if the event loop should wait for the socket to be writable, false otherwise
+     */
+    bool wantsWrite() const;
+
+    /**
+     * @brief Read from the socket and handle the incoming messages. Call when the socket is readable
+     */
+    void onReadable();
+
+    /**
+     * @brief Write pending data to the socket. Call when the socket is writable
+     */
+    void onWritable();
+
+    /**
+     * @brief Run the timed work of the connector: keepalive pings, retries, reconnects and deferred tasks
+     *
+     * Call when the timeout from getNextTimeout() expires, and preferably after every event loop iteration
+     */
+    void onTick();
+
+    /**
+     * @brief Get how long the event loop may wait before onTick() must be called
+     *
+     * @return The timeout in milliseconds, at most one second so keepalive pings are sent in time
+     */
+    int getNextTimeout() const;
+
+    /**
+     * @brief Run the network loop on a dedicated thread
+     *
+     * After this call, publishing from any thread goes through a bounded lock-free queue that is drained by the
+     * network thread, so publishers never block on the socket. Incoming messages, and with them the control
+     * callbacks of the functions, are handled on the network thread. processMessages() then only sleeps for the
+     * given timeout, so existing main loops keep working.
+     *
+     * @param publish_queue_size The maximum number of queued publishes. Publishes are dropped if the queue is full
+     * @param loop_interval_ms The longest time the network thread waits on the socket before draining the queue
+     * @return true if the thread was started, false if it was already running
+     */
+    bool startNetworkThread(size_t publish_queue_size = 1024, int loop_interval_ms = 10);
+
+    /**
+     * @brief Stop the network thread started with startNetworkThread()
+     */
+    void stopNetworkThread();
+
+    /**
+     * @brief Get the number of publishes dropped because the publish queue was full
+     *
+     * @return The number of dropped publishes
+     */
+    size_t getDroppedPublishCount() const
+    {
+        return m_dropped_publishes;
+    }
+
+    /**
+     * @brief Publish a telemetry message, like a sensor reading
+     *
+     * Unlike publishRawMessage(), the message is not retained by the broker by default, and with enableOfflineBuffer()
+     * it is kept while the connection is down, and published after the next connect. Safe to call from any thread
+     *
+     * @param topic The topic to publish to
+     * @param payload The serialized payload
+     * @param policy The QoS and retain flag, not retained by default
+     */
+    void publishTelemetry(const std::string& topic, const std::string& payload, PublishPolicy policy = {1, false});
+
+    /**
+     * @brief Keep telemetry messages published while the connection is down, and replay them after reconnecting
+     *
+     * Only messages from publishTelemetry() are buffered. Retained messages, like states and discovery, are sent again
+     * on connect anyway. The messages are kept in memory up to a byte limit, and then moved to a spill file if one is
+     * given. When the buffer is full, the oldest messages are dropped. Messages left in the spill file are replayed
+     * after a restart of the program too.
+     *
+     * After a connect, the buffered messages are published in order at a limited rate, so the broker and the network
+     * are not flooded. New telemetry waits behind them.
+     *
+     * @param max_memory_bytes The most bytes of topics and payloads to keep in memory
+     * @param spill_file The path of the spill file, or empty to only keep messages in memory
+     * @param spill_file_size The size of the spill file in bytes
+     * @param replay_per_second The most buffered messages to publish per second after a connect
+     */
+    void enableOfflineBuffer(size_t max_memory_bytes = 256 * 1024,
+                             const std::string& spill_file = "",
+                             size_t spill_file_size = 1024 * 1024,
+                             size_t replay_per_second = 50);
+
+    /**
+     * @brief Get the number of telemetry messages waiting in the offline buffer
+     *
+     * @return The number of buffered messages
+     */
+    size_t getBufferedPublishCount() const
+    {
+        return m_buffered_publishes;
+    }
+
+    /**
+     * @brief Set how the discovery messages are sent
+     *
+     * Takes effect the next time discovery messages are sent. Retained messages of the other mode are not cleared,
+     * so call DeviceBase::clearDiscovery() before switching mode on a running installation
+     *
+     * @param mode The discovery mode
+     */
+    void setDiscoveryMode(DiscoveryMode mode)
+    {
+        m_discovery_mode = mode;
+    }
+
+    /**
+     * @brief Get how the discovery messages are sent
+     *
+     * @return The discovery mode
+     */
+    DiscoveryMode getDiscoveryMode() const
+    {
+        return m_discovery_mode;
+    }
+
+    /**
+     * @brief Send discovery messages with abbreviated keys and a "~" base topic
+     *
+     * Home Assistant accepts abbreviated keys like "stat_t" for "state_topic", which makes discovery payloads a
+     * lot smaller. Off by default, since the full keys are easier to read when debugging. Takes effect the next
+     * time discovery messages are sent
+     *
+     * @param compact true to send compact discovery messages, false for full keys
+     */
+    void setCompactDiscovery(bool compact)
+    {
+        m_compact_discovery = compact;
+    }
+
+    /**
+     * @brief Check if discovery messages are sent with abbreviated keys
+     *
+     * @return true if compact discovery is enabled, false otherwise
+     */
+    bool isCompactDiscovery() const
+    {
+        return m_compact_discovery;
+    }
+
+    /**
+     * @brief Skip republishing discovery messages that have not changed
+     *
+     * A hash of every discovery payload sent is kept, so reconnects only publish the discovery messages that
+     * changed. With a state file the hashes survive restarts of the program.
+     *
+     * The hashes only tell what was sent, not what the broker still has. With a verification timeout, the
+     * discovery topics of unchanged payloads are subscribed to, and the retained message the broker sends back is
+     * compared to the payload. The payload is republished if it differs, or if nothing arrives within the timeout.
+     * Only use a zero timeout if the broker is known to keep retained messages across restarts.
+     *
+     * @param state_file A file to keep the hashes in, or empty to only keep them in memory
+     * @param verification_timeout How long to wait for the retained message from the broker, zero to trust the hashes
+     */
+    void enableDiscoveryCache(const std::string& state_file = "",
+                              std::chrono::milliseconds verification_timeout = std::chrono::milliseconds(2000));
+
+    /**
+     * @brief Get the number of discovery messages that were not republished because they had not changed
+     *
+     * @return The number of skipped discovery messages
+     */
+    size_t getSkippedDiscoveryCount() const
+    {
+        return m_skipped_discoveries;
+    }
+
+    /**
+     * @brief Publish a Home Assistant discovery message
+     *
+     * Used by DeviceBase::sendDiscovery(). Skips the publish if the discovery cache is enabled and the payload has
+     * not changed. Safe to call from any thread
+     *
+     * @param topic The discovery topic
+     * @param payload The serialized discovery payload. An empty payload removes the discovery message
+     * @param policy The QoS and retain flag. Discovery messages that are not retained bypass the discovery cache
+     */
+    void publishDiscovery(const std::string& topic, const std::string& payload, PublishPolicy policy = {});
+
+    /**
+     * @brief Restore the state of the functions from their retained state messages when first connected
+     *
+     * Without this, a restarted program publishes the default values of its functions, like the setpoints of an hvac,
+     * before it knows what the user had set. With it, the state topics from FunctionBase::getRestoreTopics() are
+     * subscribed to on the first connection, and the retained messages the broker sends back are handed to
+     * FunctionBase::restoreState(). Publishes to those topics are held back until all of them have arrived or the
+     * timeout has passed. Then they are unsubscribed from, and the status of all devices is sent.
+     *
+     * Call before connect(). Topics without a retained message keep the values set by the application
+     *
+     * @param timeout How long to wait for the retained messages
+     */
+    void enableStateRestore(std::chrono::milliseconds timeout = std::chrono::milliseconds(2000));
+
+    /**
+     * @brief Check if the state is still being restored from the retained messages
+     *
+     * @return true until the restore started by enableStateRestore() is done, false otherwise
+     */
+    bool isRestoringState() const
+    {
+        return m_restoring_state;
+    }
+
+    /**
+     * @brief Suppress publishes that would not change the retained message on the broker
+     *
+     * A hash of the last payload published to each topic is kept, and a publish with the same payload as last time
+     * is skipped. The cache is cleared on every connect, so everything is sent again after a reconnect.
+     *
+     * @param refresh_interval Publish unchanged payloads anyway when this long has passed since they were last
+     * sent. Zero to never refresh
+     */
+    void enablePublishDeduplication(std::chrono::milliseconds refresh_interval = std::chrono::milliseconds(0));
+
+    /**
+     * @brief Stop suppressing unchanged publishes
+     */
+    void disablePublishDeduplication();
+
+    /**
+     * @brief Get the number of publishes skipped because the payload had not changed
+     *
+     * @return The number of suppressed publishes
+     */
+    size_t getSuppressedPublishCount() const
+    {
+        return m_suppressed_publishes;
+    }
+
+    /**
+     * @brief Set the executor that runs the control callbacks of the functions
+     *
+     * Without an executor, or with an INLINE one, the control callbacks run on the thread handling the incoming
+     * message, so a slow callback delays all other MQTT traffic. With other executors, the publishes of the callbacks
+     * are queued to the thread running the network loop.
+     *
+     * @param executor The executor to use, or nullptr to run the callbacks inline
+     */
+    void setCallbackExecutor(std::shared_ptr<CallbackExecutor> executor);
+
+    /**
+     * @brief Get the executor that runs the control callbacks of the functions
+     *
+     * @return The executor, or nullptr if the callbacks are run inline
+     */
+    std::shared_ptr<CallbackExecutor> getCallbackExecutor() const;
+
+    /**
+     * @brief Run a control callback through the callback executor
+     *
+     * @param key Callbacks with the same key are run one at a time, in order
+     * @param task The callback to run
+     */
+    void dispatchControl(const void* key, std::function<void()> task);
+
+    /**
+     * @brief Run a task on the thread running the network loop at a later time
+     *
+     * The task is run from processMessages(), onTick(), or the network thread if started, at or shortly after the
+     * given time. Timers are kept in a timing wheel with a 10 ms tick, so a task runs at most one tick late plus
+     * whatever the loop is busy with. Tasks due at the same time run in the order they were added. Safe to call from
+     * any thread, a loop waiting for the socket is woken up.
+     *
+     * @param when The time to run the task
+     * @param task The task to run
+     * @return The id of the timer, for cancelTimer()
+     */
+    TimerId callAt(std::chrono::steady_clock::time_point when, std::function<void()> task);
+
+    /**
+     * @brief Run a task on the thread running the network loop at a fixed interval
+     *
+     * Use this for periodic work like polling sensors, instead of a thread of its own. The task first runs one
+     * interval from now. The interval keeps its phase, and runs that are missed because the loop was busy are
+     * skipped rather than run in a burst. Safe to call from any thread.
+     *
+     * Example usage:
+     * @code{.cpp}
+     * connector->callEvery(std::chrono::seconds(10), [sensor]() { sensor->update(readTemperature()); });
+     * @endcode
+     *
+     * @param interval How often to run the task, must be above zero
+     * @param task The task to run
+     * @return The id of the timer, for cancelTimer()
+     */
+    TimerId callEvery(std::chrono::steady_clock::duration interval, std::function<void()> task);
+
+    /**
+     * @brief Stop a task added with callAt() or callEvery() from running
+     *
+     * A task that is already running is not interrupted. A periodic task may cancel itself. Safe to call from any
+     * thread.
+     *
+     * @param id The id of the timer
+     * @return true if the timer was cancelled, false if it had already run or been cancelled
+     */
+    bool cancelTimer(TimerId id);
+
     /**
      * @brief Send a message to the MQTT server
      *
      * @param topic The topic to publish to
      * @param payload The payload to publish
+     * @param policy The QoS and retain flag
+     */
+    void publishMessage(const std::string& topic, const json& payload, PublishPolicy policy = {});
+
+    /**
+     * @brief Send a message with an already serialized payload to the MQTT server
+     *
+     * @param topic The topic to publish to
+     * @param payload The payload to publish. An empty payload clears the retained message on the topic
+     * @param policy The QoS and retain flag
+     */
+    void publishRawMessage(const std::string& topic, const std::string& payload, PublishPolicy policy = {});
+
+    /**
+     * @brief Send a message, and get told when the MQTT server has acknowledged it
+     *
+     * The message is always sent, publish deduplication does not apply to it
+     *
+     * @param topic The topic to publish to
+     * @param payload The payload to publish
+     * @param on_acknowledged Called on the thread running the network loop with true when the server acknowledged
+     * the message (PUBACK, or PUBCOMP for QoS 2), or false if the publish failed, the connection was lost first, or
+     * the message was held back because the state is being restored from the topic. With QoS 0 there is no
+     * acknowledgement, and true is reported right away once the message was handed to mosquitto
+     * @param policy The QoS and retain flag, not retained by default
+     */
+    void publishRawMessage(const std::string& topic,
+                           const std::string& payload,
+                           std::function<void(bool)> on_acknowledged,
+                           PublishPolicy policy = {1, false});
+
+    /**
+     * @brief Get told about the next command for a function, once
+     *
+     * The handler is called on the thread running the network loop, right after the function has processed the
+     * command. Safe to call from any thread.
+     *
+     * @param function The function to wait for
+     * @param handler Called with the topic and payload of the command
      */
-    void publishMessage(const std::string& topic, const json& payload);
+    void waitForCommand(const FunctionBase& function,
+                        std::function<void(const std::string& topic, const std::string& payload)> handler);
 
 private:
+    /**
+     * @brief An entry in the topic routing table, mapping a subscribed topic to
+     * the function that owns it
+     */
+    struct TopicRoute
+    {
+        std::string topic;
+        std::weak_ptr<FunctionBase> function;
+    };
+
+    /**
+     * @brief A publish waiting in the queue for the network thread
+     */
+    struct PendingPublish
+    {
+        std::string topic;
+        std::string payload;
+        PublishPolicy policy;
+        bool telemetry = false; // Published with publishTelemetry()
+    };
+
+    /**
+     * @brief What was last published to a topic, for deduplication
+     */
+    struct PublishRecord
+    {
+        uint64_t hash;
+        std::chrono::steady_clock::time_point sent;
+    };
+
+    /**
+     * @brief A discovery message waiting for the broker to send back its retained copy
+     */
+    struct DiscoveryVerification
+    {
+        std::string payload;
+        uint64_t hash;
+        uint64_t id; // Tells the timeout of this verification from the ones of earlier verifications of the topic
+        PublishPolicy policy;
+    };
+
+    /**
+     * @brief Run the network loop, implementing processMessages
+     *
+     * @param timeout The timeout in milliseconds
+     * @param exit_on_event If true, return after the first loop iteration
+     */
+    void runLoop(int timeout, bool exit_on_event);
+
+    /**
+     * @brief Create the mosquitto instance, once for the lifetime of the connector
+     *
+     * @return true if the instance exists, false if it could not be created
+     */
+    bool createMosquitto();
+
+    /**
+     * @brief Start a non-blocking connection attempt
+     *
+     * @return true if the attempt was started, false if it failed right away
+     */
+    bool startConnect();
+
+    /**
+     * @brief Start connection attempts that are due, and give up on attempts that take too long
+     *
+     * @return The time of the next connection event to wait for, or time_point::max() if there is none
+     */
+    std::chrono::steady_clock::time_point serviceConnection();
+
+    /**
+     * @brief Wait for the next connection attempt after a failed or lost connection
+     */
+    void scheduleReconnect();
+
+    /**
+     * @brief Handle the result of a mosquitto loop call, reconnecting if the connection failed
+     *
+     * @param rc The result of the call
+     */
+    void checkLoopResult(int rc);
+
+    /**
+     * @brief Wait for the socket, or for another thread to queue work, and handle the socket
+     *
+     * Does what mosquitto_loop() does, but also wakes up from wakeLoop()
+     *
+     * @param timeout The longest time to wait
+     */
+    void waitForNetwork(std::chrono::milliseconds timeout);
+
+    /**
+     * @brief Wake up the thread running the network loop, if called from another thread
+     */
+    void wakeLoop();
+
+    /**
+     * @brief Take the wake up signal, before running the work queued by other threads
+     */
+    void clearWake();
+
+    /**
+     * @brief Check if the calling thread may use the mosquitto instance directly
+     *
+     * @return true if no thread has run the network loop yet, or if called from the thread running it
+     */
+    bool onNetworkThread() const;
+
+    /**
+     * @brief Make the calling thread the one running the network loop, unless the network thread is running
+     *
+     * Called by the caller driven loops, processMessages() and the event loop hooks. Publishes from other threads are
+     * queued from then on
+     */
+    void claimLoopThread();
+
+    /**
+     * @brief Run a task on the network thread, or right away if onNetworkThread()
+     *
+     * @param task The task to run
+     */
+    void runOnNetworkThread(std::function<void()> task);
+
+    /**
+     * @brief Run the tasks and publishes queued for the network thread
+     */
+    void drainNetworkQueues();
+
+    /**
+     * @brief Run the tasks added with callAt() and callEvery() that are due
+     *
+     * @return The time the next task is due, or time_point::max() if there is none
+     */
+    std::chrono::steady_clock::time_point runDeferredTasks();
+
+    /**
+     * @brief Hand a message to mosquitto. Must only be called when onNetworkThread()
+     *
+     * @param topic The topic to publish to
+     * @param payload The payload to publish
+     * @param mid Set to the message ID if handed to mosquitto, and left alone otherwise. Messages that ask for it are
+     * never skipped as duplicates
+     * @param policy The QoS and retain flag. Messages that are not retained are never skipped as duplicates
+     * @return true if handed to mosquitto, skipped as a duplicate or held back, false if the publish failed
+     */
+    bool sendPublish(const std::string& topic,
+                     const std::string& payload,
+                     int* mid = nullptr,
+                     PublishPolicy policy = {});
+
+    /**
+     * @brief Publish a telemetry message, or buffer it while offline. Must only be called when onNetworkThread()
+     *
+     * @param topic The topic to publish to
+     * @param payload The payload to publish
+     * @param policy The QoS and retain flag
+     */
+    void sendTelemetry(const std::string& topic, const std::string& payload, PublishPolicy policy);
+
+    /**
+     * @brief Start replaying the offline buffer, unless already replaying
+     */
+    void startOfflineReplay();
+
+    /**
+     * @brief Publish the next batch of buffered messages, stopping the replay when done or disconnected
+     */
+    void replayOfflineBuffer();
+
+    /**
+     * @brief Implement publishDiscovery() on the network thread
+     *
+     * @param topic The discovery topic
+     * @param payload The serialized discovery payload
+     * @param policy The QoS and retain flag
+     */
+    void sendDiscoveryPayload(const std::string& topic, const std::string& payload, PublishPolicy policy);
+
+    /**
+     * @brief Publish a discovery payload and remember its hash
+     *
+     * @param topic The discovery topic
+     * @param payload The serialized discovery payload
+     * @param hash The hash of the payload
+     * @param policy The QoS and retain flag
+     */
+    void publishAndRememberDiscovery(const std::string& topic,
+                                     const std::string& payload,
+                                     uint64_t hash,
+                                     PublishPolicy policy);
+
+    /**
+     * @brief Check a retained message against a pending discovery verification
+     *
+     * @param topic The topic of the message
+     * @param payload The payload of the message
+     * @return true if the message was for a discovery verification, false otherwise
+     */
+    bool handleDiscoveryVerification(const std::string& topic, std::string_view payload);
+
+    /**
+     * @brief Republish a discovery message if its retained copy did not arrive in time
+     *
+     * @param topic The discovery topic
+     * @param id The id of the verification that timed out
+     */
+    void onDiscoveryVerificationTimeout(const std::string& topic, uint64_t id);
+
+    /**
+     * @brief Write the discovery hashes to the state file, at the next loop iteration
+     */
+    void scheduleDiscoveryStateSave();
+
+    /**
+     * @brief Read the discovery hashes from the state file
+     */
+    void loadDiscoveryState();
+
+    /**
+     * @brief Write the discovery hashes to the state file
+     */
+    void saveDiscoveryState();
+
+    /**
+     * @brief Subscribe to the state topics of the registered functions to restore them from the retained messages
+     */
+    void startStateRestore();
+
+    /**
+     * @brief Hand a retained state message to the function restoring its state from it
+     *
+     * @param topic The topic of the message
+     * @param payload The payload of the message
+     * @return true if the message was for a state restore, false otherwise
+     */
+    bool handleStateRestore(const std::string& topic, const std::string& payload);
+
+    /**
+     * @brief Stop waiting for retained state messages, and send the status of all devices
+     */
+    void finishStateRestore();
+
+    /**
+     * @brief Send the status of all registered devices after connecting, without buffering telemetry
+     *
+     * Must only be called when onNetworkThread(), with the devices mutex held
+     */
+    void sendConnectStatus();
+
+    /**
+     * @brief Check if publishes to a topic are held back until the state is restored
+     *
+     * @param topic The topic to publish to
+     * @return true if the topic is a state topic a function restores from, false otherwise
+     */
+    bool isStateRestoreTopic(const std::string& topic) const;
+
+    /**
+     * @brief Check if a publish would repeat the last payload sent to the topic, and remember it if not
+     *
+     * @param topic The topic to publish to
+     * @param payload The payload to publish
+     * @return true if the publish can be skipped, false otherwise
+     */
+    bool isDuplicatePublish(const std::string& topic, const std::string& payload);
+
     /**
      * @brief Send a last will and testament message to the MQTT server
      */
     void publishLWT();
 
+    /**
+     * @brief Subscribe to the topics of all functions of a device, and add them
+     * to the topic routing table
+     *
+     * @param device The device to subscribe for
+     * @return true if all topics were subscribed, false otherwise
+     */
+    bool subscribeDevice(const std::shared_ptr<DeviceBase>& device);
+
+    /**
+     * @brief Unsubscribe from the topics of all functions of a device, and remove
+     * them from the topic routing table
+     *
+     * @param device The device to unsubscribe for
+     */
+    void unsubscribeDevice(const std::shared_ptr<DeviceBase>& device);
+
+    /**
+     * @brief Tell everyone waiting for a publish acknowledgement that it will not come
+     */
+    void failPendingAcknowledgements();
+
+    /**
+     * @brief Callback for messages acknowledged by the MQTT server, implementing on_publish
+     *
+     * @param mosq The mosquitto instance
+     * @param obj The user data
+     * @param mid The message ID
+     */
+    static void publishCallback(mosquitto* mosq, void* obj, int mid);
+
     /**
      * @brief Callback for incoming MQTT messages, implementing the on_message
      *
@@ -180,7 +971,78 @@ private:
     std::string m_username;
     std::string m_password;
     std::string m_unique_id;
-    bool m_is_connected = false;
+    std::string m_availability_topic;
+    PublishPolicy m_availability_policy;
+    std::atomic<ConnectionState> m_connection_state{ConnectionState::DISCONNECTED};
+    // Guards the registered devices and the routing table, recursive since control callbacks may register devices
+    mutable std::recursive_mutex m_devices_mutex;
     std::vector<std::shared_ptr<DeviceBase>> m_registered_devices; // List of registered devices using smart pointers
+    // Maps a subscribed topic to its owner. The key views the topic string owned by the route, so lookups from the
+    // raw mosquitto topic do not allocate
+    std::unordered_map<std::string_view, std::unique_ptr<TopicRoute>> m_topic_routes;
     mosquitto* m_mosquitto;
+
+    // Connection state machine, only touched from the thread running the network loop
+    bool m_stay_disconnected = false; // Set by disconnect(), so the loop does not reconnect
+    bool m_connect_configured = false; // Set once mosquitto knows the server, after which reconnects are used
+    std::chrono::steady_clock::time_point m_connect_started;
+    std::chrono::steady_clock::time_point m_next_connect_attempt;
+    std::chrono::milliseconds m_reconnect_min_delay;
+    std::chrono::milliseconds m_reconnect_max_delay;
+    unsigned int m_reconnect_attempt = 0;
+    std::minstd_rand m_reconnect_random;
+
+    // Threaded network loop
+    std::thread m_network_thread;
+    std::atomic<bool> m_network_thread_running{false};
+    std::atomic<std::thread::id> m_network_thread_id; // The thread running the network loop, also when caller driven
+    std::unique_ptr<BoundedMpscQueue<PendingPublish>> m_publish_queue;
+    std::atomic<size_t> m_dropped_publishes{0};
+    std::mutex m_network_tasks_mutex;
+    std::vector<std::function<void()>> m_network_tasks;
+    int m_wake_fd = -1; // An eventfd, written by wakeLoop() so the loop does not sleep through queued work
+    std::atomic<bool> m_wake_pending{false}; // Set while the eventfd is written and not read, to write it only once
+
+    mutable std::mutex m_timers_mutex;
+    TimerWheel m_timers; // Tasks added with callAt() and callEvery()
+
+    std::atomic<DiscoveryMode> m_discovery_mode{DiscoveryMode::PER_FUNCTION};
+    std::atomic<bool> m_compact_discovery{false};
+
+    // Discovery cache, only touched from the thread running the network loop
+    bool m_discovery_cache_enabled = false;
+    std::string m_discovery_state_file;
+    std::chrono::milliseconds m_discovery_verification_timeout{0};
+    std::unordered_map<std::string, uint64_t> m_discovery_hashes;
+    std::unordered_map<std::string, DiscoveryVerification> m_discovery_verifications;
+    uint64_t m_discovery_verification_id = 0;
+    bool m_discovery_state_save_scheduled = false;
+    std::atomic<size_t> m_skipped_discoveries{0};
+
+    // State restore, only touched from the thread running the network loop
+    std::atomic<bool> m_restoring_state{false};
+    std::chrono::milliseconds m_state_restore_timeout{0};
+    std::unordered_map<std::string, std::weak_ptr<FunctionBase>> m_state_restore_routes;
+    TimerId m_state_restore_timer = 0;
+
+    // Offline buffer, only touched from the thread running the network loop
+    std::unique_ptr<OfflineBuffer> m_offline_buffer;
+    size_t m_offline_replay_per_second = 0;
+    TimerId m_offline_replay_timer = 0;
+    std::atomic<size_t> m_buffered_publishes{0};
+    bool m_sending_connect_status = false;
+
+    // Publish deduplication, only touched from the thread running the network loop
+    bool m_deduplicate_publishes = false;
+    std::chrono::milliseconds m_deduplication_refresh{0};
+    std::unordered_map<std::string, PublishRecord> m_last_publishes;
+    std::atomic<size_t> m_suppressed_publishes{0};
+
+    // Waiting for acknowledgements and commands, only touched from the thread running the network loop
+    std::unordered_map<int, std::function<void(bool)>> m_pending_acknowledgements;
+    std::unordered_multimap<const FunctionBase*, std::function<void(const std::string&, const std::string&)>>
+        m_command_waiters;
+
+    mutable std::mutex m_executor_mutex;
+    std::shared_ptr<CallbackExecutor> m_callback_executor;
 };
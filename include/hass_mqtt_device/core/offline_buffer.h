@@ -0,0 +1,171 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+#include "hass_mqtt_device/core/publish_policy.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+
+/**
+ * @brief A bounded first in, first out buffer of messages that could not be published while offline
+ *
+ * Messages are kept in memory up to a byte limit. With a spill file, the oldest messages are moved to it when the
+ * memory is full, so the file always holds older messages than the memory. The spill file is a ring of a fixed size,
+ * mapped into memory. When it is full too, the oldest messages are dropped.
+ *
+ * Messages in the spill file are kept across restarts of the program, and replayed after the next connect. They are
+ * written back to disk by the kernel, so the last ones may be lost on a power loss. Each message has a CRC-32, and
+ * the spill file is only picked up to the first damaged message.
+ *
+ * @note Not thread safe, used from the thread running the network loop
+ */
+
+class OfflineBuffer
+{
+public:
+    /**
+     * @brief A buffered message
+     */
+    struct Message
+    {
+        std::string topic;
+        std::string payload;
+        PublishPolicy policy{1, false};
+    };
+
+    /**
+     * @brief Construct a new OfflineBuffer object
+     *
+     * @param max_memory_bytes The most bytes of topics and payloads to keep in memory
+     * @param spill_file The path of the spill file, or empty to only keep messages in memory
+     * @param spill_file_size The size of the spill file in bytes
+     */
+    explicit OfflineBuffer(size_t max_memory_bytes, const std::string& spill_file = "", size_t spill_file_size = 0);
+
+    /**
+     * @brief Destroy the OfflineBuffer object, moving the messages in memory to the spill file if there is one
+     */
+    ~OfflineBuffer();
+
+    OfflineBuffer(const OfflineBuffer&) = delete;
+    OfflineBuffer& operator=(const OfflineBuffer&) = delete;
+
+    /**
+     * @brief Add a message at the end, dropping the oldest messages if there is no room
+     *
+     * @param message The message
+     */
+    void push(Message message);
+
+    /**
+     * @brief Get the oldest message
+     *
+     * @note Must not be empty. The message is valid until the next call to pop() or push()
+     *
+     * @return The oldest message
+     */
+    const Message& front();
+
+    /**
+     * @brief Remove the oldest message
+     */
+    void pop();
+
+    /**
+     * @brief Check if there are no messages
+     *
+     * @return true if empty, false otherwise
+     */
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    /**
+     * @brief Get the number of messages
+     *
+     * @return The number of messages in memory and in the spill file
+     */
+    size_t size() const
+    {
+        return m_memory.size() + m_spill_count;
+    }
+
+    /**
+     * @brief Get the number of messages dropped because the buffer was full
+     *
+     * @return The number of dropped messages
+     */
+    size_t getDroppedCount() const
+    {
+        return m_dropped;
+    }
+
+private:
+    /**
+     * @brief The start of the spill file, kept up to date so the ring can be picked up after a restart
+     */
+    struct SpillHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t head; // Offset of the oldest record in the ring
+        uint64_t used; // Bytes used by records
+        uint64_t count; // Number of records
+    };
+
+    /**
+     * @brief Open and map the spill file, picking up the messages in it
+     *
+     * @param path The path of the spill file
+     * @param size The size of the file
+     */
+    void openSpillFile(const std::string& path, size_t size);
+
+    /**
+     * @brief Pick up the records of a spill file from before a restart, dropping the first damaged one and all after it
+     *
+     * @param header The header read from the file, with the head and used bytes within the ring
+     */
+    void recoverSpilled(SpillHeader header);
+
+    /**
+     * @brief Move a message to the end of the spill file, dropping the oldest ones if there is no room
+     *
+     * @param message The message
+     */
+    void spill(const Message& message);
+
+    /**
+     * @brief Remove the oldest message of the spill file
+     */
+    void popSpilled();
+
+    // Copy to and from the ring, wrapping around at the end
+    void writeRing(uint64_t offset, const void* data, size_t size);
+    void readRing(uint64_t offset, void* data, size_t size) const;
+
+    static size_t memorySize(const Message& message)
+    {
+        return message.topic.size() + message.payload.size();
+    }
+
+    std::deque<Message> m_memory;
+    size_t m_memory_bytes = 0;
+    size_t m_max_memory_bytes;
+
+    uint8_t* m_spill = nullptr; // The mapped spill file, nullptr if there is none
+    size_t m_spill_size = 0;
+    uint64_t m_ring_size = 0; // The size of the ring after the header
+    size_t m_spill_count = 0;
+    bool m_front_loaded = false; // Set when m_front holds the oldest message of the spill file
+    Message m_front;
+
+    size_t m_dropped = 0;
+};
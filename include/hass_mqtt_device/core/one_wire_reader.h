@@ -0,0 +1,208 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+#include "hass_mqtt_device/core/callback_executor.h"
+#include "hass_mqtt_device/core/timer_wheel.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class MQTTConnector;
+template<typename T>
+class SensorFunction;
+
+/**
+ * @brief Reads 1-wire temperature probes in the background, and hands the readings to the network loop
+ *
+ * Reading a DS18B20 through sysfs takes about 750 ms of conversion, so reading the probes one by one takes seconds.
+ * This reader finds the probes once, keeps their temperature files open, and reads them in parallel on a small pool
+ * of threads. Bus masters that have a therm_bulk_read file are told to start the conversion on all their probes at
+ * once, after which the temperature files read without waiting.
+ *
+ * The readings are handed to the bound sensors, and to the reading callback, on the thread running the network loop,
+ * so they do not need any locking.
+ *
+ * Example usage:
+ * @code{.cpp}
+ * auto reader = std::make_shared<OneWireReader>(connector);
+ * reader->discover();
+ * reader->bindSensor("28-0417503c19ff", temperature_sensor);
+ * reader->start(std::chrono::seconds(10));
+ * @endcode
+ *
+ * @note Must be created with std::make_shared
+ */
+
+class OneWireReader : public std::enable_shared_from_this<OneWireReader>
+{
+public:
+    /**
+     * @brief Construct a new OneWireReader object
+     *
+     * @param connector The connector whose network loop gets the readings
+     * @param base_path The sysfs directory of the 1-wire devices. Point it to a fake tree for testing
+     * @param worker_count The number of threads reading probes in parallel
+     */
+    explicit OneWireReader(std::shared_ptr<MQTTConnector> connector,
+                           std::string base_path = "/sys/bus/w1/devices",
+                           size_t worker_count = 4);
+
+    /**
+     * @brief Destroy the OneWireReader object, skipping the reads that have not started and waiting for the rest
+     */
+    ~OneWireReader();
+
+    OneWireReader(const OneWireReader&) = delete;
+    OneWireReader& operator=(const OneWireReader&) = delete;
+
+    /**
+     * @brief Find the probes and bus masters, and open their files
+     *
+     * Called by the first read cycle if not called before. When a probe disappears, the next read cycle discovers
+     * again, so probes that are replaced or come back are picked up.
+     *
+     * @return The number of probes found
+     */
+    size_t discover();
+
+    /**
+     * @brief Feed the readings of a probe to a sensor function
+     *
+     * @param id The id of the probe, the name of its directory, e.g. "28-0417503c19ff"
+     * @param sensor The sensor to update
+     */
+    void bindSensor(const std::string& id, std::shared_ptr<SensorFunction<double>> sensor);
+
+    /**
+     * @brief Get told about every reading, also for probes that are not bound to a sensor
+     *
+     * @param callback Called with the id of the probe and the temperature in degrees Celsius
+     */
+    void setReadingCallback(std::function<void(const std::string& id, double temperature)> callback);
+
+    /**
+     * @brief Get told when all probes have been read in a cycle, after their readings are handed over
+     *
+     * @param callback Called after every read cycle
+     */
+    void setCycleCallback(std::function<void()> callback);
+
+    /**
+     * @brief Read the probes at a fixed interval
+     *
+     * A cycle that is due while the previous one is still running is skipped
+     *
+     * @param interval The time between the start of two read cycles
+     */
+    void start(std::chrono::milliseconds interval);
+
+    /**
+     * @brief Stop reading the probes. A read cycle in progress still hands over its readings
+     */
+    void stop();
+
+    /**
+     * @brief Start a read cycle now, unless one is running
+     *
+     * @return true if a cycle was started, false if one was already running
+     */
+    bool readNow();
+
+    /**
+     * @brief Get the ids of the probes found
+     *
+     * @return The probe ids
+     */
+    std::vector<std::string> getSensorIds() const;
+
+    /**
+     * @brief Get the number of read cycles that have completed
+     *
+     * @return The number of completed cycles
+     */
+    size_t getCompletedCycles() const
+    {
+        return m_completed_cycles;
+    }
+
+private:
+    /**
+     * @brief A sysfs file kept open, the temperature file of a probe or the therm_bulk_read file of a bus master
+     */
+    struct SysfsFile
+    {
+        SysfsFile(std::string id, int fd)
+            : id(std::move(id))
+            , fd(fd)
+        {
+        }
+        ~SysfsFile();
+        SysfsFile(const SysfsFile&) = delete;
+        SysfsFile& operator=(const SysfsFile&) = delete;
+
+        std::string id;
+        int fd;
+    };
+
+    /**
+     * @brief Read a temperature file from the start
+     *
+     * @param fd The open file
+     * @param temperature Set to the temperature in degrees Celsius
+     * @return true if a valid temperature was read, false otherwise
+     */
+    static bool readTemperature(int fd, double& temperature);
+
+    /**
+     * @brief Run a read cycle on a worker: trigger the bulk conversions, then read the probes in parallel
+     */
+    void runCycle();
+
+    /**
+     * @brief Read one probe on a worker, and count down the probes left in the cycle
+     *
+     * @param probe The probe to read
+     */
+    void readProbe(const std::shared_ptr<SysfsFile>& probe);
+
+    /**
+     * @brief Hand a reading to the sensor and callback, on the network loop
+     *
+     * @param id The id of the probe
+     * @param temperature The temperature in degrees Celsius
+     */
+    void deliver(const std::string& id, double temperature);
+
+    /**
+     * @brief Finish a read cycle when its last probe has been read
+     */
+    void finishProbe();
+
+    std::weak_ptr<MQTTConnector> m_connector;
+    std::string m_base_path;
+    // Guards the files, sensors and callbacks. The files are shared with the reads in progress, which close them
+    mutable std::mutex m_mutex;
+    std::vector<std::shared_ptr<SysfsFile>> m_probes;
+    std::vector<std::shared_ptr<SysfsFile>> m_bulk_reads; // The bus masters that have a therm_bulk_read file
+    std::unordered_map<std::string, std::shared_ptr<SensorFunction<double>>> m_sensors;
+    std::function<void(const std::string&, double)> m_reading_callback;
+    std::function<void()> m_cycle_callback;
+    std::atomic<bool> m_discovered{false};
+    std::atomic<bool> m_rediscover{false}; // Set when a probe disappeared
+    std::atomic<TimerId> m_timer{0};
+    std::atomic<bool> m_cycle_running{false};
+    std::atomic<bool> m_stopping{false}; // Set by the destructor, so cycles in progress skip the reads
+    std::atomic<size_t> m_probes_left{0};
+    std::atomic<size_t> m_completed_cycles{0};
+    std::unique_ptr<CallbackExecutor> m_workers; // Last, so its threads are joined before the rest is destroyed
+};
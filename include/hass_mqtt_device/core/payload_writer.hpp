@@ -0,0 +1,211 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+/**
+ * @brief Formats fixed-shape JSON payloads straight into a reusable buffer
+ *
+ * State payloads like {"value":12.5} always have the same shape, so building a json object and dumping it is
+ * mostly wasted work. The constant parts are written as they are, and only the values are formatted. The buffer
+ * keeps its capacity, so after the first few payloads nothing is allocated. The output matches what
+ * nlohmann::json::dump() gives for the same values, except that floats are written with float precision instead
+ * of being widened to double first.
+ *
+ * Example usage:
+ * @code{.cpp}
+ * auto& writer = PayloadWriter::threadLocal();
+ * writer.raw(R"({"value":)").value(m_temperature).raw("}");
+ * publishState(writer.str());
+ * @endcode
+ */
+
+class PayloadWriter
+{
+public:
+    /**
+     * @brief Get an empty writer owned by the calling thread
+     *
+     * Lets const status functions format payloads without a shared buffer, so they stay safe to call from several
+     * threads. The payload must be used before the next call to threadLocal() on the same thread
+     *
+     * @return The writer of this thread, cleared
+     */
+    static PayloadWriter& threadLocal()
+    {
+        thread_local PayloadWriter writer;
+        writer.clear();
+        return writer;
+    }
+
+    /**
+     * @brief Empty the buffer, keeping its capacity
+     */
+    void clear()
+    {
+        m_buffer.clear();
+    }
+
+    /**
+     * @brief Get the formatted payload
+     *
+     * @return The payload
+     */
+    const std::string& str() const
+    {
+        return m_buffer;
+    }
+
+    /**
+     * @brief Append text as it is, for the constant parts of the payload
+     *
+     * @param text The text to append
+     * @return This writer
+     */
+    PayloadWriter& raw(std::string_view text)
+    {
+        m_buffer.append(text);
+        return *this;
+    }
+
+    /**
+     * @brief Append a string as a quoted and escaped JSON string
+     *
+     * @param text The string to append
+     * @return This writer
+     */
+    PayloadWriter& value(std::string_view text)
+    {
+        m_buffer.push_back('"');
+        for(char character : text)
+        {
+            switch(character)
+            {
+            case '"':
+                m_buffer.append("\\\"");
+                break;
+            case '\\':
+                m_buffer.append("\\\\");
+                break;
+            case '\n':
+                m_buffer.append("\\n");
+                break;
+            case '\r':
+                m_buffer.append("\\r");
+                break;
+            case '\t':
+                m_buffer.append("\\t");
+                break;
+            case '\b':
+                m_buffer.append("\\b");
+                break;
+            case '\f':
+                m_buffer.append("\\f");
+                break;
+            default:
+                if(static_cast<unsigned char>(character) < 0x20)
+                {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", character);
+                    m_buffer.append(escaped);
+                }
+                else
+                {
+                    m_buffer.push_back(character);
+                }
+            }
+        }
+        m_buffer.push_back('"');
+        return *this;
+    }
+
+    /**
+     * @brief Append a string as a quoted and escaped JSON string
+     *
+     * @param text The string to append
+     * @return This writer
+     */
+    PayloadWriter& value(const char* text)
+    {
+        return value(std::string_view(text));
+    }
+
+    /**
+     * @brief Append a string as a quoted and escaped JSON string
+     *
+     * @param text The string to append
+     * @return This writer
+     */
+    PayloadWriter& value(const std::string& text)
+    {
+        return value(std::string_view(text));
+    }
+
+    /**
+     * @brief Append a boolean as true or false
+     *
+     * @param flag The boolean to append
+     * @return This writer
+     */
+    PayloadWriter& value(bool flag)
+    {
+        m_buffer.append(flag ? "true" : "false");
+        return *this;
+    }
+
+    /**
+     * @brief Append a number
+     *
+     * Integers are written as they are. Floating point numbers use the shortest form that reads back to the same
+     * value, with ".0" added to whole numbers, and null for NaN and infinity, like nlohmann::json
+     *
+     * @param number The number to append
+     * @return This writer
+     */
+    template<typename T, typename = std::enable_if_t<std::is_arithmetic_v<T> && !std::is_same_v<T, bool>>>
+    PayloadWriter& value(T number)
+    {
+        char digits[64];
+        if constexpr(std::is_integral_v<T>)
+        {
+            auto result = std::to_chars(digits, digits + sizeof(digits), number);
+            m_buffer.append(digits, result.ptr);
+        }
+        else
+        {
+            if(!std::isfinite(number))
+            {
+                m_buffer.append("null");
+                return *this;
+            }
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+            auto result = std::to_chars(digits, digits + sizeof(digits), number);
+            std::string_view text(digits, result.ptr - digits);
+#else
+            // Older standard libraries can not format floating point numbers with to_chars
+            int length = std::snprintf(
+                digits, sizeof(digits), "%.*g", std::is_same_v<T, float> ? 9 : 17, static_cast<double>(number));
+            std::string_view text(digits, length);
+#endif
+            m_buffer.append(text);
+            if(text.find_first_of(".e") == std::string_view::npos)
+            {
+                m_buffer.append(".0");
+            }
+        }
+        return *this;
+    }
+
+private:
+    std::string m_buffer;
+};
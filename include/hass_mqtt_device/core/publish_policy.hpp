@@ -0,0 +1,47 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+/**
+ * @brief The kinds of topics a function publishes to, each with its own PublishPolicy
+ */
+enum class TopicKind
+{
+    DISCOVERY, // The Home Assistant discovery messages
+    STATE, // The state topics, read by Home Assistant and used to restore the state after a restart
+    TELEMETRY // Readings published with publishTelemetryState(), like sensor values
+};
+
+/**
+ * @brief The QoS and retain flag of the messages published to a kind of topic
+ *
+ * QoS 1 makes the broker acknowledge every message, which doubles the round trips. QoS 0 is enough for high rate
+ * readings where the next one follows soon. Retained messages are stored by the broker, and sent to every new
+ * subscriber, which Home Assistant needs for discovery and states, but not for readings that are stale soon anyway.
+ */
+struct PublishPolicy
+{
+    int qos = 1;
+    bool retain = true;
+};
+
+/**
+ * @brief Check that a QoS level is one MQTT knows
+ *
+ * @param qos The QoS level
+ * @throw std::invalid_argument if it is not 0, 1 or 2
+ */
+inline void validateQos(int qos)
+{
+    if(qos < 0 || qos > 2)
+    {
+        throw std::invalid_argument("MQTT QoS must be 0, 1 or 2, got " + std::to_string(qos));
+    }
+}
@@ -0,0 +1,178 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+#include "hass_mqtt_device/core/timer_wheel.h"
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <vector>
+
+class MQTTConnector;
+class NumberFunction;
+
+/**
+ * @brief Time-proportioning PWM for slow outputs like relays for floor heating
+ *
+ * Every channel has a period, and is on for the duty cycle fraction at the start of each period. All channels share
+ * one timer on the connector, armed for the next on/off edge of any channel, so the outputs switch within a tick of
+ * the timing wheel no matter how many channels there are or how busy the MQTT traffic is. The outputs are written
+ * from the thread running the network loop, and only when they change.
+ *
+ * Channels start their periods at different phases, so relays do not all switch on at once.
+ *
+ * Example usage:
+ * @code{.cpp}
+ * auto pwm = std::make_shared<SlowPwm>(connector);
+ * auto room = std::make_shared<NumberFunction>("Room 1", [&room](double value) { room->update(value); });
+ * pwm->bindNumber(room, [](bool on) { digitalWrite(21, on); }, std::chrono::minutes(10));
+ * @endcode
+ *
+ * @note Must be created with std::make_shared
+ */
+
+class SlowPwm : public std::enable_shared_from_this<SlowPwm>
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @brief Construct a new SlowPwm object
+     *
+     * @param connector The connector whose network loop runs the timer
+     */
+    explicit SlowPwm(std::shared_ptr<MQTTConnector> connector);
+
+    /**
+     * @brief Destroy the SlowPwm object, leaving the outputs as they are
+     */
+    ~SlowPwm();
+
+    SlowPwm(const SlowPwm&) = delete;
+    SlowPwm& operator=(const SlowPwm&) = delete;
+
+    /**
+     * @brief Add a channel, starting with the output off
+     *
+     * @param output Called with true to switch the output on, and false to switch it off
+     * @param period The length of one on/off cycle
+     * @param phase How far into the cycle the channel is at start, or nullopt to spread the channels evenly
+     * @return The index of the channel
+     */
+    size_t addChannel(std::function<void(bool)> output,
+                      std::chrono::milliseconds period,
+                      std::optional<std::chrono::milliseconds> phase = std::nullopt);
+
+    /**
+     * @brief Add a channel with the duty cycle following the value of a number function
+     *
+     * The minimum of the number is fully off, and the maximum fully on. The duty cycle changes every time update()
+     * is called on the number.
+     *
+     * @param number The number function to follow
+     * @param output Called with true to switch the output on, and false to switch it off
+     * @param period The length of one on/off cycle
+     * @param phase How far into the cycle the channel is at start, or nullopt to spread the channels evenly
+     * @return The index of the channel
+     */
+    size_t bindNumber(const std::shared_ptr<NumberFunction>& number,
+                      std::function<void(bool)> output,
+                      std::chrono::milliseconds period,
+                      std::optional<std::chrono::milliseconds> phase = std::nullopt);
+
+    /**
+     * @brief Set the duty cycle of a channel. Safe to call from any thread
+     *
+     * The output is updated right away, at the next iteration of the network loop
+     *
+     * @param channel The index of the channel
+     * @param duty The fraction of the period to be on, from 0 to 1
+     */
+    void setDuty(size_t channel, double duty);
+
+    /**
+     * @brief Get the duty cycle of a channel
+     *
+     * @param channel The index of the channel
+     * @return The fraction of the period to be on
+     */
+    double getDuty(size_t channel) const;
+
+    /**
+     * @brief Get the state last written to the output of a channel
+     *
+     * @param channel The index of the channel
+     * @return true if the output is on, false otherwise
+     */
+    bool getOutput(size_t channel) const;
+
+    /**
+     * @brief Get the number of channels
+     *
+     * @return The number of channels
+     */
+    size_t getChannelCount() const;
+
+private:
+    /**
+     * @brief A PWM output
+     */
+    struct Channel
+    {
+        std::function<void(bool)> output;
+        Clock::duration period;
+        Clock::duration phase;
+        double duty = 0;
+        bool state = false;
+        bool written = false; // The output is written the first time no matter the state
+        uint64_t generation = 0; // Tells the current edge of the channel from ones made stale by setDuty()
+    };
+
+    /**
+     * @brief The next time a channel may have to switch
+     */
+    struct Edge
+    {
+        Clock::time_point when;
+        size_t channel;
+        uint64_t generation;
+
+        bool operator>(const Edge& other) const
+        {
+            return when > other.when;
+        }
+    };
+
+    /**
+     * @brief Queue an edge for a channel, replacing the one it had. Must be called with the mutex held
+     *
+     * @param channel The index of the channel
+     * @param when The time of the edge
+     */
+    void scheduleEdge(size_t channel, Clock::time_point when);
+
+    /**
+     * @brief Make sure the connector timer fires for the earliest edge. Must be called with the mutex held
+     */
+    void armTimer();
+
+    /**
+     * @brief Switch the outputs of the edges that are due, implementing the connector timer
+     */
+    void onTimer();
+
+    std::weak_ptr<MQTTConnector> m_connector;
+    Clock::time_point m_epoch; // Time zero of the cycles of all channels
+    mutable std::mutex m_mutex;
+    std::vector<Channel> m_channels;
+    std::priority_queue<Edge, std::vector<Edge>, std::greater<>> m_edges;
+    TimerId m_timer = 0; // Zero when not armed
+    Clock::time_point m_timer_when;
+};
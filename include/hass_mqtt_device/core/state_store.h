@@ -0,0 +1,156 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Crash-safe storage of function values, like number values, switch states and hvac setpoints
+ *
+ * The values are kept in memory, and every change is appended to a journal file as a small checksummed record,
+ * 16 bytes for a value. Each write is synced to disk before set() returns, so a power loss loses at most the change
+ * being written. A record that was torn by a power loss fails its checksum, and is dropped when the journal is
+ * opened again.
+ *
+ * When the journal grows past the compaction threshold it is rewritten with only the latest value of each key, into a
+ * temporary file that then replaces the journal. The journal is either the old or the new one after a power loss.
+ *
+ * The first time a key is set, a record naming it is written, and later values refer to it by a slot number.
+ *
+ * Example usage:
+ * @code{.cpp}
+ * auto store = std::make_shared<StateStore>("/var/lib/heating/state.journal");
+ * store->open();
+ * number->update(store->get("Room 1").value_or(20));
+ * ...
+ * store->set("Room 1", number->getNumber());
+ * @endcode
+ *
+ * @note Thread safe
+ */
+
+class StateStore
+{
+public:
+    /**
+     * @brief Construct a new StateStore object
+     *
+     * @param path The path of the journal file. The folder must exist
+     * @param compact_threshold Compact the journal when it grows past this many bytes
+     */
+    explicit StateStore(std::string path, size_t compact_threshold = 64 * 1024);
+
+    /**
+     * @brief Destroy the StateStore object, closing the journal
+     */
+    ~StateStore();
+
+    StateStore(const StateStore&) = delete;
+    StateStore& operator=(const StateStore&) = delete;
+
+    /**
+     * @brief Open the journal and restore the values in it, creating it if it does not exist
+     *
+     * A torn record at the end is cut off. Values set before this call are written on top of the ones in the journal.
+     * Without a journal that can be written, the values are only kept in memory
+     *
+     * @return true if the journal is open for writing, false otherwise
+     */
+    bool open();
+
+    /**
+     * @brief Get the value of a key
+     *
+     * @param key The key
+     * @return The value, or nullopt if it has never been set
+     */
+    std::optional<double> get(const std::string& key) const;
+
+    /**
+     * @brief Set the value of a key, writing it to the journal if it changed
+     *
+     * @param key The key, at most 255 bytes
+     * @param value The value
+     * @return true if the value is stored on disk, false if it could not be written. Before open() the value is
+     * still kept in memory, and written when the journal is opened, but after a write error it is not kept at all
+     */
+    bool set(const std::string& key, double value);
+
+    /**
+     * @brief Rewrite the journal with only the latest value of each key
+     *
+     * Done automatically when the journal grows past the compaction threshold
+     *
+     * @return true if the journal was rewritten, false otherwise
+     */
+    bool compact();
+
+    /**
+     * @brief Get the number of keys with a value
+     *
+     * @return The number of keys
+     */
+    size_t size() const;
+
+    /**
+     * @brief Get the size of the journal file
+     *
+     * @return The size in bytes
+     */
+    size_t getJournalSize() const;
+
+private:
+    struct Entry
+    {
+        uint16_t slot;
+        double value;
+    };
+
+    /**
+     * @brief Read the records of a journal into the values
+     *
+     * @param fd The journal, positioned at the start
+     * @param slots Filled with the key of each slot
+     * @param values Filled with the latest value of each key
+     * @return The size of the valid part of the journal, 0 if the header is not valid
+     */
+    size_t readJournal(int fd, std::vector<std::string>& slots, std::unordered_map<std::string, Entry>& values);
+
+    /**
+     * @brief Append records to the journal, and sync them to disk
+     *
+     * @param records The serialized records
+     * @return true if written, false otherwise
+     */
+    bool append(const std::vector<uint8_t>& records);
+
+    /**
+     * @brief Check if the journal has grown enough to be compacted
+     *
+     * @return true if it should be compacted, false otherwise
+     */
+    bool needsCompaction() const;
+
+    // Set and compact without taking the lock
+    bool setLocked(const std::string& key, double value);
+    bool compactLocked();
+
+    std::string m_path;
+    size_t m_compact_threshold;
+    int m_fd = -1;
+    size_t m_journal_size = 0;
+    size_t m_compacted_size = 0; // The size of the journal after the last compaction
+    std::unordered_map<std::string, Entry> m_values;
+    std::vector<std::string> m_slots; // The key of each slot in the journal
+    mutable std::mutex m_mutex;
+};
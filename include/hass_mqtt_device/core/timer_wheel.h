@@ -0,0 +1,157 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Identifies a timer, for cancelling it. Zero is never used
+ */
+using TimerId = uint64_t;
+
+/**
+ * @brief A hashed timing wheel, holding one-shot and periodic timers
+ *
+ * Time is cut into ticks, and each timer goes into the slot of the tick it is due in, modulo the number of slots.
+ * Adding and cancelling a timer is constant time, and advancing the wheel only looks at the slots of the ticks
+ * that passed, so many timers cost little when few are due. Timers never fire early, and at most one tick late
+ * plus however long the caller takes to advance the wheel.
+ *
+ * @note This class is not thread-safe, MQTTConnector guards it with a mutex
+ */
+
+class TimerWheel
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @brief A timer that is due, taken out of the wheel by advance()
+     */
+    struct DueTimer
+    {
+        TimerId id;
+        std::shared_ptr<std::function<void()>> task; // Shared with the wheel for periodic timers
+    };
+
+    /**
+     * @brief Construct a new TimerWheel object
+     *
+     * @param tick The resolution of the wheel, and the longest a timer can be late
+     * @param slot_count The number of slots. Timers due more than tick * slot_count ahead go round the wheel more
+     * than once before firing
+     */
+    explicit TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(10), size_t slot_count = 512);
+
+    /**
+     * @brief Add a timer
+     *
+     * @param when The first time the timer is due
+     * @param period How often the timer repeats after that, or zero for a one-shot timer
+     * @param task The task to run when due
+     * @return The id of the timer
+     */
+    TimerId add(Clock::time_point when, Clock::duration period, std::function<void()> task);
+
+    /**
+     * @brief Remove a timer
+     *
+     * @param id The id of the timer
+     * @return true if the timer was removed, false if it had already fired or been cancelled
+     */
+    bool cancel(TimerId id);
+
+    /**
+     * @brief Take out the timers that are due
+     *
+     * Periodic timers are put back for their next period, skipping the periods that were missed, so a late wheel
+     * does not fire them in a burst.
+     *
+     * @param now The current time
+     * @return The due timers, in the order they were due, and in the order they were added if due at the same time
+     */
+    std::vector<DueTimer> advance(Clock::time_point now);
+
+    /**
+     * @brief Get the time the next timer fires, the start of the tick it is in
+     *
+     * Only the slots of the next round of the wheel are looked at, unless they are all empty
+     *
+     * @return The time, or time_point::max() if there are no timers
+     */
+    Clock::time_point nextDue() const;
+
+    /**
+     * @brief Check if there are no timers
+     *
+     * @return true if there are no timers, false otherwise
+     */
+    bool empty() const
+    {
+        return m_timers.empty();
+    }
+
+    /**
+     * @brief Get the number of timers
+     *
+     * @return The number of timers
+     */
+    size_t size() const
+    {
+        return m_timers.size();
+    }
+
+private:
+    /**
+     * @brief A timer in the wheel
+     */
+    struct Timer
+    {
+        Clock::time_point when;
+        Clock::duration period;
+        uint64_t tick; // The tick the timer fires in, the first one that does not start before when
+        std::shared_ptr<std::function<void()>> task;
+    };
+
+    /**
+     * @brief Get the tick a timer due at a given time fires in
+     *
+     * @param when The time the timer is due
+     * @return The tick
+     */
+    uint64_t tickOf(Clock::time_point when) const;
+
+    /**
+     * @brief Get the start time of a tick
+     *
+     * @param tick The tick
+     * @return The start time
+     */
+    Clock::time_point startOf(uint64_t tick) const;
+
+    /**
+     * @brief Put a timer in the slot of its tick, or in the overdue list if that tick has passed
+     *
+     * @param id The id of the timer
+     * @param timer The timer
+     */
+    void place(TimerId id, Timer& timer);
+
+    Clock::time_point m_start;
+    Clock::duration m_tick;
+    // The slots hold ids, cancelled timers are dropped from a slot when it is visited
+    std::vector<std::vector<TimerId>> m_slots;
+    std::vector<TimerId> m_overdue; // Added for a tick that has already been advanced past
+    std::unordered_map<TimerId, Timer> m_timers;
+    uint64_t m_current_tick = 0; // The last tick advanced past
+    TimerId m_next_id = 1;
+};
@@ -0,0 +1,141 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+#pragma once
+
+#include "hass_mqtt_device/functions/sensor.h"
+#include <chrono>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+/**
+ * @brief The statistics of one window of samples
+ */
+template<typename T>
+struct WindowStatistics
+{
+    T min{};
+    T max{};
+    double mean = 0;
+    double stddev = 0; // Population standard deviation
+    size_t samples = 0;
+};
+
+/**
+ * @brief Class for a sensor that is sampled much faster than it should be published
+ *
+ * Samples are collected in a fixed-size ring buffer and reduced once per window. The mean of the window is
+ * published as the state, subject to the filtering in the sensor attributes, and min, max, mean, standard
+ * deviation and sample count of every window are published as entity attributes, also when the filter holds back
+ * the mean.
+ *
+ * The window is time based if a window duration is given, keeping the newest samples if more arrive than the
+ * buffer holds. A sample arriving after the end of the window ends it, so call checkWindow() regularly if the
+ * samples may stop. Otherwise a window ends when the buffer is full.
+ *
+ * The window is guarded by a mutex, so samples may be added on another thread than the one checking the window.
+ * The statistics are published with the TopicKind::TELEMETRY policy if the sensor publishes telemetry.
+ *
+ * Example usage:
+ * @code{.cpp}
+ * // Sampled at 500 Hz, published once per second
+ * auto current = std::make_shared<AggregatingSensorFunction<float>>(
+ *     "Current", attributes, 512, std::chrono::milliseconds(1000));
+ * current->addSample(readClamp());
+ * ...
+ * connector->callEvery(std::chrono::milliseconds(100), [current]() { current->checkWindow(); });
+ * @endcode
+ */
+
+template<typename T>
+class AggregatingSensorFunction : public SensorFunction<T>
+{
+    static_assert(std::is_floating_point_v<T>, "AggregatingSensorFunction needs a floating point type");
+
+public:
+    /**
+     * @brief Construct a new AggregatingSensorFunction object
+     *
+     * @param function_name The name of the function
+     * @param attributes The attributes of the sensor
+     * @param window_size The number of samples the buffer holds
+     * @param window_duration The length of a window, or zero to end a window when the buffer is full
+     */
+    AggregatingSensorFunction(const std::string& function_name,
+                              const SensorAttributes& attributes,
+                              size_t window_size,
+                              std::chrono::milliseconds window_duration = std::chrono::milliseconds(0));
+
+    /**
+     * @brief Implements the discovery payload function for this function, adding the attributes topic
+     *
+     * @return The discovery payload for this function
+     */
+    [[nodiscard]] json getDiscoveryJson() const override;
+
+    /**
+     * @brief Implement sending status for all values, including the statistics of the last window
+     */
+    void sendStatus() const override;
+
+    /**
+     * @brief Add a sample, publishing the window if it is complete
+     *
+     * @param value The sample
+     */
+    void addSample(T value);
+
+    /**
+     * @brief End the current window now and publish it
+     *
+     * Does nothing if there are no samples in the window
+     */
+    void flush();
+
+    /**
+     * @brief End the current window if it is time based and its duration has passed
+     */
+    void checkWindow();
+
+    /**
+     * @brief Get the statistics of the last published window
+     *
+     * @return The statistics of the last window
+     */
+    [[nodiscard]] WindowStatistics<T> getLastStatistics() const
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_mutex);
+        return m_statistics;
+    }
+
+private:
+    std::vector<T> m_samples; // Ring buffer, allocated once
+    size_t m_next = 0;
+    size_t m_count = 0;
+    std::chrono::milliseconds m_window_duration;
+    std::chrono::steady_clock::time_point m_window_start;
+    WindowStatistics<T> m_statistics;
+    mutable bool m_statistics_published = false;
+    // Guards the window and the statistics. Recursive, as ending a window publishes through sendStatus()
+    mutable std::recursive_mutex m_mutex;
+
+    /**
+     * @brief Publish the statistics of the last window to the attributes topic
+     */
+    void publishAttributes() const;
+
+    /**
+     * @brief Check if the current window is time based and has ended
+     *
+     * @param now The current time
+     * @return true if the window has ended, false otherwise
+     */
+    bool windowExpired(std::chrono::steady_clock::time_point now) const
+    {
+        return m_window_duration.count() > 0 && m_count > 0 && now - m_window_start >= m_window_duration;
+    }
+};
@@ -8,8 +8,10 @@
 
 #include "hass_mqtt_device/core/device_base.h"
 #include "hass_mqtt_device/core/function_base.h"
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <utility>
 
 /**
  * @brief Class for an on/off only light device
@@ -67,6 +69,21 @@ public:
      */
     void sendStatus() const override;
 
+    /**
+     * @brief Implement the topics to restore the state from
+     *
+     * @return The state topic of this function
+     */
+    [[nodiscard]] std::vector<std::string> getRestoreTopics() const override;
+
+    /**
+     * @brief Implement restoring the state from a retained state message
+     *
+     * @param topic The topic of the message
+     * @param payload The payload of the message
+     */
+    void restoreState(const std::string& topic, const std::string& payload) override;
+
     /**
      * @brief Set the state and brightness of this function
      *
@@ -75,6 +92,16 @@ public:
      */
     void update(bool state, double brightness);
 
+    /**
+     * @brief Collapse bursts of commands, e.g. from dragging the slider in Home Assistant
+     *
+     * When enabled, only the newest pending command is delivered to the control callback, and deliveries are at
+     * least the given interval apart. Commands are delivered right away when disabled, which is the default.
+     *
+     * @param min_interval The minimum time between two calls to the control callback
+     */
+    void setCommandCoalescing(std::chrono::milliseconds min_interval);
+
     /**
      * @brief Get the state of this function
      *
@@ -100,4 +127,5 @@ protected:
     bool m_state;
     double m_brightness;
     std::function<void(bool, double)> m_control_cb;
+    std::shared_ptr<CommandMailbox<std::pair<bool, double>>> m_mailbox; // Only set when command coalescing is enabled
 };
@@ -101,6 +101,21 @@ public:
      */
     void sendStatus() const override;
 
+    /**
+     * @brief Implement the topics to restore the state from
+     *
+     * @return The state topics of the supported setpoints and modes
+     */
+    [[nodiscard]] std::vector<std::string> getRestoreTopics() const override;
+
+    /**
+     * @brief Implement restoring the state from a retained state message
+     *
+     * @param topic The topic of the message
+     * @param payload The payload of the message
+     */
+    void restoreState(const std::string& topic, const std::string& payload) override;
+
     /**
      * @brief Set the temperature measured by the device
      *
@@ -317,6 +332,14 @@ protected:
      */
     void sendFunctionStatus(const HvacSupportedFeatures& feature) const;
 
+    /**
+     * @brief Run the control callback for one feature through the callback executor
+     *
+     * @param feature The feature that was set
+     * @param value The value that was set
+     */
+    void dispatchFeatureControl(HvacSupportedFeatures feature, const std::string& value) const;
+
     unsigned m_supported_features;
     std::function<void(HvacSupportedFeatures, std::string)> m_control_cb;
     std::vector<std::string> m_device_modes; // Auto, Cool, Heat, Dry, Fan only type modes
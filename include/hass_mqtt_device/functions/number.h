@@ -8,6 +8,7 @@
 
 #include "hass_mqtt_device/core/device_base.h"
 #include "hass_mqtt_device/core/function_base.h"
+#include <chrono>
 #include <functional>
 #include <memory>
 
@@ -74,6 +75,21 @@ public:
      */
     void sendStatus() const override;
 
+    /**
+     * @brief Implement the topics to restore the state from
+     *
+     * @return The state topic of this function
+     */
+    [[nodiscard]] std::vector<std::string> getRestoreTopics() const override;
+
+    /**
+     * @brief Implement restoring the state from a retained state message
+     *
+     * @param topic The topic of the message
+     * @param payload The payload of the message
+     */
+    void restoreState(const std::string& topic, const std::string& payload) override;
+
     /**
      * @brief Set the state of this function
      *
@@ -81,6 +97,16 @@ public:
      */
     void update(double number);
 
+    /**
+     * @brief Collapse bursts of commands, e.g. from dragging the slider in Home Assistant
+     *
+     * When enabled, only the newest pending command is delivered to the control callback, and deliveries are at
+     * least the given interval apart. Commands are delivered right away when disabled, which is the default.
+     *
+     * @param min_interval The minimum time between two calls to the control callback
+     */
+    void setCommandCoalescing(std::chrono::milliseconds min_interval);
+
     /**
      * @brief Get the value of this function
      *
@@ -91,6 +117,38 @@ public:
         return m_number;
     };
 
+    /**
+     * @brief Get the minimum value of this function
+     *
+     * @return The minimum value
+     */
+    [[nodiscard]] double getMin() const
+    {
+        return m_min;
+    };
+
+    /**
+     * @brief Get the maximum value of this function
+     *
+     * @return The maximum value
+     */
+    [[nodiscard]] double getMax() const
+    {
+        return m_max;
+    };
+
+    /**
+     * @brief Get told every time the value is set with update(), e.g. to drive an output from it
+     *
+     * Used by SlowPwm::bindNumber(). Set it before the function is in use, there is only one listener
+     *
+     * @param listener Called with the new value, on the thread calling update()
+     */
+    void setValueListener(std::function<void(double)> listener)
+    {
+        m_value_listener = std::move(listener);
+    };
+
 private:
 protected:
     double m_number;
@@ -98,4 +156,6 @@ protected:
     double m_min;
     double m_step;
     std::function<void(double)> m_control_cb;
+    std::shared_ptr<CommandMailbox<double>> m_mailbox; // Only set when command coalescing is enabled
+    std::function<void(double)> m_value_listener;
 };
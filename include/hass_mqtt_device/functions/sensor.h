@@ -8,6 +8,7 @@
 
 #include "hass_mqtt_device/core/device_base.h"
 #include "hass_mqtt_device/core/function_base.h"
+#include <chrono>
 #include <functional>
 #include <memory>
 
@@ -22,6 +23,8 @@
  * attributes.device_class = "temperature";
  * attributes.unit = "°C";
  * attributes.precision = 1;
+ * attributes.absolute_deadband = 0.2; // Ignore jitter of the probe
+ * attributes.max_silence_interval = std::chrono::minutes(5); // But report at least every 5 minutes
  * @endcode
  *
  * You can see the sensor device class types here:
@@ -35,6 +38,17 @@ struct SensorAttributes
     std::string state_class;
     std::string unit_of_measurement;
     int suggested_display_precision;
+
+    // Publish filtering, applied by update(). Only used for numeric sensors, except the intervals
+    double absolute_deadband = 0; // Only publish when the value moved more than this from the last published value
+    double relative_deadband = 0; // As absolute_deadband, but a fraction of the last published value, e.g. 0.01
+    std::chrono::milliseconds min_publish_interval{0}; // Never publish more often than this
+    std::chrono::milliseconds max_silence_interval{0}; // Publish even if unchanged when this has passed, 0 for never
+
+    // Publish readings as telemetry, with the TopicKind::TELEMETRY policy that is not retained by default, and
+    // buffered while offline with MQTTConnector::enableOfflineBuffer(). Home Assistant shows the sensor as unknown
+    // until the first reading
+    bool telemetry = false;
 };
 
 /**
@@ -103,13 +117,27 @@ public:
     /**
      * @brief Set the state of this function
      *
-     * @param state The state to set
+     * The value is published unless filtered by the deadband and interval settings of the attributes. A filtered
+     * value is still kept, and sent with the next status update
+     *
      * @param value The value to send for this sensor
      */
     void update(T value);
 
 private:
+    /**
+     * @brief Check the deadband and interval settings to see if a new value should be published
+     *
+     * @param value The new value
+     * @param now The current time
+     * @return true if the value should be published, false otherwise
+     */
+    bool shouldPublish(const T& value, std::chrono::steady_clock::time_point now) const;
+
     bool m_has_data;
+    bool m_has_published = false;
+    T m_last_published{};
+    std::chrono::steady_clock::time_point m_last_publish_time;
 protected:
     SensorAttributes m_attributes;
     T m_value;
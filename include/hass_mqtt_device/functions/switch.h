@@ -67,6 +67,21 @@ public:
      */
     void sendStatus() const override;
 
+    /**
+     * @brief Implement the topics to restore the state from
+     *
+     * @return The state topic of this function
+     */
+    [[nodiscard]] std::vector<std::string> getRestoreTopics() const override;
+
+    /**
+     * @brief Implement restoring the state from a retained state message
+     *
+     * @param topic The topic of the message
+     * @param payload The payload of the message
+     */
+    void restoreState(const std::string& topic, const std::string& payload) override;
+
     /**
      * @brief Set the state of this function
      *
@@ -0,0 +1,142 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+// Include the corresponding header file
+#include "hass_mqtt_device/core/callback_executor.h"
+
+// Include any other necessary headers
+#include "hass_mqtt_device/logger/logger.hpp" // For logging
+#include <algorithm>
+#include <exception>
+
+CallbackExecutor::CallbackExecutor(ExecutorMode mode, size_t worker_count)
+    : m_mode(mode)
+{
+    if(m_mode == ExecutorMode::INLINE)
+    {
+        return;
+    }
+    if(m_mode == ExecutorMode::DEDICATED_THREAD || worker_count == 0)
+    {
+        worker_count = 1;
+    }
+    LOG_DEBUG("Starting callback executor with {} threads", worker_count);
+    m_running_workers = worker_count;
+    for(size_t i = 0; i < worker_count; ++i)
+    {
+        m_workers.emplace_back([this]() { workerLoop(); });
+    }
+}
+
+CallbackExecutor::~CallbackExecutor()
+{
+    shutdown();
+}
+
+void CallbackExecutor::shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_condition.notify_all();
+    for(auto& worker : m_workers)
+    {
+        if(worker.joinable())
+        {
+            worker.join();
+        }
+    }
+}
+
+bool CallbackExecutor::post(const void* key, std::function<void()> task)
+{
+    if(m_mode == ExecutorMode::INLINE)
+    {
+        task();
+        ++m_executed;
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_running_workers == 0)
+        {
+            LOG_WARN("Callback executor is shut down, dropping the task");
+            return false;
+        }
+        auto [strand, inserted] = m_strands.try_emplace(key);
+        strand->second.tasks.push_back(std::move(task));
+        m_queue_depth++;
+        m_max_queue_depth = std::max(m_max_queue_depth, m_queue_depth);
+        // If the key already has a task queued or running, the worker running it picks this one up afterwards
+        if(!inserted)
+        {
+            return true;
+        }
+        m_ready.push_back(key);
+    }
+    m_condition.notify_one();
+    return true;
+}
+
+size_t CallbackExecutor::getQueueDepth() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queue_depth;
+}
+
+size_t CallbackExecutor::getMaxQueueDepth() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_max_queue_depth;
+}
+
+void CallbackExecutor::workerLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(true)
+    {
+        m_condition.wait(lock, [this]() { return m_stopping || !m_ready.empty(); });
+        if(m_ready.empty())
+        {
+            // Stopping, and everything queued has been run
+            m_running_workers--;
+            return;
+        }
+
+        const void* key = m_ready.front();
+        m_ready.pop_front();
+        auto& tasks = m_strands[key].tasks;
+        auto task = std::move(tasks.front());
+        tasks.pop_front();
+        m_queue_depth--;
+
+        lock.unlock();
+        try
+        {
+            task();
+        }
+        catch(const std::exception& e)
+        {
+            LOG_ERROR("Control callback failed: {}", e.what());
+        }
+        ++m_executed;
+        lock.lock();
+
+        // Keep the tasks of this key in order by only handing out the next one now that this one is done
+        auto strand = m_strands.find(key);
+        if(strand->second.tasks.empty())
+        {
+            m_strands.erase(strand);
+        }
+        else
+        {
+            m_ready.push_back(key);
+            m_condition.notify_one();
+        }
+    }
+}
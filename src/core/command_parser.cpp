@@ -0,0 +1,342 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+// Include the corresponding header file
+#include "hass_mqtt_device/core/command_parser.h"
+
+// Include any other necessary headers
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+
+static bool isWhitespace(char character)
+{
+    return character == ' ' || character == '\t' || character == '\n' || character == '\r';
+}
+
+static bool isDigit(char character)
+{
+    return character >= '0' && character <= '9';
+}
+
+/**
+ * @brief Find the end of a JSON number
+ *
+ * @param text The text to check
+ * @param position The start of the number
+ * @return The position after the number, or std::string_view::npos if it is not a valid JSON number
+ */
+static size_t scanNumber(std::string_view text, size_t position)
+{
+    if(position < text.size() && text[position] == '-')
+    {
+        ++position;
+    }
+    if(position >= text.size() || !isDigit(text[position]))
+    {
+        return std::string_view::npos;
+    }
+    // No leading zeros
+    if(text[position] == '0')
+    {
+        ++position;
+    }
+    else
+    {
+        while(position < text.size() && isDigit(text[position]))
+        {
+            ++position;
+        }
+    }
+    if(position < text.size() && text[position] == '.')
+    {
+        ++position;
+        if(position >= text.size() || !isDigit(text[position]))
+        {
+            return std::string_view::npos;
+        }
+        while(position < text.size() && isDigit(text[position]))
+        {
+            ++position;
+        }
+    }
+    if(position < text.size() && (text[position] == 'e' || text[position] == 'E'))
+    {
+        ++position;
+        if(position < text.size() && (text[position] == '+' || text[position] == '-'))
+        {
+            ++position;
+        }
+        if(position >= text.size() || !isDigit(text[position]))
+        {
+            return std::string_view::npos;
+        }
+        while(position < text.size() && isDigit(text[position]))
+        {
+            ++position;
+        }
+    }
+    return position;
+}
+
+/**
+ * @brief Find the end of a string without escapes
+ *
+ * @param text The text to check
+ * @param position The position after the opening quote
+ * @return The position of the closing quote, or std::string_view::npos if the string has escapes, control
+ * characters or no end
+ */
+static size_t scanString(std::string_view text, size_t position)
+{
+    for(; position < text.size(); ++position)
+    {
+        char character = text[position];
+        if(character == '"')
+        {
+            return position;
+        }
+        if(character == '\\' || static_cast<unsigned char>(character) < 0x20)
+        {
+            return std::string_view::npos;
+        }
+    }
+    return std::string_view::npos;
+}
+
+CommandParser::CommandParser(std::string_view payload)
+{
+    if(scan(payload))
+    {
+        m_scanned = true;
+        m_valid = true;
+        return;
+    }
+
+    // Not a shape the scanner knows, let the full parser handle it and report the errors
+    m_member_count = 0;
+    try
+    {
+        m_document = json::parse(payload);
+    }
+    catch(const json::exception& e)
+    {
+        m_error = e.what();
+        return;
+    }
+    if(!m_document.is_object())
+    {
+        m_error = "Payload is not a JSON object";
+        return;
+    }
+    m_valid = true;
+}
+
+bool CommandParser::scan(std::string_view payload)
+{
+    size_t position = 0;
+    auto skipWhitespace = [&]() {
+        while(position < payload.size() && isWhitespace(payload[position]))
+        {
+            ++position;
+        }
+    };
+
+    skipWhitespace();
+    if(position >= payload.size() || payload[position] != '{')
+    {
+        return false;
+    }
+    ++position;
+    skipWhitespace();
+    if(position < payload.size() && payload[position] == '}')
+    {
+        ++position;
+        skipWhitespace();
+        return position == payload.size();
+    }
+
+    while(true)
+    {
+        if(m_member_count == max_members || position >= payload.size() || payload[position] != '"')
+        {
+            return false;
+        }
+        size_t key_end = scanString(payload, position + 1);
+        if(key_end == std::string_view::npos)
+        {
+            return false;
+        }
+        Member& member = m_members[m_member_count];
+        member.key = payload.substr(position + 1, key_end - position - 1);
+        position = key_end + 1;
+
+        skipWhitespace();
+        if(position >= payload.size() || payload[position] != ':')
+        {
+            return false;
+        }
+        ++position;
+        skipWhitespace();
+        if(position >= payload.size())
+        {
+            return false;
+        }
+
+        char first = payload[position];
+        if(first == '"')
+        {
+            size_t value_end = scanString(payload, position + 1);
+            if(value_end == std::string_view::npos)
+            {
+                return false;
+            }
+            member.value = payload.substr(position + 1, value_end - position - 1);
+            member.type = MemberType::STRING;
+            position = value_end + 1;
+        }
+        else if(first == '-' || isDigit(first))
+        {
+            size_t value_end = scanNumber(payload, position);
+            if(value_end == std::string_view::npos)
+            {
+                return false;
+            }
+            member.value = payload.substr(position, value_end - position);
+            member.type = MemberType::NUMBER;
+            position = value_end;
+        }
+        else
+        {
+            bool found = false;
+            for(std::string_view literal : {"true", "false", "null"})
+            {
+                if(payload.compare(position, literal.size(), literal) == 0)
+                {
+                    member.value = literal;
+                    member.type = MemberType::LITERAL;
+                    position += literal.size();
+                    found = true;
+                    break;
+                }
+            }
+            // Nested objects and arrays end up here too
+            if(!found)
+            {
+                return false;
+            }
+        }
+        ++m_member_count;
+
+        skipWhitespace();
+        if(position >= payload.size())
+        {
+            return false;
+        }
+        if(payload[position] == ',')
+        {
+            ++position;
+            skipWhitespace();
+            continue;
+        }
+        if(payload[position] != '}')
+        {
+            return false;
+        }
+        ++position;
+        skipWhitespace();
+        return position == payload.size();
+    }
+}
+
+const CommandParser::Member* CommandParser::findMember(std::string_view key) const
+{
+    for(size_t i = m_member_count; i > 0; --i)
+    {
+        if(m_members[i - 1].key == key)
+        {
+            return &m_members[i - 1];
+        }
+    }
+    return nullptr;
+}
+
+bool CommandParser::contains(std::string_view key) const
+{
+    if(!m_valid)
+    {
+        return false;
+    }
+    if(m_scanned)
+    {
+        return findMember(key) != nullptr;
+    }
+    return m_document.contains(std::string(key));
+}
+
+std::optional<std::string_view> CommandParser::getString(std::string_view key) const
+{
+    if(!m_valid)
+    {
+        return std::nullopt;
+    }
+    if(m_scanned)
+    {
+        const Member* member = findMember(key);
+        if(member == nullptr || member->type != MemberType::STRING)
+        {
+            return std::nullopt;
+        }
+        return member->value;
+    }
+    auto value = m_document.find(std::string(key));
+    if(value == m_document.end() || !value->is_string())
+    {
+        return std::nullopt;
+    }
+    return std::string_view(value->get_ref<const std::string&>());
+}
+
+std::optional<double> CommandParser::getNumber(std::string_view key) const
+{
+    if(!m_valid)
+    {
+        return std::nullopt;
+    }
+    if(m_scanned)
+    {
+        const Member* member = findMember(key);
+        if(member == nullptr || member->type != MemberType::NUMBER)
+        {
+            return std::nullopt;
+        }
+        double number = 0;
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+        auto result = std::from_chars(member->value.data(), member->value.data() + member->value.size(), number);
+        if(result.ec != std::errc())
+        {
+            return std::nullopt;
+        }
+#else
+        // Older standard libraries can not parse floating point numbers with from_chars
+        char digits[64];
+        if(member->value.size() >= sizeof(digits))
+        {
+            return std::nullopt;
+        }
+        std::memcpy(digits, member->value.data(), member->value.size());
+        digits[member->value.size()] = '\0';
+        number = std::strtod(digits, nullptr);
+#endif
+        return number;
+    }
+    auto value = m_document.find(std::string(key));
+    if(value == m_document.end() || !value->is_number())
+    {
+        return std::nullopt;
+    }
+    return value->get<double>();
+}
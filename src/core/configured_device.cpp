@@ -0,0 +1,389 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+// Include the corresponding header file
+#include "hass_mqtt_device/core/configured_device.h"
+
+// Include any other necessary headers
+#include "hass_mqtt_device/core/device_base.h"
+#include "hass_mqtt_device/core/slow_pwm.h"
+#include "hass_mqtt_device/core/state_store.h"
+#include "hass_mqtt_device/functions/number.h"
+#include "hass_mqtt_device/functions/sensor.h"
+#include "hass_mqtt_device/functions/sensor_attributes_factory.hpp"
+#include "hass_mqtt_device/functions/switch.h"
+#include "hass_mqtt_device/logger/logger.hpp" // For logging
+#include <stdexcept>
+
+namespace
+{
+// Log and throw a config error for a function
+[[noreturn]] void configError(const std::string& name, const std::string& error)
+{
+    LOG_ERROR("Function {} in config: {}", name, error);
+    throw std::invalid_argument("Function " + name + " in config: " + error);
+}
+
+const nlohmann::json& requireObject(const nlohmann::json& parent, const char* key, const std::string& name)
+{
+    if(!parent.contains(key) || !parent[key].is_object())
+    {
+        configError(name, std::string("missing object ") + key);
+    }
+    return parent[key];
+}
+
+double requireNumber(const nlohmann::json& parent, const char* key, const std::string& name)
+{
+    if(!parent.contains(key) || !parent[key].is_number())
+    {
+        configError(name, std::string("missing number ") + key);
+    }
+    return parent[key].get<double>();
+}
+
+int requireGpio(const nlohmann::json& usage, const std::string& name)
+{
+    if(!usage.contains("gpio") || !usage["gpio"].is_number_integer())
+    {
+        configError(name, "missing gpio");
+    }
+    return usage["gpio"].get<int>();
+}
+
+bool optionalBool(const nlohmann::json& parent, const char* key, bool fallback, const std::string& name)
+{
+    if(!parent.contains(key))
+    {
+        return fallback;
+    }
+    if(!parent[key].is_boolean())
+    {
+        configError(name, std::string(key) + " is not a boolean");
+    }
+    return parent[key].get<bool>();
+}
+} // namespace
+
+ConfiguredDevice::ConfiguredDevice(const nlohmann::json& functions)
+{
+    if(!functions.is_array())
+    {
+        LOG_ERROR("The functions of the config are not an array");
+        throw std::invalid_argument("The functions of the config are not an array");
+    }
+    for(const auto& function : functions)
+    {
+        auto config = parseFunction(function);
+        size_t index = m_configs.size();
+        if(!m_names.emplace(config.name, index).second)
+        {
+            configError(config.name, "the name is used more than once");
+        }
+        if(config.usage == FunctionConfig::Usage::ONE_WIRE && !m_probes.emplace(config.probe_id, index).second)
+        {
+            configError(config.name, "probe " + config.probe_id + " is used more than once");
+        }
+        m_configs.push_back(std::move(config));
+    }
+    m_states.resize(m_configs.size());
+    m_functions.resize(m_configs.size());
+}
+
+FunctionConfig ConfiguredDevice::parseFunction(const nlohmann::json& function)
+{
+    if(!function.is_object() || !function.contains("name") || !function["name"].is_string())
+    {
+        LOG_ERROR("Function in config has no name: {}", function.dump());
+        throw std::invalid_argument("Function in config has no name");
+    }
+    FunctionConfig config;
+    config.name = function["name"].get<std::string>();
+    if(!function.contains("type") || !function["type"].is_string())
+    {
+        configError(config.name, "missing type");
+    }
+    const auto& parameters = requireObject(function, "parameters", config.name);
+    const auto& usage = requireObject(function, "usage", config.name);
+    auto type = function["type"].get<std::string>();
+    auto usage_type = usage.contains("type") && usage["type"].is_string() ? usage["type"].get<std::string>() : "";
+
+    if(type == "number")
+    {
+        config.type = FunctionConfig::Type::NUMBER;
+        config.min = requireNumber(parameters, "min", config.name);
+        config.max = requireNumber(parameters, "max", config.name);
+        config.step = requireNumber(parameters, "step", config.name);
+        if(config.min >= config.max || config.step <= 0)
+        {
+            configError(config.name, "min must be below max, and step above zero");
+        }
+        if(usage_type == "pwm")
+        {
+            config.usage = FunctionConfig::Usage::PWM;
+            config.gpio = requireGpio(usage, config.name);
+            config.active_state = optionalBool(usage, "active_state", true, config.name);
+            config.period =
+                std::chrono::milliseconds(static_cast<int64_t>(requireNumber(usage, "period", config.name)));
+            if(config.period <= std::chrono::milliseconds(0))
+            {
+                configError(config.name, "period must be above zero");
+            }
+            if(usage.contains("offset"))
+            {
+                config.offset =
+                    std::chrono::milliseconds(static_cast<int64_t>(requireNumber(usage, "offset", config.name)));
+            }
+        }
+        else if(usage_type == "analog")
+        {
+            config.usage = FunctionConfig::Usage::ANALOG;
+            config.gpio = requireGpio(usage, config.name);
+        }
+        else
+        {
+            configError(config.name, "usage type of a number must be pwm or analog");
+        }
+    }
+    else if(type == "switch")
+    {
+        config.type = FunctionConfig::Type::SWITCH;
+        if(usage_type != "onoff")
+        {
+            configError(config.name, "usage type of a switch must be onoff");
+        }
+        config.usage = FunctionConfig::Usage::ONOFF;
+        config.gpio = requireGpio(usage, config.name);
+        config.active_state = optionalBool(usage, "active_state", true, config.name);
+    }
+    else if(type == "temp")
+    {
+        config.type = FunctionConfig::Type::TEMPERATURE;
+        if(usage_type != "1w")
+        {
+            configError(config.name, "usage type of a temp must be 1w");
+        }
+        config.usage = FunctionConfig::Usage::ONE_WIRE;
+        if(!usage.contains("id") || !usage["id"].is_string())
+        {
+            configError(config.name, "missing 1w probe id");
+        }
+        config.probe_id = usage["id"].get<std::string>();
+    }
+    else
+    {
+        configError(config.name, "unknown type " + type);
+    }
+    return config;
+}
+
+void ConfiguredDevice::setOutputWriter(std::function<void(int gpio, bool level)> writer)
+{
+    m_output_writer = std::move(writer);
+}
+
+void ConfiguredDevice::setChangeListener(std::function<void(size_t index, const FunctionState& state)> listener)
+{
+    m_change_listener = std::move(listener);
+}
+
+void ConfiguredDevice::setStateStore(std::shared_ptr<StateStore> store)
+{
+    m_state_store = std::move(store);
+    for(size_t index = 0; index < m_configs.size(); ++index)
+    {
+        if(m_configs[index].type == FunctionConfig::Type::TEMPERATURE)
+        {
+            continue;
+        }
+        if(auto value = m_state_store->get(m_configs[index].name))
+        {
+            LOG_DEBUG("Restoring {} to {}", m_configs[index].name, *value);
+            setValue(index, *value);
+        }
+        else if(m_states[index].has_value)
+        {
+            m_state_store->set(m_configs[index].name, m_states[index].value);
+        }
+    }
+}
+
+std::shared_ptr<DeviceBase> ConfiguredDevice::build(const std::string& device_name,
+                                                    const std::string& id,
+                                                    const std::shared_ptr<SlowPwm>& pwm)
+{
+    auto device = std::make_shared<DeviceBase>(device_name, id);
+    std::weak_ptr<ConfiguredDevice> weak_self = weak_from_this();
+    for(size_t index = 0; index < m_configs.size(); ++index)
+    {
+        const auto& config = m_configs[index];
+        auto& state = m_states[index];
+        auto& functions = m_functions[index];
+        switch(config.type)
+        {
+        case FunctionConfig::Type::NUMBER:
+        {
+            functions.number = std::make_shared<NumberFunction>(
+                config.name,
+                [weak_self, index](double value) {
+                    if(auto self = weak_self.lock())
+                    {
+                        self->setValue(index, value);
+                    }
+                },
+                config.max,
+                config.min,
+                config.step);
+            if(!state.has_value)
+            {
+                state.value = config.min;
+                state.has_value = true;
+            }
+            if(config.usage == FunctionConfig::Usage::PWM)
+            {
+                if(!pwm)
+                {
+                    configError(config.name, "a pwm number needs a PWM engine");
+                }
+                writeOutput(index, false);
+                pwm->bindNumber(
+                    functions.number,
+                    [weak_self, index](bool on) {
+                        if(auto self = weak_self.lock())
+                        {
+                            self->writeOutput(index, on);
+                        }
+                    },
+                    config.period,
+                    config.offset);
+            }
+            functions.number->update(state.value);
+            device->registerFunction(functions.number);
+            break;
+        }
+        case FunctionConfig::Type::SWITCH:
+        {
+            functions.on_off = std::make_shared<SwitchFunction>(config.name, [weak_self, index](bool on) {
+                if(auto self = weak_self.lock())
+                {
+                    self->setValue(index, on ? 1 : 0);
+                }
+            });
+            state.value = state.value != 0 ? 1 : 0;
+            state.has_value = true;
+            writeOutput(index, state.value != 0);
+            functions.on_off->update(state.value != 0);
+            device->registerFunction(functions.on_off);
+            break;
+        }
+        case FunctionConfig::Type::TEMPERATURE:
+        {
+            functions.sensor = std::make_shared<SensorFunction<double>>(config.name, getTemperatureSensorAttributes());
+            if(state.has_value)
+            {
+                functions.sensor->update(state.value);
+            }
+            device->registerFunction(functions.sensor);
+            break;
+        }
+        }
+    }
+    return device;
+}
+
+void ConfiguredDevice::setValue(size_t index, double value)
+{
+    if(index >= m_configs.size())
+    {
+        LOG_ERROR("Function {} does not exist", index);
+        return;
+    }
+    const auto& config = m_configs[index];
+    auto& state = m_states[index];
+    auto& functions = m_functions[index];
+    if(config.type == FunctionConfig::Type::SWITCH)
+    {
+        value = value != 0 ? 1 : 0;
+    }
+    if(state.has_value && state.value == value)
+    {
+        LOG_DEBUG("{} already set to {}", config.name, value);
+        return;
+    }
+    LOG_INFO("{} changed to {}", config.name, value);
+    state.value = value;
+    state.has_value = true;
+
+    // Before build() the value is only kept, to be used as the initial value. Before the device is registered, the
+    // functions keep it without publishing
+    if(functions.number)
+    {
+        functions.number->update(value);
+    }
+    else if(functions.on_off)
+    {
+        writeOutput(index, value != 0);
+        functions.on_off->update(value != 0);
+    }
+    else if(functions.sensor)
+    {
+        functions.sensor->update(value);
+    }
+
+    if(m_state_store && config.type != FunctionConfig::Type::TEMPERATURE)
+    {
+        m_state_store->set(config.name, value);
+    }
+    if(m_change_listener)
+    {
+        m_change_listener(index, state);
+    }
+}
+
+std::optional<size_t> ConfiguredDevice::find(const std::string& name) const
+{
+    auto found = m_names.find(name);
+    if(found == m_names.end())
+    {
+        return std::nullopt;
+    }
+    return found->second;
+}
+
+std::optional<size_t> ConfiguredDevice::findProbe(const std::string& probe_id) const
+{
+    auto found = m_probes.find(probe_id);
+    if(found == m_probes.end())
+    {
+        return std::nullopt;
+    }
+    return found->second;
+}
+
+std::shared_ptr<FunctionBase> ConfiguredDevice::getFunction(size_t index) const
+{
+    const auto& functions = m_functions.at(index);
+    if(functions.number)
+    {
+        return functions.number;
+    }
+    if(functions.on_off)
+    {
+        return functions.on_off;
+    }
+    return functions.sensor;
+}
+
+void ConfiguredDevice::writeOutput(size_t index, bool on)
+{
+    const auto& config = m_configs[index];
+    m_states[index].output = on;
+    if(config.gpio < 0 || !m_output_writer)
+    {
+        return;
+    }
+    m_output_writer(config.gpio, on ? config.active_state : !config.active_state);
+}
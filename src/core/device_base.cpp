@@ -6,55 +6,79 @@
 
 // Include the corresponding header file
 #include "hass_mqtt_device/core/device_base.h"
+#include "hass_mqtt_device/core/discovery_abbreviations.h"
 #include "hass_mqtt_device/core/function_base.h"
 #include "hass_mqtt_device/core/helper_functions.hpp"
 
 // Include any other necessary headers
 #include "hass_mqtt_device/logger/logger.hpp" // For logging
+#include <algorithm>
 
 DeviceBase::DeviceBase(const std::string& device_name, const std::string& id)
     : m_device_name(device_name)
     , m_id(getValidHassString(id))
+    , m_clean_name(getValidHassString(device_name))
 {
     LOG_DEBUG("Creating device with name: {} id {}", getName(), getId());
 }
 
-std::string DeviceBase::getId() const
+const std::string& DeviceBase::getId() const
 {
     return m_id;
 }
 
-std::string DeviceBase::getName() const
+const std::string& DeviceBase::getName() const
 {
     return m_device_name;
 }
 
-std::string DeviceBase::getCleanName() const
+const std::string& DeviceBase::getCleanName() const
 {
-    return getValidHassString(getName());
+    return m_clean_name;
 }
 
-std::string DeviceBase::getUniqueId() const
+const std::string& DeviceBase::getUniqueId() const
 {
-    // Get the connector
-    if(auto connector = m_connector.lock())
+    // If the connector is no longer alive, throw
+    if(!isRegistered())
+    {
+        throw std::runtime_error("MQTTConnector is not alive");
+    }
+    return m_unique_id;
+}
+
+const std::string& DeviceBase::getFullId() const
+{
+    // Same requirements as the unique id
+    if(!isRegistered())
+    {
+        throw std::runtime_error("MQTTConnector is not alive");
+    }
+    return m_full_id;
+}
+
+void DeviceBase::setParentConnector(std::weak_ptr<MQTTConnector> connector)
+{
+    m_connector = connector;
+
+    // Compute the identity strings once, they only change if the connector changes
+    m_unique_id.clear();
+    m_full_id.clear();
+    if(auto parent = m_connector.lock())
     {
-        // Return the full id
-        std::string unique_id = connector->getId();
+        m_unique_id = parent->getId();
         if(!m_id.empty())
         {
-            unique_id += "_" + m_id;
+            m_unique_id += "_" + m_id;
         }
-        return unique_id;
+        m_full_id = m_unique_id + "_" + m_clean_name;
     }
-    // If the connector is no longer alive, throw
-    throw std::runtime_error("MQTTConnector is not alive");
-}
 
-std::string DeviceBase::getFullId() const
-{
-    // Return the full id
-    return getUniqueId() + "_" + getCleanName();
+    // The functions derive their identity from ours
+    for(auto& function : m_functions)
+    {
+        function->refreshIdentity();
+    }
 }
 
 std::vector<std::string> DeviceBase::getSubscribeTopics() const
@@ -107,25 +131,39 @@ std::shared_ptr<FunctionBase> DeviceBase::findFunction(const std::string& name)
     return std::shared_ptr<FunctionBase>();
 }
 
+std::string DeviceBase::getDiscoveryTopic() const
+{
+    return "homeassistant/device/" + getFullId() + "/config";
+}
+
 void DeviceBase::sendDiscovery()
 {
     // Get availability topic from m_connector
-    std::string availabilityTopic;
-    if(auto connector = m_connector.lock())
-    {
-        availabilityTopic = connector->getAvailabilityTopic();
-    }
-    else
+    auto connector = m_connector.lock();
+    if(!connector)
     {
         LOG_ERROR("Failed to send discovery message for device {}-{}: MQTTConnector is no longer alive",
                   getName(),
                   getId());
         throw std::runtime_error("Failed to send discovery message for device: MQTTConnector is no longer alive");
     }
+    const std::string& availabilityTopic = connector->getAvailabilityTopic();
+    bool compact = connector->isCompactDiscovery();
+    bool perDevice = connector->getDiscoveryMode() == DiscoveryMode::PER_DEVICE;
+
+    json device = {{"name", getName()},
+                   {"identifiers", {m_id}},
+                   {"manufacturer", "Homebrew"},
+                   {"model", "hass_mqtt_device"},
+                   {"sw_version", "0.1.0"}};
 
     // Loop through all functions and gather their discovery parts
     LOG_DEBUG("Sending discovery for device: {}", getName());
     std::map<std::string, json> discoveryParts;
+    std::map<std::string, PublishPolicy> discoveryPolicies;
+    // In device based discovery, the one message gets the highest QoS of the functions, and is retained if any is
+    PublishPolicy devicePolicy{0, false};
+    json components = json::object();
     for(auto& function : m_functions)
     {
         LOG_DEBUG("Sending discovery for function {}", function->getName());
@@ -139,25 +177,70 @@ void DeviceBase::sendDiscovery()
         }
 
         discoveryJson["schema"] = "json";
-        discoveryJson["availability_topic"] = availabilityTopic;
-        discoveryJson["availability_template"] = "{{ value_json.availability }}";
+        if(function->getSubscribeQos() > 0)
+        {
+            // Home Assistant publishes the commands with this QoS
+            discoveryJson["qos"] = function->getSubscribeQos();
+        }
+        auto policy = function->getPublishPolicy(TopicKind::DISCOVERY);
+        discoveryPolicies[discoveryTopic] = policy;
+        devicePolicy.qos = std::max(devicePolicy.qos, policy.qos);
+        devicePolicy.retain = devicePolicy.retain || policy.retain;
+        if(perDevice)
+        {
+            // The device and availability are shared by all components, and given once for the device
+            discoveryJson["platform"] = function->getPlatform();
+        }
+        else
+        {
+            discoveryJson["availability_topic"] = availabilityTopic;
+            discoveryJson["availability_template"] = "{{ value_json.availability }}";
 
-        // Add the device info to the discovery json
-        discoveryJson["device"] = {{"name", getName()},
-                                   {"identifiers", {m_id}},
-                                   {"manufacturer", "Homebrew"},
-                                   {"model", "hass_mqtt_device"},
-                                   {"sw_version", "0.1.0"}};
+            // Add the device info to the discovery json
+            discoveryJson["device"] = device;
+        }
 
-        discoveryParts[discoveryTopic] = discoveryJson;
+        if(compact)
+        {
+            discoveryJson = abbreviateDiscoveryJson(discoveryJson, function->getBaseTopic());
+        }
+        if(perDevice)
+        {
+            components[function->getCleanName()] = discoveryJson;
+            discoveryParts[discoveryTopic] = json();
+        }
+        else
+        {
+            discoveryParts[discoveryTopic] = discoveryJson;
+        }
+    }
+
+    if(perDevice)
+    {
+        // One message for the whole device
+        json discoveryJson;
+        discoveryJson["device"] = device;
+        discoveryJson["origin"] = {{"name", "hass_mqtt_device"}, {"sw_version", "0.1.0"}};
+        discoveryJson["availability_topic"] = availabilityTopic;
+        discoveryJson["availability_template"] = "{{ value_json.availability }}";
+        discoveryJson["components"] = components;
+        if(compact)
+        {
+            discoveryJson = abbreviateDiscoveryJson(discoveryJson, "");
+        }
+        discoveryParts.clear();
+        discoveryParts[getDiscoveryTopic()] = discoveryJson;
+        discoveryPolicies[getDiscoveryTopic()] = devicePolicy;
     }
+
     // Now to send the discovery messages
     for(auto& discoveryPart : discoveryParts)
     {
         LOG_DEBUG("Sending discovery message to topic: {}", discoveryPart.first);
         try
         {
-            publishMessage(discoveryPart.first, discoveryPart.second);
+            connector->publishDiscovery(
+                discoveryPart.first, discoveryPart.second.dump(), discoveryPolicies[discoveryPart.first]);
         }
         catch(const std::exception& e)
         {
@@ -167,6 +250,27 @@ void DeviceBase::sendDiscovery()
     }
 }
 
+void DeviceBase::clearDiscovery()
+{
+    auto connector = m_connector.lock();
+    if(!connector)
+    {
+        LOG_ERROR("Failed to clear discovery for device {}-{}: MQTTConnector is no longer alive", getName(), getId());
+        throw std::runtime_error("Failed to clear discovery for device: MQTTConnector is no longer alive");
+    }
+
+    LOG_DEBUG("Clearing discovery for device: {}", getName());
+    if(connector->getDiscoveryMode() == DiscoveryMode::PER_DEVICE)
+    {
+        connector->publishDiscovery(getDiscoveryTopic(), "");
+        return;
+    }
+    for(auto& function : m_functions)
+    {
+        connector->publishDiscovery(function->getDiscoveryTopic(), "");
+    }
+}
+
 void DeviceBase::processMessage(const std::string& topic, const std::string& payload)
 {
     LOG_DEBUG("Processing message for device {} with topic {}", getName(), topic);
@@ -182,13 +286,39 @@ void DeviceBase::processMessage(const std::string& topic, const std::string& pay
     }
 }
 
-void DeviceBase::publishMessage(const std::string& topic, const json& payload)
+void DeviceBase::publishMessage(const std::string& topic, const json& payload, PublishPolicy policy)
 {
     // Check if the connector is still alive
     if(auto connector = m_connector.lock())
     {
         // Publish the message
-        connector->publishMessage(topic, payload);
+        connector->publishMessage(topic, payload, policy);
+    }
+    else
+    {
+        LOG_ERROR("Failed to publish MQTT message: MQTTConnector is no longer alive");
+        throw std::runtime_error("Failed to publish MQTT message: MQTTConnector is no longer alive");
+    }
+}
+
+void DeviceBase::publishRawMessage(const std::string& topic, const std::string& payload, PublishPolicy policy)
+{
+    if(auto connector = m_connector.lock())
+    {
+        connector->publishRawMessage(topic, payload, policy);
+    }
+    else
+    {
+        LOG_ERROR("Failed to publish MQTT message: MQTTConnector is no longer alive");
+        throw std::runtime_error("Failed to publish MQTT message: MQTTConnector is no longer alive");
+    }
+}
+
+void DeviceBase::publishTelemetry(const std::string& topic, const std::string& payload, PublishPolicy policy)
+{
+    if(auto connector = m_connector.lock())
+    {
+        connector->publishTelemetry(topic, payload, policy);
     }
     else
     {
@@ -197,13 +327,47 @@ void DeviceBase::publishMessage(const std::string& topic, const json& payload)
     }
 }
 
+void DeviceBase::dispatchControl(const void* key, std::function<void()> task)
+{
+    if(auto connector = m_connector.lock())
+    {
+        connector->dispatchControl(key, std::move(task));
+    }
+    else
+    {
+        task();
+    }
+}
+
+void DeviceBase::dispatchControlAt(const void* key,
+                                   std::chrono::steady_clock::time_point when,
+                                   std::function<void()> task)
+{
+    auto connector = m_connector.lock();
+    if(!connector)
+    {
+        task();
+        return;
+    }
+    // Hold the connector weakly, the deferred task is owned by it
+    std::weak_ptr<MQTTConnector> weak_connector = connector;
+    connector->callAt(when, [weak_connector, key, task = std::move(task)]() mutable {
+        if(auto connector = weak_connector.lock())
+        {
+            connector->dispatchControl(key, std::move(task));
+        }
+    });
+}
+
 void DeviceBase::sendStatus()
 {
     // Get availability topic from m_connector
     std::string availabilityTopic;
+    PublishPolicy availabilityPolicy;
     if(auto connector = m_connector.lock())
     {
         availabilityTopic = connector->getAvailabilityTopic();
+        availabilityPolicy = connector->getAvailabilityPolicy();
     }
     else
     {
@@ -217,7 +381,7 @@ void DeviceBase::sendStatus()
     json payload;
     payload["availability"] = "online";
 
-    publishMessage(availabilityTopic, payload);
+    publishMessage(availabilityTopic, payload, availabilityPolicy);
 
     // Publish the availability and status messages for all functions
     for(auto& function : m_functions)
@@ -0,0 +1,129 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+// Include the corresponding header file
+#include "hass_mqtt_device/core/discovery_abbreviations.h"
+
+// Include any other necessary headers
+#include <string_view>
+#include <unordered_map>
+
+// The abbreviations for the keys used by the functions of this library, taken from
+// homeassistant/components/mqtt/abbreviations.py. Only add keys that are listed there, Home Assistant rejects
+// unknown keys
+static const std::unordered_map<std::string_view, std::string_view> abbreviations = {
+    {"action_template", "act_tpl"},
+    {"action_topic", "act_t"},
+    {"availability_template", "avty_tpl"},
+    {"availability_topic", "avty_t"},
+    {"command_topic", "cmd_t"},
+    {"components", "cmps"},
+    {"current_humidity_template", "curr_hum_tpl"},
+    {"current_humidity_topic", "curr_hum_t"},
+    {"current_temperature_template", "curr_temp_tpl"},
+    {"current_temperature_topic", "curr_temp_t"},
+    {"device", "dev"},
+    {"device_class", "dev_cla"},
+    {"fan_mode_command_template", "fan_mode_cmd_tpl"},
+    {"fan_mode_command_topic", "fan_mode_cmd_t"},
+    {"fan_mode_state_template", "fan_mode_stat_tpl"},
+    {"fan_mode_state_topic", "fan_mode_stat_t"},
+    {"json_attributes_topic", "json_attr_t"},
+    {"mode_command_template", "mode_cmd_tpl"},
+    {"mode_command_topic", "mode_cmd_t"},
+    {"mode_state_template", "mode_stat_tpl"},
+    {"mode_state_topic", "mode_stat_t"},
+    {"origin", "o"},
+    {"payload_off", "pl_off"},
+    {"payload_on", "pl_on"},
+    {"platform", "p"},
+    {"power_command_topic", "pow_cmd_t"},
+    {"preset_mode_command_template", "pr_mode_cmd_tpl"},
+    {"preset_mode_command_topic", "pr_mode_cmd_t"},
+    {"preset_mode_state_topic", "pr_mode_stat_t"},
+    {"preset_mode_value_template", "pr_mode_val_tpl"},
+    {"preset_modes", "pr_modes"},
+    {"state_class", "stat_cla"},
+    {"state_topic", "stat_t"},
+    {"suggested_display_precision", "sug_dsp_prc"},
+    {"swing_mode_command_template", "swing_mode_cmd_tpl"},
+    {"swing_mode_command_topic", "swing_mode_cmd_t"},
+    {"swing_mode_state_template", "swing_mode_stat_tpl"},
+    {"swing_mode_state_topic", "swing_mode_stat_t"},
+    {"target_humidity_command_template", "hum_cmd_tpl"},
+    {"target_humidity_command_topic", "hum_cmd_t"},
+    {"target_humidity_state_template", "hum_state_tpl"},
+    {"target_humidity_state_topic", "hum_stat_t"},
+    {"temperature_high_command_template", "temp_hi_cmd_tpl"},
+    {"temperature_high_command_topic", "temp_hi_cmd_t"},
+    {"temperature_high_state_template", "temp_hi_stat_tpl"},
+    {"temperature_high_state_topic", "temp_hi_stat_t"},
+    {"temperature_low_command_template", "temp_lo_cmd_tpl"},
+    {"temperature_low_command_topic", "temp_lo_cmd_t"},
+    {"temperature_low_state_template", "temp_lo_stat_tpl"},
+    {"temperature_low_state_topic", "temp_lo_stat_t"},
+    {"unique_id", "uniq_id"},
+    {"unit_of_measurement", "unit_of_meas"},
+    {"value_template", "val_tpl"},
+};
+
+// The abbreviations for the keys of the device and origin blocks
+static const std::unordered_map<std::string_view, std::string_view> device_abbreviations = {
+    {"identifiers", "ids"},
+    {"manufacturer", "mf"},
+    {"model", "mdl"},
+    {"support_url", "url"},
+    {"sw_version", "sw"},
+};
+
+static std::string abbreviate(const std::unordered_map<std::string_view, std::string_view>& table,
+                              const std::string& key)
+{
+    auto abbreviation = table.find(key);
+    if(abbreviation == table.end())
+    {
+        return key;
+    }
+    return std::string(abbreviation->second);
+}
+
+json abbreviateDiscoveryJson(const json& discovery, const std::string& base_topic)
+{
+    json compact = json::object();
+    bool uses_base_topic = false;
+    for(const auto& [key, value] : discovery.items())
+    {
+        if((key == "device" || key == "origin") && value.is_object())
+        {
+            json device = json::object();
+            for(const auto& [device_key, device_value] : value.items())
+            {
+                device[abbreviate(device_abbreviations, device_key)] = device_value;
+            }
+            compact[abbreviate(abbreviations, key)] = device;
+            continue;
+        }
+
+        // Home Assistant expands a leading "~" in the values of topic keys
+        bool is_topic = key.size() > 6 && key.compare(key.size() - 6, 6, "_topic") == 0;
+        if(is_topic && !base_topic.empty() && value.is_string())
+        {
+            const auto& topic = value.get_ref<const std::string&>();
+            if(topic.compare(0, base_topic.size(), base_topic) == 0)
+            {
+                compact[abbreviate(abbreviations, key)] = "~" + topic.substr(base_topic.size());
+                uses_base_topic = true;
+                continue;
+            }
+        }
+        compact[abbreviate(abbreviations, key)] = value;
+    }
+    if(uses_base_topic)
+    {
+        compact["~"] = base_topic;
+    }
+    return compact;
+}
@@ -14,37 +14,136 @@
 
 FunctionBase::FunctionBase(const std::string& function_name)
     : m_function_name(function_name)
+    , m_clean_name(getValidHassString(function_name))
 {
 }
 
-std::string FunctionBase::getName() const
+const std::string& FunctionBase::getName() const
 {
     return m_function_name;
 }
 
-std::string FunctionBase::getCleanName() const
+const std::string& FunctionBase::getCleanName() const
 {
-    return getValidHassString(getName());
+    return m_clean_name;
 }
 
-std::string FunctionBase::getId() const
+const std::string& FunctionBase::getId() const
+{
+    return m_id;
+}
+
+std::string FunctionBase::getPlatform() const
+{
+    // The discovery topic is homeassistant/<platform>/<node_id>/<object_id>/config
+    auto topic = getDiscoveryTopic();
+    auto start = topic.find('/');
+    auto end = topic.find('/', start + 1);
+    if(start == std::string::npos || end == std::string::npos)
+    {
+        LOG_ERROR("Can not find the platform in discovery topic {}", topic);
+        return "";
+    }
+    return topic.substr(start + 1, end - start - 1);
+}
+
+std::vector<std::string> FunctionBase::getRestoreTopics() const
+{
+    return {};
+}
+
+void FunctionBase::restoreState(const std::string& topic, const std::string& /*payload*/)
+{
+    LOG_DEBUG("Function {} does not restore its state from {}", getName(), topic);
+}
+
+void FunctionBase::setPublishPolicy(TopicKind kind, PublishPolicy policy)
+{
+    validateQos(policy.qos);
+    m_publish_policies[static_cast<size_t>(kind)] = policy;
+}
+
+void FunctionBase::setSubscribeQos(int qos)
+{
+    validateQos(qos);
+    m_subscribe_qos = qos;
+}
+
+const std::string& FunctionBase::getBaseTopic() const
+{
+    return m_base_topic;
+}
+
+bool FunctionBase::isTopic(const std::string& topic, std::string_view sub_topic) const
+{
+    if(m_base_topic.empty() || topic.size() != m_base_topic.size() + sub_topic.size())
+    {
+        return false;
+    }
+    return topic.compare(0, m_base_topic.size(), m_base_topic) == 0 &&
+           topic.compare(m_base_topic.size(), std::string::npos, sub_topic.data(), sub_topic.size()) == 0;
+}
+
+void FunctionBase::publishState(const std::string& payload) const
+{
+    // The state is sent when the device is registered, so values set before that are only kept
+    auto parent = m_parent_device.lock();
+    if(!parent || !parent->isRegistered())
+    {
+        return;
+    }
+    parent->publishRawMessage(m_state_topic, payload, getPublishPolicy(TopicKind::STATE));
+}
+
+void FunctionBase::publishTelemetryState(const std::string& payload) const
+{
+    auto parent = m_parent_device.lock();
+    if(!parent || !parent->isRegistered())
+    {
+        return;
+    }
+    parent->publishTelemetry(m_state_topic, payload, getPublishPolicy(TopicKind::TELEMETRY));
+}
+
+void FunctionBase::dispatchControl(std::function<void()> task) const
 {
     auto parent = m_parent_device.lock();
     if(!parent)
     {
         LOG_ERROR("Parent device is not available.");
-        return "";
+        return;
     }
-    return parent->getFullId() + "_" + getCleanName();
+    parent->dispatchControl(this, std::move(task));
 }
 
-std::string FunctionBase::getBaseTopic() const
+void FunctionBase::dispatchControlAt(std::chrono::steady_clock::time_point when, std::function<void()> task) const
 {
     auto parent = m_parent_device.lock();
     if(!parent)
     {
         LOG_ERROR("Parent device is not available.");
-        return "";
+        return;
     }
-    return "home/" + parent->getFullId() + "/" + getCleanName() + "/";
-};
+    parent->dispatchControlAt(this, when, std::move(task));
+}
+
+void FunctionBase::refreshIdentity()
+{
+    m_id.clear();
+    m_base_topic.clear();
+    m_state_topic.clear();
+    auto parent = m_parent_device.lock();
+    if(!parent)
+    {
+        LOG_ERROR("Parent device is not available.");
+        return;
+    }
+    if(!parent->isRegistered())
+    {
+        // Not registered with a connector yet, will be refreshed when it is
+        return;
+    }
+    m_id = parent->getFullId() + "_" + m_clean_name;
+    m_base_topic = "home/" + parent->getFullId() + "/" + m_clean_name + "/";
+    m_state_topic = m_base_topic + "state";
+}
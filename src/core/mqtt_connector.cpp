@@ -1,17 +1,32 @@
 // Include the corresponding header file
 #include "hass_mqtt_device/core/mqtt_connector.h"
 #include "hass_mqtt_device/core/device_base.h"
+#include "hass_mqtt_device/core/function_base.h"
 
 // Include any other necessary headers
+#include "hass_mqtt_device/core/helper_functions.hpp"
 #include "hass_mqtt_device/logger/logger.hpp" // For logging
-#include <array>
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
 #include <mosquitto.h>
+#include <poll.h>
 #include <string>
+#include <sys/eventfd.h>
 #include <thread>
+#include <unistd.h>
 
-constexpr std::array<int, 8> backoff_ladder = {1000, 1000, 5000, 5000, 5000, 15000, 30000, 30000};
-int backoff_state = 0;
+constexpr std::chrono::milliseconds default_reconnect_min_delay(1000);
+constexpr std::chrono::milliseconds default_reconnect_max_delay(30000);
+// Give up on a connection attempt the server has not answered in this time
+constexpr std::chrono::seconds connect_timeout(10);
+// The publish queue of a caller driven loop, startNetworkThread() chooses the size otherwise
+constexpr size_t default_publish_queue_size = 1024;
+constexpr int keepalive_seconds = 60;
 
 // Constructor implementation
 MQTTConnector::MQTTConnector(const std::string& server,
@@ -24,24 +39,70 @@ MQTTConnector::MQTTConnector(const std::string& server,
     , m_username(username)
     , m_password(password)
     , m_unique_id(unique_id)
+    , m_availability_topic("home/" + unique_id + "/availability")
     , m_mosquitto(nullptr)
+    , m_reconnect_min_delay(default_reconnect_min_delay)
+    , m_reconnect_max_delay(default_reconnect_max_delay)
+    , m_reconnect_random(std::random_device{}())
 {
     LOG_DEBUG("MQTTConnector created with server: {}", server);
 
     // Initialize the MQTT library
     mosquitto_lib_init();
+
+    m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_wake_fd < 0)
+    {
+        LOG_WARN("Failed to create the wake up descriptor, work from other threads waits for the loop timeout: {}",
+                 std::strerror(errno));
+    }
+}
+
+MQTTConnector::~MQTTConnector()
+{
+    stopNetworkThread();
+    if(m_mosquitto != nullptr)
+    {
+        mosquitto_destroy(m_mosquitto);
+    }
+    if(m_wake_fd >= 0)
+    {
+        close(m_wake_fd);
+    }
 }
 
-std::string MQTTConnector::getAvailabilityTopic() const
+const std::string& MQTTConnector::getAvailabilityTopic() const
 {
-    std::string topic = "home/" + getId() + "/availability";
-    return topic;
+    return m_availability_topic;
 };
 
 // Connect to the MQTT server
 bool MQTTConnector::connect()
 {
+    // The mosquitto instance belongs to the thread running the network loop
+    if(!onNetworkThread())
+    {
+        runOnNetworkThread([this]() { connect(); });
+        return true;
+    }
+
+    m_stay_disconnected = false;
+    auto state = m_connection_state.load();
+    if(state == ConnectionState::CONNECTING || state == ConnectionState::CONNECTED)
+    {
+        return true;
+    }
     LOG_DEBUG("Connecting to MQTT server: {}", m_server);
+    m_reconnect_attempt = 0;
+    return startConnect();
+}
+
+bool MQTTConnector::createMosquitto()
+{
+    if(m_mosquitto != nullptr)
+    {
+        return true;
+    }
 
     m_mosquitto = mosquitto_new(nullptr, true, this);
     if(m_mosquitto == nullptr)
@@ -59,38 +120,153 @@ bool MQTTConnector::connect()
     mosquitto_subscribe_callback_set(m_mosquitto, subscribeCallback);
     mosquitto_unsubscribe_callback_set(m_mosquitto, unsubscribeCallback);
     mosquitto_message_callback_set(m_mosquitto, messageCallback);
+    mosquitto_publish_callback_set(m_mosquitto, publishCallback);
 
     // Set the lwt availability topic for all devices
     publishLWT();
+    return true;
+}
 
-    int rc = mosquitto_connect(m_mosquitto, m_server.c_str(), m_port, 60);
-    if(rc != MOSQ_ERR_SUCCESS)
+bool MQTTConnector::startConnect()
+{
+    if(!createMosquitto())
     {
-        LOG_ERROR("Failed to connect to MQTT server: {}", mosquitto_strerror(rc));
+        scheduleReconnect();
         return false;
     }
-    LOG_DEBUG("Connected to MQTT server: {}", m_server);
-    m_is_connected = true;
 
+    m_connection_state = ConnectionState::CONNECTING;
+    m_connect_started = std::chrono::steady_clock::now();
+
+    // The same instance is reused for every attempt, so the subscriptions and queued messages are kept
+    int rc = MOSQ_ERR_SUCCESS;
+    if(m_connect_configured)
+    {
+        rc = mosquitto_reconnect_async(m_mosquitto);
+    }
+    else
+    {
+        rc = mosquitto_connect_async(m_mosquitto, m_server.c_str(), m_port, keepalive_seconds);
+        m_connect_configured = rc == MOSQ_ERR_SUCCESS;
+    }
+    if(rc != MOSQ_ERR_SUCCESS)
+    {
+        LOG_ERROR("Failed to connect to MQTT server {}: {}", m_server, mosquitto_strerror(rc));
+        scheduleReconnect();
+        return false;
+    }
     return true;
 }
 
+std::chrono::steady_clock::time_point MQTTConnector::serviceConnection()
+{
+    auto now = std::chrono::steady_clock::now();
+    switch(m_connection_state.load())
+    {
+    case ConnectionState::DISCONNECTED:
+        // Running the loop without calling connect() first also connects
+        if(!m_stay_disconnected)
+        {
+            connect();
+        }
+        break;
+    case ConnectionState::WAITING_TO_RECONNECT:
+        if(now < m_next_connect_attempt)
+        {
+            return m_next_connect_attempt;
+        }
+        LOG_DEBUG("Reconnecting to MQTT server: {}", m_server);
+        startConnect();
+        break;
+    case ConnectionState::CONNECTING:
+        if(now - m_connect_started < connect_timeout)
+        {
+            return m_connect_started + connect_timeout;
+        }
+        LOG_ERROR("Timed out connecting to MQTT server: {}", m_server);
+        scheduleReconnect();
+        break;
+    case ConnectionState::CONNECTED:
+        break;
+    }
+    if(m_connection_state == ConnectionState::WAITING_TO_RECONNECT)
+    {
+        return m_next_connect_attempt;
+    }
+    return std::chrono::steady_clock::time_point::max();
+}
+
+void MQTTConnector::scheduleReconnect()
+{
+    if(m_stay_disconnected)
+    {
+        m_connection_state = ConnectionState::DISCONNECTED;
+        failPendingAcknowledgements();
+        return;
+    }
+    if(m_connection_state == ConnectionState::WAITING_TO_RECONNECT)
+    {
+        // Both the loop and the disconnect callback report a lost connection
+        return;
+    }
+    failPendingAcknowledgements();
+
+    // Double the wait for every failed attempt, and take a random part of up to half of it off
+    auto ceiling = m_reconnect_max_delay;
+    if(m_reconnect_attempt < 16 && m_reconnect_min_delay * (1 << m_reconnect_attempt) < m_reconnect_max_delay)
+    {
+        ceiling = m_reconnect_min_delay * (1 << m_reconnect_attempt);
+    }
+    m_reconnect_attempt++;
+    std::uniform_int_distribution<std::chrono::milliseconds::rep> jitter(0, ceiling.count() / 2);
+    auto delay = ceiling - std::chrono::milliseconds(jitter(m_reconnect_random));
+
+    LOG_INFO("Reconnecting to MQTT server in {} ms", delay.count());
+    m_next_connect_attempt = std::chrono::steady_clock::now() + delay;
+    m_connection_state = ConnectionState::WAITING_TO_RECONNECT;
+}
+
+void MQTTConnector::setReconnectDelay(std::chrono::milliseconds min_delay, std::chrono::milliseconds max_delay)
+{
+    runOnNetworkThread([this, min_delay, max_delay]() {
+        m_reconnect_min_delay = std::max(min_delay, std::chrono::milliseconds(1));
+        m_reconnect_max_delay = std::max(max_delay, m_reconnect_min_delay);
+    });
+}
+
 // Disconnect from the MQTT server
 void MQTTConnector::disconnect()
 {
+    if(!onNetworkThread())
+    {
+        runOnNetworkThread([this]() { disconnect(); });
+        return;
+    }
+
     LOG_DEBUG("Disconnecting from MQTT server: {}", m_server);
-    mosquitto_disconnect(m_mosquitto);
+    m_stay_disconnected = true;
+    if(m_connection_state != ConnectionState::CONNECTED)
+    {
+        // Nothing to wait for, the disconnect callback only comes for an established connection
+        m_connection_state = ConnectionState::DISCONNECTED;
+    }
+    if(m_mosquitto != nullptr)
+    {
+        mosquitto_disconnect(m_mosquitto);
+    }
 }
 
 // Check if connected to the MQTT server
 bool MQTTConnector::isConnected() const
 {
-    return m_is_connected;
+    return m_connection_state == ConnectionState::CONNECTED;
 }
 
 // Register a device to listen for its MQTT topics
 void MQTTConnector::registerDevice(std::shared_ptr<DeviceBase> device)
 {
+    std::lock_guard<std::recursive_mutex> lock(m_devices_mutex);
+
     // Make sure the device is not already registered. Same Id is fine, but same
     // name and id is not
     for(auto& registered_device : m_registered_devices)
@@ -105,11 +281,20 @@ void MQTTConnector::registerDevice(std::shared_ptr<DeviceBase> device)
     device->setParentConnector(shared_from_this());
     m_registered_devices.push_back(device);
 
-    // If connected, subscribe to the topic
-    if(m_is_connected)
+    // If connected, subscribe to the topics of this device only and announce it
+    if(isConnected())
     {
-        disconnect();
-        connect();
+        runOnNetworkThread([this, device]() {
+            std::lock_guard<std::recursive_mutex> lock(m_devices_mutex);
+            if(!subscribeDevice(device))
+            {
+                // The connect callback subscribes all registered devices again, and announces them
+                scheduleReconnect();
+                return;
+            }
+            device->sendDiscovery();
+            device->sendStatus();
+        });
     }
     LOG_DEBUG("Device registered with name: {}", device->getName());
 }
@@ -117,10 +302,28 @@ void MQTTConnector::registerDevice(std::shared_ptr<DeviceBase> device)
 // Unregister a device
 void MQTTConnector::unregisterDevice(const std::string& device_name)
 {
+    std::lock_guard<std::recursive_mutex> lock(m_devices_mutex);
     for(auto it = m_registered_devices.begin(); it != m_registered_devices.end(); it++)
     {
         if((*it)->getId() == device_name)
         {
+            // Nobody can wait for commands to functions that are going away
+            runOnNetworkThread([this, device = *it]() {
+                for(const auto& function : device->getFunctions())
+                {
+                    m_command_waiters.erase(function.get());
+                }
+            });
+
+            // If connected, stop listening for this device and remove it from Home Assistant
+            if(isConnected())
+            {
+                runOnNetworkThread([this, device = *it]() {
+                    std::lock_guard<std::recursive_mutex> lock(m_devices_mutex);
+                    unsubscribeDevice(device);
+                    device->clearDiscovery();
+                });
+            }
             m_registered_devices.erase(it);
             break;
         }
@@ -130,6 +333,7 @@ void MQTTConnector::unregisterDevice(const std::string& device_name)
 // Get a device by name
 std::shared_ptr<DeviceBase> MQTTConnector::getDevice(const std::string& device_name) const
 {
+    std::lock_guard<std::recursive_mutex> lock(m_devices_mutex);
     for(const auto& device : m_registered_devices)
     {
         if(device->getName() == device_name || device->getCleanName() == device_name)
@@ -143,55 +347,55 @@ std::shared_ptr<DeviceBase> MQTTConnector::getDevice(const std::string& device_n
 // Process incoming MQTT messages
 void MQTTConnector::processMessages(int timeout, bool exit_on_event)
 {
-    if(!isConnected())
+    // The network thread does the work, just keep the timing of the caller's loop
+    if(m_network_thread_running)
     {
-        LOG_DEBUG("Not connected to MQTT server. Attempting to reconnect.");
-        static int slept_for = 0;
-        LOG_DEBUG("Slept since last reconnect try {}ms", slept_for);
         std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
-        slept_for += timeout;
-        if(slept_for < backoff_ladder[backoff_state])
-        {
-            return;
-        }
-        slept_for = 0;
-        backoff_state++;
-        if(backoff_state >= backoff_ladder.size())
-        {
-            backoff_state = backoff_ladder.size() - 1;
-        }
-
-        bool rc = connect();
-        if(!rc)
-        {
-            LOG_ERROR("Failed to reconnect to MQTT server: {}. Continuing to sleep "
-                      "and retry.",
-                      mosquitto_strerror(rc));
-            return;
-        }
-        backoff_state = 0;
+        return;
     }
+    runLoop(timeout, exit_on_event);
+}
+
+// Run the network loop
+void MQTTConnector::runLoop(int timeout, bool exit_on_event)
+{
+    claimLoopThread();
+    drainNetworkQueues();
 
-    // At this point, we are connected to the MQTT server
-    // Get the monotonic time when we should be done processing messages
     // Get the monotonic time when we should be done processing messages
     auto done = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
 
     while(true)
     {
+        auto next_task = runDeferredTasks();
+        auto next_connection_event = serviceConnection();
         auto now = std::chrono::steady_clock::now();
         if(now >= done)
         {
             break;
         }
 
-        // How much time left till done
-        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(done - now);
-        int rc = mosquitto_loop(m_mosquitto, remaining.count(), 1);
-        if(rc != MOSQ_ERR_SUCCESS && rc != MOSQ_ERR_NO_CONN)
+        // How much time left till done, or till the next deferred task or connection attempt is due
+        auto wake = std::min({done, next_task, next_connection_event});
+        // mosquitto waits its default second on a negative timeout, so do not wait for work that is already due. Round
+        // up, so the loop does not spin on a wait of less than a millisecond
+        auto remaining =
+            std::max(std::chrono::ceil<std::chrono::milliseconds>(wake - now), std::chrono::milliseconds(0));
+        auto state = m_connection_state.load();
+        if(m_wake_fd >= 0)
         {
-            LOG_ERROR("Failed to process MQTT messages: {}", mosquitto_strerror(rc));
+            waitForNetwork(remaining);
         }
+        else if(state == ConnectionState::CONNECTING || state == ConnectionState::CONNECTED)
+        {
+            checkLoopResult(mosquitto_loop(m_mosquitto, static_cast<int>(remaining.count()), 1));
+        }
+        else
+        {
+            // No socket to wait on until the next connection attempt
+            std::this_thread::sleep_for(remaining);
+        }
+        drainNetworkQueues();
         if(exit_on_event)
         {
             break;
@@ -199,98 +403,1100 @@ void MQTTConnector::processMessages(int timeout, bool exit_on_event)
     }
 }
 
-// Publish a message
-void MQTTConnector::publishMessage(const std::string& topic, const json& payload)
+void MQTTConnector::checkLoopResult(int rc)
 {
-    std::string payload_str = payload.dump();
-    LOG_DEBUG("Publishing MQTT message to topic: {}", topic);
-    LOG_DEBUG("MQTT message payload: {}", payload_str);
-    int rc = mosquitto_publish(m_mosquitto, nullptr, topic.c_str(), payload_str.size(), payload_str.c_str(), 1, true);
     if(rc != MOSQ_ERR_SUCCESS)
     {
-        LOG_ERROR("Failed to publish MQTT message: {}", mosquitto_strerror(rc));
+        LOG_ERROR("Failed to process MQTT messages: {}", mosquitto_strerror(rc));
+        scheduleReconnect();
     }
 }
 
-// publish last will and testament
-void MQTTConnector::publishLWT()
+void MQTTConnector::waitForNetwork(std::chrono::milliseconds timeout)
 {
-    // Create the will message
-    json payload;
-    payload["availability"] = "offline";
+    // No socket to wait on until the next connection attempt, but still wake up for queued work
+    int socket = getSocket();
+    pollfd descriptors[2] = {{m_wake_fd, POLLIN, 0}, {socket, POLLIN, 0}};
+    if(socket != -1 && mosquitto_want_write(m_mosquitto))
+    {
+        descriptors[1].events |= POLLOUT;
+    }
+    nfds_t count = socket != -1 ? 2 : 1;
+    if(poll(descriptors, count, static_cast<int>(timeout.count())) < 0)
+    {
+        if(errno != EINTR)
+        {
+            LOG_ERROR("Failed to wait for the MQTT socket: {}", std::strerror(errno));
+        }
+        return;
+    }
+    if(socket == -1)
+    {
+        return;
+    }
+    if(descriptors[1].revents & (POLLIN | POLLERR | POLLHUP))
+    {
+        checkLoopResult(mosquitto_loop_read(m_mosquitto, 1));
+    }
+    if((descriptors[1].revents & POLLOUT) && getSocket() != -1)
+    {
+        checkLoopResult(mosquitto_loop_write(m_mosquitto, 1));
+    }
+    // Keepalive and retries, like mosquitto_loop() does after every wait
+    if(getSocket() != -1)
+    {
+        checkLoopResult(mosquitto_loop_misc(m_mosquitto));
+    }
+}
 
-    std::string payload_str = payload.dump();
-    LOG_DEBUG("Publishing LWT MQTT message to topic: {}", getAvailabilityTopic());
-    LOG_DEBUG("LWT MQTT message payload: {}", payload_str);
-    int rc =
-        mosquitto_will_set(m_mosquitto, getAvailabilityTopic().c_str(), payload_str.size(), payload_str.c_str(), 1, true);
-    if(rc != MOSQ_ERR_SUCCESS)
+void MQTTConnector::wakeLoop()
+{
+    if(m_wake_fd < 0 || onNetworkThread() || m_wake_pending.exchange(true))
     {
-        LOG_ERROR("Failed to publish MQTT message: {}", mosquitto_strerror(rc));
+        return;
+    }
+    uint64_t one = 1;
+    if(write(m_wake_fd, &one, sizeof(one)) != sizeof(one))
+    {
+        LOG_WARN("Failed to wake up the network loop: {}", std::strerror(errno));
     }
 }
 
-// Callback for incoming MQTT messages, implementing the on_message
-void MQTTConnector::messageCallback(mosquitto*  /*mosq*/, void* obj, const mosquitto_message* message)
+void MQTTConnector::clearWake()
 {
-    LOG_DEBUG("Received MQTT message on topic: {}", message->topic);
-    auto* connector = static_cast<MQTTConnector*>(obj);
-    // Convert the topic and message to a string
-    std::string topic(message->topic);
-    std::string payload(static_cast<char*>(message->payload), message->payloadlen);
+    if(m_wake_fd < 0 || !m_wake_pending.exchange(false))
+    {
+        return;
+    }
+    uint64_t value = 0;
+    // Nothing to read if the write failed, which is fine as the descriptor is non-blocking
+    [[maybe_unused]] auto result = read(m_wake_fd, &value, sizeof(value));
+}
 
-    for(auto& device : connector->m_registered_devices)
+int MQTTConnector::getSocket() const
+{
+    auto state = m_connection_state.load();
+    if(m_mosquitto == nullptr || (state != ConnectionState::CONNECTING && state != ConnectionState::CONNECTED))
+    {
+        return -1;
+    }
+    return mosquitto_socket(m_mosquitto);
+}
+
+bool MQTTConnector::wantsWrite() const
+{
+    return getSocket() != -1 && mosquitto_want_write(m_mosquitto);
+}
+
+void MQTTConnector::onReadable()
+{
+    claimLoopThread();
+    if(getSocket() != -1)
+    {
+        checkLoopResult(mosquitto_loop_read(m_mosquitto, 1));
+    }
+    drainNetworkQueues();
+}
+
+void MQTTConnector::onWritable()
+{
+    claimLoopThread();
+    if(getSocket() != -1)
+    {
+        checkLoopResult(mosquitto_loop_write(m_mosquitto, 1));
+    }
+}
+
+void MQTTConnector::onTick()
+{
+    claimLoopThread();
+    drainNetworkQueues();
+    runDeferredTasks();
+    serviceConnection();
+    if(getSocket() != -1)
     {
-        // Check if the topic starts with the device's topic after home/
-        if(topic.find("home/" + device->getFullId()) == 0)
+        checkLoopResult(mosquitto_loop_misc(m_mosquitto));
+    }
+}
+
+int MQTTConnector::getNextTimeout() const
+{
+    auto now = std::chrono::steady_clock::now();
+    auto wake = now + std::chrono::seconds(1);
+    {
+        std::lock_guard<std::mutex> lock(m_timers_mutex);
+        wake = std::min(wake, m_timers.nextDue());
+    }
+    switch(m_connection_state.load())
+    {
+    case ConnectionState::DISCONNECTED:
+        if(!m_stay_disconnected)
         {
-            // Call the device's processMessage method
-            device->processMessage(topic, payload);
+            wake = now;
         }
+        break;
+    case ConnectionState::WAITING_TO_RECONNECT:
+        wake = std::min(wake, m_next_connect_attempt);
+        break;
+    case ConnectionState::CONNECTING:
+        wake = std::min(wake, m_connect_started + connect_timeout);
+        break;
+    case ConnectionState::CONNECTED:
+        break;
+    }
+    if(wake <= now)
+    {
+        return 0;
     }
+    // Round up, so the loop does not wake up just before the work is due
+    return static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(wake - now).count());
 }
 
-// Callback for successful connection to the MQTT server, implementing
-// on_connect
-void MQTTConnector::connectCallback(mosquitto*  /*mosq*/, void* obj, int rc)
+// Publish a message
+void MQTTConnector::publishMessage(const std::string& topic, const json& payload, PublishPolicy policy)
 {
-    LOG_DEBUG("Connected to MQTT server callback");
-    auto* connector = static_cast<MQTTConnector*>(obj);
+    publishRawMessage(topic, payload.dump(), policy);
+}
 
-    // Subscribe to the topics of the registered devices
-    for(auto& device : connector->m_registered_devices)
+// Publish an already serialized message
+void MQTTConnector::publishRawMessage(const std::string& topic, const std::string& payload, PublishPolicy policy)
+{
+    if(!onNetworkThread())
     {
-        for(auto& topic : device->getSubscribeTopics())
+        // Hand it over to the network thread without blocking
+        if(!m_publish_queue->tryPush(PendingPublish{topic, payload, policy}))
         {
-            LOG_DEBUG("Subscribing to topic: {}", topic);
-            rc = mosquitto_subscribe(connector->m_mosquitto, nullptr, topic.c_str(), 0);
-            if(rc != MOSQ_ERR_SUCCESS)
-            {
-                LOG_ERROR("Failed to subscribe to topic: {}", mosquitto_strerror(rc));
-                return;
-            }
+            ++m_dropped_publishes;
+            LOG_WARN("Publish queue is full, dropping message to topic: {}", topic);
+            return;
         }
+        wakeLoop();
+        return;
     }
+    sendPublish(topic, payload, nullptr, policy);
+}
 
-    // Send the discovery messages for the registered devices
-    LOG_DEBUG("Sending discovery messages for {} devices", connector->m_registered_devices.size());
-    for(auto& device : connector->m_registered_devices)
+// Publish a telemetry message that is not retained
+void MQTTConnector::publishTelemetry(const std::string& topic, const std::string& payload, PublishPolicy policy)
+{
+    if(!onNetworkThread())
     {
-        device->sendDiscovery();
-        device->sendStatus();
+        if(!m_publish_queue->tryPush(PendingPublish{topic, payload, policy, true}))
+        {
+            ++m_dropped_publishes;
+            LOG_WARN("Publish queue is full, dropping message to topic: {}", topic);
+            return;
+        }
+        wakeLoop();
+        return;
     }
-    LOG_DEBUG("Discovery messages sent for {} devices", connector->m_registered_devices.size());
+    sendTelemetry(topic, payload, policy);
+}
+
+// Publish a message and report its acknowledgement
+void MQTTConnector::publishRawMessage(const std::string& topic,
+                                      const std::string& payload,
+                                      std::function<void(bool)> on_acknowledged,
+                                      PublishPolicy policy)
+{
+    runOnNetworkThread([this, topic, payload, policy, on_acknowledged = std::move(on_acknowledged)]() mutable {
+        int mid = -1;
+        if(!sendPublish(topic, payload, &mid, policy))
+        {
+            on_acknowledged(false);
+            return;
+        }
+        if(mid == -1)
+        {
+            // Held back while the state is restored, so the server will not acknowledge it
+            on_acknowledged(false);
+            return;
+        }
+        if(policy.qos == 0)
+        {
+            // Nothing to wait for. mosquitto may even have reported the publish already, from inside
+            // mosquitto_publish, before the handler could be registered
+            on_acknowledged(true);
+            return;
+        }
+        m_pending_acknowledgements[mid] = std::move(on_acknowledged);
+    });
+}
 
-    connector->m_is_connected = true;
+void MQTTConnector::failPendingAcknowledgements()
+{
+    // The handlers may publish again, so take them out first
+    auto pending = std::move(m_pending_acknowledgements);
+    m_pending_acknowledgements.clear();
+    for(auto& [mid, on_acknowledged] : pending)
+    {
+        on_acknowledged(false);
+    }
 }
 
-// Callback for disconnection from the MQTT server, implementing
-// on_disconnect
-void MQTTConnector::disconnectCallback(mosquitto*  /*mosq*/, void* obj, int  /*rc*/)
+void MQTTConnector::waitForCommand(const FunctionBase& function,
+                                   std::function<void(const std::string& topic, const std::string& payload)> handler)
 {
-    LOG_INFO("Disconnected from MQTT server");
-    auto* connector = static_cast<MQTTConnector*>(obj);
-    connector->m_is_connected = false;
+    runOnNetworkThread([this, key = &function, handler = std::move(handler)]() mutable {
+        m_command_waiters.emplace(key, std::move(handler));
+    });
+}
+
+// Hand a message to mosquitto
+bool MQTTConnector::sendPublish(const std::string& topic, const std::string& payload, int* mid, PublishPolicy policy)
+{
+    if(m_restoring_state && isStateRestoreTopic(topic))
+    {
+        // The status of all devices is sent when the restore is done
+        LOG_DEBUG("Holding back MQTT message to topic {} until the state is restored", topic);
+        return true;
+    }
+    if(mid == nullptr && policy.retain && m_deduplicate_publishes && isDuplicatePublish(topic, payload))
+    {
+        ++m_suppressed_publishes;
+        LOG_DEBUG("Skipping unchanged MQTT message to topic: {}", topic);
+        return true;
+    }
+    LOG_DEBUG("Publishing MQTT message to topic: {}", topic);
+    LOG_DEBUG("MQTT message payload: {}", payload);
+    int rc = mosquitto_publish(
+        m_mosquitto, mid, topic.c_str(), payload.size(), payload.c_str(), policy.qos, policy.retain);
+    if(rc != MOSQ_ERR_SUCCESS)
+    {
+        LOG_ERROR("Failed to publish MQTT message: {}", mosquitto_strerror(rc));
+        // Make sure it is sent next time
+        m_last_publishes.erase(topic);
+        return false;
+    }
+    return true;
+}
+
+// Publish a telemetry message, or buffer it while offline
+void MQTTConnector::sendTelemetry(const std::string& topic, const std::string& payload, PublishPolicy policy)
+{
+    if(!m_offline_buffer)
+    {
+        sendPublish(topic, payload, nullptr, policy);
+        return;
+    }
+    if(m_sending_connect_status && !m_offline_buffer->empty())
+    {
+        // The current reading was buffered when it was taken, or sent before the connection was lost
+        return;
+    }
+    // mosquitto would queue it without limit while disconnected, and it must not overtake what is buffered
+    if(isConnected() && m_offline_buffer->empty() && sendPublish(topic, payload, nullptr, policy))
+    {
+        return;
+    }
+    m_offline_buffer->push({topic, payload, policy});
+    m_buffered_publishes = m_offline_buffer->size();
+    if(isConnected())
+    {
+        startOfflineReplay();
+    }
+}
+
+void MQTTConnector::enableOfflineBuffer(size_t max_memory_bytes,
+                                        const std::string& spill_file,
+                                        size_t spill_file_size,
+                                        size_t replay_per_second)
+{
+    runOnNetworkThread([this, max_memory_bytes, spill_file, spill_file_size, replay_per_second]() {
+        m_offline_buffer = std::make_unique<OfflineBuffer>(max_memory_bytes, spill_file, spill_file_size);
+        m_offline_replay_per_second = std::max<size_t>(replay_per_second, 1);
+        m_buffered_publishes = m_offline_buffer->size();
+        if(isConnected() && !m_offline_buffer->empty())
+        {
+            startOfflineReplay();
+        }
+    });
+}
+
+void MQTTConnector::startOfflineReplay()
+{
+    if(m_offline_replay_timer != 0)
+    {
+        return;
+    }
+    LOG_INFO("Replaying {} buffered MQTT messages, {} dropped so far because the buffer was full",
+             m_offline_buffer->size(),
+             m_offline_buffer->getDroppedCount());
+    // Publish in small batches ten times a second, which keeps the rate smooth
+    m_offline_replay_timer = callEvery(std::chrono::milliseconds(100), [this]() { replayOfflineBuffer(); });
+}
+
+void MQTTConnector::replayOfflineBuffer()
+{
+    size_t batch = std::max<size_t>(m_offline_replay_per_second / 10, 1);
+    while(isConnected() && batch > 0 && !m_offline_buffer->empty())
+    {
+        const auto& message = m_offline_buffer->front();
+        if(!sendPublish(message.topic, message.payload, nullptr, message.policy))
+        {
+            break;
+        }
+        m_offline_buffer->pop();
+        --batch;
+    }
+    m_buffered_publishes = m_offline_buffer->size();
+    if(!isConnected() || m_offline_buffer->empty())
+    {
+        // Started again on the next connect, or when something is buffered
+        cancelTimer(m_offline_replay_timer);
+        m_offline_replay_timer = 0;
+    }
+}
+
+// Publish a discovery message
+void MQTTConnector::publishDiscovery(const std::string& topic, const std::string& payload, PublishPolicy policy)
+{
+    if(!onNetworkThread())
+    {
+        runOnNetworkThread([this, topic, payload, policy]() { sendDiscoveryPayload(topic, payload, policy); });
+        return;
+    }
+    sendDiscoveryPayload(topic, payload, policy);
+}
+
+void MQTTConnector::sendDiscoveryPayload(const std::string& topic, const std::string& payload, PublishPolicy policy)
+{
+    // A message that is not retained can not be verified, and must be sent every time
+    if(!m_discovery_cache_enabled || !policy.retain)
+    {
+        sendPublish(topic, payload, nullptr, policy);
+        return;
+    }
+
+    // Removing a discovery message, forget about it
+    if(payload.empty())
+    {
+        m_discovery_verifications.erase(topic);
+        if(m_discovery_hashes.erase(topic) > 0)
+        {
+            scheduleDiscoveryStateSave();
+        }
+        sendPublish(topic, payload, nullptr, policy);
+        return;
+    }
+
+    auto hash = fnv1aHash(payload);
+    auto known = m_discovery_hashes.find(topic);
+    if(known == m_discovery_hashes.end() || known->second != hash)
+    {
+        publishAndRememberDiscovery(topic, payload, hash, policy);
+        return;
+    }
+    if(m_discovery_verification_timeout.count() == 0)
+    {
+        ++m_skipped_discoveries;
+        LOG_DEBUG("Discovery message to topic {} has not changed, not publishing", topic);
+        return;
+    }
+
+    // Unchanged since last sent, but check that the broker still has it
+    auto id = ++m_discovery_verification_id;
+    m_discovery_verifications[topic] = DiscoveryVerification{payload, hash, id, policy};
+    int rc = mosquitto_subscribe(m_mosquitto, nullptr, topic.c_str(), policy.qos);
+    if(rc != MOSQ_ERR_SUCCESS)
+    {
+        LOG_ERROR("Failed to subscribe to discovery topic {}: {}", topic, mosquitto_strerror(rc));
+        m_discovery_verifications.erase(topic);
+        publishAndRememberDiscovery(topic, payload, hash, policy);
+        return;
+    }
+    callAt(std::chrono::steady_clock::now() + m_discovery_verification_timeout,
+           [this, topic, id]() { onDiscoveryVerificationTimeout(topic, id); });
+}
+
+void MQTTConnector::publishAndRememberDiscovery(const std::string& topic,
+                                                const std::string& payload,
+                                                uint64_t hash,
+                                                PublishPolicy policy)
+{
+    if(sendPublish(topic, payload, nullptr, policy))
+    {
+        m_discovery_hashes[topic] = hash;
+    }
+    else
+    {
+        m_discovery_hashes.erase(topic);
+    }
+    scheduleDiscoveryStateSave();
+}
+
+bool MQTTConnector::handleDiscoveryVerification(const std::string& topic, std::string_view payload)
+{
+    auto verification = m_discovery_verifications.find(topic);
+    if(verification == m_discovery_verifications.end())
+    {
+        return false;
+    }
+    // Stop listening before a possible republish, so it is not echoed back
+    mosquitto_unsubscribe(m_mosquitto, nullptr, topic.c_str());
+    auto pending = std::move(verification->second);
+    m_discovery_verifications.erase(verification);
+
+    if(fnv1aHash(payload) == pending.hash)
+    {
+        ++m_skipped_discoveries;
+        LOG_DEBUG("Broker has the current discovery message for topic {}, not publishing", topic);
+        return true;
+    }
+    LOG_DEBUG("Broker has an outdated discovery message for topic {}, publishing", topic);
+    publishAndRememberDiscovery(topic, pending.payload, pending.hash, pending.policy);
+    return true;
+}
+
+void MQTTConnector::onDiscoveryVerificationTimeout(const std::string& topic, uint64_t id)
+{
+    auto verification = m_discovery_verifications.find(topic);
+    if(verification == m_discovery_verifications.end() || verification->second.id != id)
+    {
+        return;
+    }
+    mosquitto_unsubscribe(m_mosquitto, nullptr, topic.c_str());
+    auto pending = std::move(verification->second);
+    m_discovery_verifications.erase(verification);
+
+    LOG_DEBUG("Broker has no discovery message for topic {}, publishing", topic);
+    publishAndRememberDiscovery(topic, pending.payload, pending.hash, pending.policy);
+}
+
+void MQTTConnector::enableDiscoveryCache(const std::string& state_file, std::chrono::milliseconds verification_timeout)
+{
+    runOnNetworkThread([this, state_file, verification_timeout]() {
+        m_discovery_cache_enabled = true;
+        m_discovery_state_file = state_file;
+        m_discovery_verification_timeout = verification_timeout;
+        loadDiscoveryState();
+    });
+}
+
+void MQTTConnector::scheduleDiscoveryStateSave()
+{
+    if(m_discovery_state_file.empty() || m_discovery_state_save_scheduled)
+    {
+        return;
+    }
+    // A discovery round changes many hashes, write them all at once
+    m_discovery_state_save_scheduled = true;
+    callAt(std::chrono::steady_clock::now(), [this]() {
+        m_discovery_state_save_scheduled = false;
+        saveDiscoveryState();
+    });
+}
+
+void MQTTConnector::loadDiscoveryState()
+{
+    if(m_discovery_state_file.empty())
+    {
+        return;
+    }
+    std::ifstream file(m_discovery_state_file);
+    if(!file)
+    {
+        LOG_DEBUG("No discovery state file {} yet", m_discovery_state_file);
+        return;
+    }
+    try
+    {
+        json state = json::parse(file);
+        for(const auto& [topic, hash] : state.items())
+        {
+            m_discovery_hashes[topic] = hash.get<uint64_t>();
+        }
+        LOG_DEBUG("Loaded {} discovery hashes from {}", m_discovery_hashes.size(), m_discovery_state_file);
+    }
+    catch(const json::exception& e)
+    {
+        LOG_WARN("Ignoring broken discovery state file {}: {}", m_discovery_state_file, e.what());
+        m_discovery_hashes.clear();
+    }
+}
+
+void MQTTConnector::saveDiscoveryState()
+{
+    if(m_discovery_state_file.empty())
+    {
+        return;
+    }
+    json state = json::object();
+    for(const auto& [topic, hash] : m_discovery_hashes)
+    {
+        state[topic] = hash;
+    }
+
+    // Write to a temporary file and rename it, so a crash never leaves a half written file
+    std::string temporary_file = m_discovery_state_file + ".tmp";
+    {
+        std::ofstream file(temporary_file, std::ios::trunc);
+        file << state.dump();
+        if(!file)
+        {
+            LOG_ERROR("Failed to write discovery state file {}", temporary_file);
+            return;
+        }
+    }
+    if(std::rename(temporary_file.c_str(), m_discovery_state_file.c_str()) != 0)
+    {
+        LOG_ERROR("Failed to replace discovery state file {}", m_discovery_state_file);
+    }
+}
+
+void MQTTConnector::enableStateRestore(std::chrono::milliseconds timeout)
+{
+    m_restoring_state = true;
+    runOnNetworkThread([this, timeout]() { m_state_restore_timeout = timeout; });
+}
+
+void MQTTConnector::startStateRestore()
+{
+    // Subscriptions do not survive a reconnect, so a restore in progress starts over
+    if(m_state_restore_timer != 0)
+    {
+        cancelTimer(m_state_restore_timer);
+        m_state_restore_timer = 0;
+    }
+    m_state_restore_routes.clear();
+    for(const auto& device : m_registered_devices)
+    {
+        for(const auto& function : device->getFunctions())
+        {
+            for(auto& topic : function->getRestoreTopics())
+            {
+                LOG_DEBUG("Subscribing to state topic {} to restore it", topic);
+                int rc = mosquitto_subscribe(
+                    m_mosquitto, nullptr, topic.c_str(), function->getPublishPolicy(TopicKind::STATE).qos);
+                if(rc != MOSQ_ERR_SUCCESS)
+                {
+                    LOG_ERROR("Failed to subscribe to state topic {}: {}", topic, mosquitto_strerror(rc));
+                    continue;
+                }
+                m_state_restore_routes.emplace(std::move(topic), function);
+            }
+        }
+    }
+    if(m_state_restore_routes.empty())
+    {
+        finishStateRestore();
+        return;
+    }
+    LOG_INFO("Waiting for the retained state of {} topics", m_state_restore_routes.size());
+    m_state_restore_timer =
+        callAt(std::chrono::steady_clock::now() + m_state_restore_timeout, [this]() { finishStateRestore(); });
+}
+
+bool MQTTConnector::handleStateRestore(const std::string& topic, const std::string& payload)
+{
+    auto route = m_state_restore_routes.find(topic);
+    if(route == m_state_restore_routes.end())
+    {
+        return false;
+    }
+    mosquitto_unsubscribe(m_mosquitto, nullptr, topic.c_str());
+    auto function = route->second.lock();
+    m_state_restore_routes.erase(route);
+    if(function)
+    {
+        function->restoreState(topic, payload);
+    }
+    if(m_state_restore_routes.empty())
+    {
+        finishStateRestore();
+    }
+    return true;
+}
+
+void MQTTConnector::finishStateRestore()
+{
+    if(!m_restoring_state)
+    {
+        return;
+    }
+    if(m_state_restore_timer != 0)
+    {
+        cancelTimer(m_state_restore_timer);
+        m_state_restore_timer = 0;
+    }
+    for(const auto& [topic, function] : m_state_restore_routes)
+    {
+        LOG_DEBUG("No retained state for topic {}", topic);
+        mosquitto_unsubscribe(m_mosquitto, nullptr, topic.c_str());
+    }
+    m_state_restore_routes.clear();
+    m_restoring_state = false;
+    LOG_INFO("Done restoring state");
+
+    // When done right away, the connect callback sends the status
+    if(!isConnected())
+    {
+        return;
+    }
+    std::lock_guard<std::recursive_mutex> lock(m_devices_mutex);
+    sendConnectStatus();
+}
+
+void MQTTConnector::sendConnectStatus()
+{
+    m_sending_connect_status = true;
+    for(auto& device : m_registered_devices)
+    {
+        device->sendStatus();
+    }
+    m_sending_connect_status = false;
+}
+
+bool MQTTConnector::isStateRestoreTopic(const std::string& topic) const
+{
+    std::lock_guard<std::recursive_mutex> lock(m_devices_mutex);
+    for(const auto& device : m_registered_devices)
+    {
+        for(const auto& function : device->getFunctions())
+        {
+            auto topics = function->getRestoreTopics();
+            if(std::find(topics.begin(), topics.end(), topic) != topics.end())
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool MQTTConnector::isDuplicatePublish(const std::string& topic, const std::string& payload)
+{
+    // Clearing a retained message always goes through, and forgets what was there
+    if(payload.empty())
+    {
+        m_last_publishes.erase(topic);
+        return false;
+    }
+
+    auto hash = fnv1aHash(payload);
+    auto now = std::chrono::steady_clock::now();
+    auto record = m_last_publishes.find(topic);
+    if(record == m_last_publishes.end())
+    {
+        m_last_publishes.emplace(topic, PublishRecord{hash, now});
+        return false;
+    }
+    bool refresh_due = m_deduplication_refresh.count() > 0 && now - record->second.sent >= m_deduplication_refresh;
+    if(record->second.hash == hash && !refresh_due)
+    {
+        return true;
+    }
+    record->second = PublishRecord{hash, now};
+    return false;
+}
+
+void MQTTConnector::enablePublishDeduplication(std::chrono::milliseconds refresh_interval)
+{
+    runOnNetworkThread([this, refresh_interval]() {
+        m_deduplicate_publishes = true;
+        m_deduplication_refresh = refresh_interval;
+    });
+}
+
+void MQTTConnector::disablePublishDeduplication()
+{
+    runOnNetworkThread([this]() {
+        m_deduplicate_publishes = false;
+        m_last_publishes.clear();
+    });
+}
+
+void MQTTConnector::setCallbackExecutor(std::shared_ptr<CallbackExecutor> executor)
+{
+    std::lock_guard<std::mutex> lock(m_executor_mutex);
+    m_callback_executor = std::move(executor);
+}
+
+std::shared_ptr<CallbackExecutor> MQTTConnector::getCallbackExecutor() const
+{
+    std::lock_guard<std::mutex> lock(m_executor_mutex);
+    return m_callback_executor;
+}
+
+void MQTTConnector::dispatchControl(const void* key, std::function<void()> task)
+{
+    auto executor = getCallbackExecutor();
+    if(!executor)
+    {
+        task();
+        return;
+    }
+    executor->post(key, std::move(task));
+}
+
+TimerId MQTTConnector::callAt(std::chrono::steady_clock::time_point when, std::function<void()> task)
+{
+    TimerId id = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_timers_mutex);
+        id = m_timers.add(when, std::chrono::steady_clock::duration::zero(), std::move(task));
+    }
+    // The loop may be waiting for a later time
+    wakeLoop();
+    return id;
+}
+
+TimerId MQTTConnector::callEvery(std::chrono::steady_clock::duration interval, std::function<void()> task)
+{
+    if(interval <= std::chrono::steady_clock::duration::zero())
+    {
+        LOG_ERROR("Interval of periodic task must be above zero");
+        throw std::invalid_argument("Interval of periodic task must be above zero");
+    }
+    TimerId id = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_timers_mutex);
+        id = m_timers.add(std::chrono::steady_clock::now() + interval, interval, std::move(task));
+    }
+    wakeLoop();
+    return id;
+}
+
+bool MQTTConnector::cancelTimer(TimerId id)
+{
+    std::lock_guard<std::mutex> lock(m_timers_mutex);
+    return m_timers.cancel(id);
+}
+
+std::chrono::steady_clock::time_point MQTTConnector::runDeferredTasks()
+{
+    std::vector<TimerWheel::DueTimer> due;
+    {
+        std::lock_guard<std::mutex> lock(m_timers_mutex);
+        due = m_timers.advance(std::chrono::steady_clock::now());
+    }
+    // Run without the lock, so the tasks can add and cancel timers
+    for(auto& timer : due)
+    {
+        (*timer.task)();
+    }
+    std::lock_guard<std::mutex> lock(m_timers_mutex);
+    return m_timers.nextDue();
+}
+
+// Start the network thread
+bool MQTTConnector::startNetworkThread(size_t publish_queue_size, int loop_interval_ms)
+{
+    if(m_network_thread_running)
+    {
+        LOG_WARN("Network thread is already running");
+        return false;
+    }
+    LOG_DEBUG("Starting network thread");
+    // Other threads may already be pushing to the queue of a caller driven loop, so it is kept
+    if(!m_publish_queue)
+    {
+        m_publish_queue = std::make_unique<BoundedMpscQueue<PendingPublish>>(publish_queue_size);
+    }
+    m_network_thread_running = true;
+    m_network_thread = std::thread([this, loop_interval_ms]() {
+        m_network_thread_id = std::this_thread::get_id();
+        while(m_network_thread_running)
+        {
+            runLoop(loop_interval_ms, true);
+        }
+        // Flush what was queued before stopping
+        drainNetworkQueues();
+    });
+    m_network_thread_id = m_network_thread.get_id();
+    return true;
+}
+
+// Stop the network thread
+void MQTTConnector::stopNetworkThread()
+{
+    if(!m_network_thread.joinable())
+    {
+        return;
+    }
+    LOG_DEBUG("Stopping network thread");
+    m_network_thread_running = false;
+    wakeLoop();
+    m_network_thread.join();
+    m_network_thread_id = std::thread::id();
+}
+
+bool MQTTConnector::onNetworkThread() const
+{
+    auto owner = m_network_thread_id.load();
+    return owner == std::thread::id() || owner == std::this_thread::get_id();
+}
+
+void MQTTConnector::claimLoopThread()
+{
+    auto current = std::this_thread::get_id();
+    if(m_network_thread_running || m_network_thread_id.load() == current)
+    {
+        return;
+    }
+    // Create the queue before other threads can see that they must use it
+    if(!m_publish_queue)
+    {
+        m_publish_queue = std::make_unique<BoundedMpscQueue<PendingPublish>>(default_publish_queue_size);
+    }
+    m_network_thread_id = current;
+}
+
+void MQTTConnector::runOnNetworkThread(std::function<void()> task)
+{
+    if(onNetworkThread())
+    {
+        task();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_network_tasks_mutex);
+        m_network_tasks.push_back(std::move(task));
+    }
+    wakeLoop();
+}
+
+void MQTTConnector::drainNetworkQueues()
+{
+    // Nothing is ever queued before a thread has run the network loop
+    if(!m_publish_queue)
+    {
+        return;
+    }
+
+    // Taken before the queues are read, so work queued from here on wakes the loop again
+    clearWake();
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> lock(m_network_tasks_mutex);
+        tasks.swap(m_network_tasks);
+    }
+    for(auto& task : tasks)
+    {
+        task();
+    }
+
+    PendingPublish pending;
+    while(m_publish_queue->tryPop(pending))
+    {
+        if(pending.telemetry)
+        {
+            sendTelemetry(pending.topic, pending.payload, pending.policy);
+        }
+        else
+        {
+            sendPublish(pending.topic, pending.payload, nullptr, pending.policy);
+        }
+    }
+}
+
+// publish last will and testament
+void MQTTConnector::publishLWT()
+{
+    // Create the will message
+    json payload;
+    payload["availability"] = "offline";
+
+    std::string payload_str = payload.dump();
+    LOG_DEBUG("Publishing LWT MQTT message to topic: {}", getAvailabilityTopic());
+    LOG_DEBUG("LWT MQTT message payload: {}", payload_str);
+    int rc = mosquitto_will_set(m_mosquitto,
+                                getAvailabilityTopic().c_str(),
+                                payload_str.size(),
+                                payload_str.c_str(),
+                                m_availability_policy.qos,
+                                m_availability_policy.retain);
+    if(rc != MOSQ_ERR_SUCCESS)
+    {
+        LOG_ERROR("Failed to publish MQTT message: {}", mosquitto_strerror(rc));
+    }
+}
+
+// Subscribe to the topics of a device and add them to the routing table
+bool MQTTConnector::subscribeDevice(const std::shared_ptr<DeviceBase>& device)
+{
+    for(const auto& function : device->getFunctions())
+    {
+        for(auto& topic : function->getSubscribeTopics())
+        {
+            if(m_topic_routes.find(topic) != m_topic_routes.end())
+            {
+                LOG_ERROR("Topic {} is already registered by another function", topic);
+                continue;
+            }
+
+            LOG_DEBUG("Subscribing to topic: {}", topic);
+            int rc = mosquitto_subscribe(m_mosquitto, nullptr, topic.c_str(), function->getSubscribeQos());
+            if(rc != MOSQ_ERR_SUCCESS)
+            {
+                LOG_ERROR("Failed to subscribe to topic: {}", mosquitto_strerror(rc));
+                return false;
+            }
+            // Only routed once subscribed, the routing table is rebuilt on the next connect otherwise
+            auto route = std::make_unique<TopicRoute>(TopicRoute{topic, function});
+            std::string_view key(route->topic);
+            m_topic_routes.emplace(key, std::move(route));
+        }
+    }
+    return true;
+}
+
+// Unsubscribe from the topics of a device and remove them from the routing table
+void MQTTConnector::unsubscribeDevice(const std::shared_ptr<DeviceBase>& device)
+{
+    for(const auto& function : device->getFunctions())
+    {
+        for(auto& topic : function->getSubscribeTopics())
+        {
+            m_topic_routes.erase(topic);
+
+            LOG_DEBUG("Unsubscribing from topic: {}", topic);
+            int rc = mosquitto_unsubscribe(m_mosquitto, nullptr, topic.c_str());
+            if(rc != MOSQ_ERR_SUCCESS)
+            {
+                LOG_ERROR("Failed to unsubscribe from topic: {}", mosquitto_strerror(rc));
+            }
+        }
+    }
+}
+
+// Callback for incoming MQTT messages, implementing the on_message
+void MQTTConnector::messageCallback(mosquitto*  /*mosq*/, void* obj, const mosquitto_message* message)
+{
+    LOG_DEBUG("Received MQTT message on topic: {}", message->topic);
+    auto* connector = static_cast<MQTTConnector*>(obj);
+    std::lock_guard<std::recursive_mutex> lock(connector->m_devices_mutex);
+
+    // Look up the owner of the topic directly, no need to build strings for every device
+    auto route = connector->m_topic_routes.find(std::string_view(message->topic));
+    if(route == connector->m_topic_routes.end())
+    {
+        std::string_view payload(static_cast<const char*>(message->payload), message->payloadlen);
+        if(message->retain && connector->handleDiscoveryVerification(message->topic, payload))
+        {
+            return;
+        }
+        if(message->retain && connector->handleStateRestore(message->topic, std::string(payload)))
+        {
+            return;
+        }
+        LOG_DEBUG("No function registered for topic: {}", message->topic);
+        return;
+    }
+    auto function = route->second->function.lock();
+    if(!function)
+    {
+        LOG_DEBUG("Function for topic {} is no longer alive", message->topic);
+        return;
+    }
+
+    // Convert the message to a string. The topic string is owned by the route
+    std::string payload(static_cast<char*>(message->payload), message->payloadlen);
+    function->processMessage(route->second->topic, payload);
+
+    // Hand the command to those waiting for it, they may start waiting again from the handler
+    auto waiting = connector->m_command_waiters.equal_range(function.get());
+    if(waiting.first == waiting.second)
+    {
+        return;
+    }
+    std::vector<std::function<void(const std::string&, const std::string&)>> handlers;
+    for(auto waiter = waiting.first; waiter != waiting.second; ++waiter)
+    {
+        handlers.push_back(std::move(waiter->second));
+    }
+    connector->m_command_waiters.erase(waiting.first, waiting.second);
+    // A handler may unregister the device, and with it the route owning the topic
+    std::string topic = route->second->topic;
+    for(auto& handler : handlers)
+    {
+        handler(topic, payload);
+    }
+}
+
+// Callback for successful connection to the MQTT server, implementing
+// on_connect
+void MQTTConnector::connectCallback(mosquitto*  /*mosq*/, void* obj, int rc)
+{
+    LOG_DEBUG("Connected to MQTT server callback");
+    auto* connector = static_cast<MQTTConnector*>(obj);
+    if(rc != 0)
+    {
+        LOG_ERROR("MQTT server refused the connection: {}", mosquitto_connack_string(rc));
+        connector->scheduleReconnect();
+        return;
+    }
+    std::lock_guard<std::recursive_mutex> lock(connector->m_devices_mutex);
+    connector->m_reconnect_attempt = 0;
+
+    // The broker may have lost the retained messages, so publish everything again
+    connector->m_last_publishes.clear();
+    // Subscriptions do not survive the reconnect, so verifications in progress start over
+    connector->m_discovery_verifications.clear();
+
+    // Subscribe to the topics of the registered devices, rebuilding the routing table as we go
+    connector->m_topic_routes.clear();
+    for(auto& device : connector->m_registered_devices)
+    {
+        if(!connector->subscribeDevice(device))
+        {
+            // Try again with a new connection rather than running with some topics missing
+            connector->scheduleReconnect();
+            return;
+        }
+    }
+
+    // Restore the state from the retained messages before publishing it, the publishes are held back until then
+    if(connector->m_restoring_state)
+    {
+        connector->startStateRestore();
+    }
+
+    // Connected from here on, so that the status below is published instead of buffered as offline telemetry
+    connector->m_connection_state = ConnectionState::CONNECTED;
+
+    // Send the discovery messages for the registered devices
+    LOG_DEBUG("Sending discovery messages for {} devices", connector->m_registered_devices.size());
+    for(auto& device : connector->m_registered_devices)
+    {
+        device->sendDiscovery();
+    }
+    connector->sendConnectStatus();
+    LOG_DEBUG("Discovery messages sent for {} devices", connector->m_registered_devices.size());
+
+    // Replay the telemetry published while offline
+    if(connector->m_offline_buffer && !connector->m_offline_buffer->empty())
+    {
+        connector->startOfflineReplay();
+    }
+}
+
+// Callback for messages acknowledged by the MQTT server, implementing on_publish
+void MQTTConnector::publishCallback(mosquitto* /*mosq*/, void* obj, int mid)
+{
+    auto* connector = static_cast<MQTTConnector*>(obj);
+    auto pending = connector->m_pending_acknowledgements.find(mid);
+    if(pending == connector->m_pending_acknowledgements.end())
+    {
+        return;
+    }
+    auto on_acknowledged = std::move(pending->second);
+    connector->m_pending_acknowledgements.erase(pending);
+    on_acknowledged(true);
+}
+
+// Callback for disconnection from the MQTT server, implementing
+// on_disconnect
+void MQTTConnector::disconnectCallback(mosquitto*  /*mosq*/, void* obj, int rc)
+{
+    LOG_INFO("Disconnected from MQTT server");
+    auto* connector = static_cast<MQTTConnector*>(obj);
+    if(rc != 0)
+    {
+        LOG_WARN("Lost the connection to the MQTT server: {}", mosquitto_strerror(rc));
+    }
+    // Reconnects unless disconnect() was called
+    connector->scheduleReconnect();
 }
 
 // Callback for successful subscription to an MQTT topic, implementing
@@ -304,5 +1510,5 @@ void MQTTConnector::subscribeCallback(mosquitto*  /*mosq*/, void*  /*obj*/, int
 // on_unsubscribe
 void MQTTConnector::unsubscribeCallback(mosquitto*  /*mosq*/, void*  /*obj*/, int  /*mid*/)
 {
-    LOG_ERROR("Unsubscribed from MQTT topic");
+    LOG_DEBUG("Unsubscribed from MQTT topic");
 }
@@ -0,0 +1,293 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+// Include the corresponding header file
+#include "hass_mqtt_device/core/offline_buffer.h"
+
+// Include any other necessary headers
+#include "hass_mqtt_device/core/helper_functions.hpp"
+#include "hass_mqtt_device/logger/logger.hpp" // For logging
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+constexpr char spill_magic[4] = {'H', 'M', 'O', 'B'};
+constexpr uint32_t spill_version = 3;
+
+// A record in the ring is the length of the topic and of the payload, the publish policy and a CRC-32, followed by the
+// topic and the payload. The CRC covers all of those, except itself
+struct RecordHeader
+{
+    uint32_t topic_size;
+    uint32_t payload_size;
+    uint8_t qos;
+    uint8_t retain;
+    uint16_t reserved;
+    uint32_t crc;
+};
+constexpr size_t record_crc_offset = offsetof(RecordHeader, crc);
+
+uint32_t recordCrc(const RecordHeader& record, const std::string& topic, const std::string& payload)
+{
+    auto crc = crc32(&record, record_crc_offset);
+    crc = crc32(topic.data(), topic.size(), crc);
+    return crc32(payload.data(), payload.size(), crc);
+}
+} // namespace
+
+OfflineBuffer::OfflineBuffer(size_t max_memory_bytes, const std::string& spill_file, size_t spill_file_size)
+    : m_max_memory_bytes(max_memory_bytes)
+{
+    if(!spill_file.empty())
+    {
+        openSpillFile(spill_file, spill_file_size);
+    }
+}
+
+OfflineBuffer::~OfflineBuffer()
+{
+    if(!m_spill)
+    {
+        return;
+    }
+    // Keep what is left in memory for the next run
+    for(const auto& message : m_memory)
+    {
+        spill(message);
+    }
+    munmap(m_spill, m_spill_size);
+}
+
+void OfflineBuffer::openSpillFile(const std::string& path, size_t size)
+{
+    if(size <= sizeof(SpillHeader) + sizeof(RecordHeader))
+    {
+        LOG_ERROR("Spill file {} of {} bytes is too small, only buffering in memory", path, size);
+        return;
+    }
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        LOG_ERROR("Failed to open spill file {}, only buffering in memory: {}", path, std::strerror(errno));
+        return;
+    }
+    struct stat status;
+    bool resized = fstat(fd, &status) != 0 || static_cast<size_t>(status.st_size) != size;
+    if(resized && ftruncate(fd, static_cast<off_t>(size)) != 0)
+    {
+        LOG_ERROR("Failed to size spill file {}, only buffering in memory: {}", path, std::strerror(errno));
+        close(fd);
+        return;
+    }
+    void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // The mapping keeps the file open
+    close(fd);
+    if(mapped == MAP_FAILED)
+    {
+        LOG_ERROR("Failed to map spill file {}, only buffering in memory: {}", path, std::strerror(errno));
+        return;
+    }
+    m_spill = static_cast<uint8_t*>(mapped);
+    m_spill_size = size;
+    m_ring_size = size - sizeof(SpillHeader);
+
+    // Pick up the messages from before a restart if the header makes sense, start empty otherwise
+    SpillHeader header;
+    std::memcpy(&header, m_spill, sizeof(header));
+    if(!resized && std::memcmp(header.magic, spill_magic, sizeof(spill_magic)) == 0 &&
+       header.version == spill_version && header.head < m_ring_size && header.used <= m_ring_size)
+    {
+        recoverSpilled(header);
+        if(m_spill_count > 0)
+        {
+            LOG_INFO("Picked up {} buffered messages from spill file {}", m_spill_count, path);
+        }
+        return;
+    }
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, spill_magic, sizeof(spill_magic));
+    header.version = spill_version;
+    std::memcpy(m_spill, &header, sizeof(header));
+}
+
+void OfflineBuffer::recoverSpilled(SpillHeader header)
+{
+    // The file may have been torn by a power loss, so check every record, and keep the ones before the first bad one
+    uint64_t used = 0;
+    uint64_t count = 0;
+    Message message;
+    while(count < header.count && used + sizeof(RecordHeader) <= header.used)
+    {
+        RecordHeader record;
+        readRing(header.head + used, &record, sizeof(record));
+        uint64_t record_size = sizeof(record) + uint64_t(record.topic_size) + record.payload_size;
+        if(record_size > header.used - used || record.qos > 2)
+        {
+            break;
+        }
+        message.topic.resize(record.topic_size);
+        message.payload.resize(record.payload_size);
+        readRing(header.head + used + sizeof(record), message.topic.data(), record.topic_size);
+        readRing(header.head + used + sizeof(record) + record.topic_size, message.payload.data(), record.payload_size);
+        if(recordCrc(record, message.topic, message.payload) != record.crc)
+        {
+            break;
+        }
+        used += record_size;
+        ++count;
+    }
+    if(count < header.count)
+    {
+        LOG_WARN("Spill file is damaged, dropping {} of its {} messages", header.count - count, header.count);
+        m_dropped += header.count - count;
+    }
+    header.used = used;
+    header.count = count;
+    if(count == 0)
+    {
+        header.head = 0;
+    }
+    std::memcpy(m_spill, &header, sizeof(header));
+    m_spill_count = count;
+}
+
+void OfflineBuffer::push(Message message)
+{
+    m_memory_bytes += memorySize(message);
+    m_memory.push_back(std::move(message));
+    while(m_memory_bytes > m_max_memory_bytes && !m_memory.empty())
+    {
+        auto& oldest = m_memory.front();
+        if(m_spill)
+        {
+            spill(oldest);
+        }
+        else
+        {
+            ++m_dropped;
+        }
+        m_memory_bytes -= memorySize(oldest);
+        m_memory.pop_front();
+    }
+}
+
+const OfflineBuffer::Message& OfflineBuffer::front()
+{
+    if(m_spill_count == 0)
+    {
+        return m_memory.front();
+    }
+    if(!m_front_loaded)
+    {
+        SpillHeader header;
+        std::memcpy(&header, m_spill, sizeof(header));
+        RecordHeader record;
+        readRing(header.head, &record, sizeof(record));
+        m_front.topic.resize(record.topic_size);
+        m_front.payload.resize(record.payload_size);
+        uint64_t offset = header.head + sizeof(record);
+        readRing(offset, m_front.topic.data(), record.topic_size);
+        readRing(offset + record.topic_size, m_front.payload.data(), record.payload_size);
+        m_front.policy = PublishPolicy{record.qos, record.retain != 0};
+        m_front_loaded = true;
+    }
+    return m_front;
+}
+
+void OfflineBuffer::pop()
+{
+    if(m_spill_count > 0)
+    {
+        popSpilled();
+        return;
+    }
+    if(m_memory.empty())
+    {
+        return;
+    }
+    m_memory_bytes -= memorySize(m_memory.front());
+    m_memory.pop_front();
+}
+
+void OfflineBuffer::spill(const Message& message)
+{
+    uint64_t record_size = sizeof(RecordHeader) + message.topic.size() + message.payload.size();
+    if(record_size > m_ring_size)
+    {
+        LOG_WARN("Message to topic {} does not fit in the spill file, dropping it", message.topic);
+        ++m_dropped;
+        return;
+    }
+    SpillHeader header;
+    std::memcpy(&header, m_spill, sizeof(header));
+    while(header.used + record_size > m_ring_size)
+    {
+        popSpilled();
+        ++m_dropped;
+        std::memcpy(&header, m_spill, sizeof(header));
+    }
+
+    RecordHeader record{static_cast<uint32_t>(message.topic.size()),
+                        static_cast<uint32_t>(message.payload.size()),
+                        static_cast<uint8_t>(message.policy.qos),
+                        static_cast<uint8_t>(message.policy.retain),
+                        0,
+                        0};
+    record.crc = recordCrc(record, message.topic, message.payload);
+    uint64_t offset = header.head + header.used;
+    writeRing(offset, &record, sizeof(record));
+    writeRing(offset + sizeof(record), message.topic.data(), message.topic.size());
+    writeRing(offset + sizeof(record) + message.topic.size(), message.payload.data(), message.payload.size());
+
+    // Update the header last, so a crash while writing the record leaves the ring as it was
+    header.used += record_size;
+    header.count = ++m_spill_count;
+    std::memcpy(m_spill, &header, sizeof(header));
+}
+
+void OfflineBuffer::popSpilled()
+{
+    SpillHeader header;
+    std::memcpy(&header, m_spill, sizeof(header));
+    RecordHeader record;
+    readRing(header.head, &record, sizeof(record));
+    uint64_t record_size = sizeof(record) + record.topic_size + record.payload_size;
+    header.head = (header.head + record_size) % m_ring_size;
+    header.used -= record_size;
+    header.count = --m_spill_count;
+    if(m_spill_count == 0)
+    {
+        header.head = 0;
+        header.used = 0;
+    }
+    std::memcpy(m_spill, &header, sizeof(header));
+    m_front_loaded = false;
+}
+
+void OfflineBuffer::writeRing(uint64_t offset, const void* data, size_t size)
+{
+    offset %= m_ring_size;
+    uint8_t* ring = m_spill + sizeof(SpillHeader);
+    size_t first = std::min<uint64_t>(size, m_ring_size - offset);
+    std::memcpy(ring + offset, data, first);
+    std::memcpy(ring, static_cast<const uint8_t*>(data) + first, size - first);
+}
+
+void OfflineBuffer::readRing(uint64_t offset, void* data, size_t size) const
+{
+    offset %= m_ring_size;
+    const uint8_t* ring = m_spill + sizeof(SpillHeader);
+    size_t first = std::min<uint64_t>(size, m_ring_size - offset);
+    std::memcpy(data, ring + offset, first);
+    std::memcpy(static_cast<uint8_t*>(data) + first, ring, size - first);
+}
@@ -0,0 +1,335 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+// Include the corresponding header file
+#include "hass_mqtt_device/core/one_wire_reader.h"
+
+// Include any other necessary headers
+#include "hass_mqtt_device/core/mqtt_connector.h"
+#include "hass_mqtt_device/functions/sensor.h"
+#include "hass_mqtt_device/logger/logger.hpp" // For logging
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <unistd.h>
+
+// A DS18B20 reports this before its first conversion, e.g. after losing power
+constexpr long power_on_reset_millidegrees = 85000;
+
+OneWireReader::SysfsFile::~SysfsFile()
+{
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+OneWireReader::OneWireReader(std::shared_ptr<MQTTConnector> connector, std::string base_path, size_t worker_count)
+    : m_connector(connector)
+    , m_base_path(std::move(base_path))
+    , m_workers(std::make_unique<CallbackExecutor>(ExecutorMode::WORKER_POOL, std::max<size_t>(worker_count, 1)))
+{
+}
+
+OneWireReader::~OneWireReader()
+{
+    m_stopping = true;
+    stop();
+    // Wait for the cycle in progress, it uses this object and posts its reads to the workers
+    m_workers->shutdown();
+}
+
+size_t OneWireReader::discover()
+{
+    std::vector<std::shared_ptr<SysfsFile>> probes;
+    std::vector<std::shared_ptr<SysfsFile>> bulk_reads;
+    std::error_code ec;
+    if(!std::filesystem::is_directory(m_base_path, ec))
+    {
+        LOG_DEBUG("No 1w directory exist at {}", m_base_path);
+    }
+    else
+    {
+        for(const auto& entry : std::filesystem::directory_iterator(m_base_path, ec))
+        {
+            auto id = entry.path().filename().string();
+            auto temperature = entry.path() / "temperature";
+            auto bulk_read = entry.path() / "therm_bulk_read";
+            if(std::filesystem::is_regular_file(temperature, ec))
+            {
+                int fd = open(temperature.c_str(), O_RDONLY | O_CLOEXEC);
+                if(fd < 0)
+                {
+                    LOG_ERROR("Failed to open {}: {}", temperature.string(), std::strerror(errno));
+                    continue;
+                }
+                probes.push_back(std::make_shared<SysfsFile>(id, fd));
+            }
+            else if(std::filesystem::is_regular_file(bulk_read, ec))
+            {
+                int fd = open(bulk_read.c_str(), O_WRONLY | O_CLOEXEC);
+                if(fd < 0)
+                {
+                    LOG_WARN("Failed to open {}, reading the probes of {} one by one: {}",
+                             bulk_read.string(),
+                             id,
+                             std::strerror(errno));
+                    continue;
+                }
+                bulk_reads.push_back(std::make_shared<SysfsFile>(id, fd));
+            }
+        }
+    }
+    std::sort(probes.begin(), probes.end(), [](const auto& a, const auto& b) { return a->id < b->id; });
+    LOG_INFO("Found {} 1w probes and {} bus masters with bulk read", probes.size(), bulk_reads.size());
+
+    size_t count = probes.size();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_probes = std::move(probes);
+        m_bulk_reads = std::move(bulk_reads);
+    }
+    m_discovered = true;
+    m_rediscover = false;
+    return count;
+}
+
+void OneWireReader::bindSensor(const std::string& id, std::shared_ptr<SensorFunction<double>> sensor)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_sensors[id] = std::move(sensor);
+}
+
+void OneWireReader::setReadingCallback(std::function<void(const std::string& id, double temperature)> callback)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_reading_callback = std::move(callback);
+}
+
+void OneWireReader::setCycleCallback(std::function<void()> callback)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cycle_callback = std::move(callback);
+}
+
+void OneWireReader::start(std::chrono::milliseconds interval)
+{
+    auto connector = m_connector.lock();
+    if(!connector)
+    {
+        LOG_ERROR("Failed to start reading 1w probes: MQTTConnector is no longer alive");
+        return;
+    }
+    stop();
+    std::weak_ptr<OneWireReader> weak_self = weak_from_this();
+    m_timer = connector->callEvery(interval, [weak_self]() {
+        if(auto self = weak_self.lock())
+        {
+            self->readNow();
+        }
+    });
+    readNow();
+}
+
+void OneWireReader::stop()
+{
+    auto timer = m_timer.exchange(0);
+    auto connector = m_connector.lock();
+    if(timer != 0 && connector)
+    {
+        connector->cancelTimer(timer);
+    }
+}
+
+bool OneWireReader::readNow()
+{
+    if(m_stopping)
+    {
+        return false;
+    }
+    if(m_cycle_running.exchange(true))
+    {
+        LOG_DEBUG("Skipping 1w read cycle, the previous one is still running");
+        return false;
+    }
+    m_workers->post(this, [this]() { runCycle(); });
+    return true;
+}
+
+std::vector<std::string> OneWireReader::getSensorIds() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<std::string> ids;
+    ids.reserve(m_probes.size());
+    for(const auto& probe : m_probes)
+    {
+        ids.push_back(probe->id);
+    }
+    return ids;
+}
+
+void OneWireReader::runCycle()
+{
+    if(m_stopping)
+    {
+        m_cycle_running = false;
+        return;
+    }
+    if(!m_discovered || m_rediscover)
+    {
+        discover();
+    }
+
+    std::vector<std::shared_ptr<SysfsFile>> probes;
+    std::vector<std::shared_ptr<SysfsFile>> bulk_reads;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        probes = m_probes;
+        bulk_reads = m_bulk_reads;
+    }
+
+    // Start the conversion on all probes of each bus master at once. The write returns when the conversion is done
+    for(const auto& bulk_read : bulk_reads)
+    {
+        static const char trigger[] = "trigger\n";
+        if(pwrite(bulk_read->fd, trigger, sizeof(trigger) - 1, 0) < 0)
+        {
+            LOG_WARN("Failed to trigger bulk read on {}: {}", bulk_read->id, std::strerror(errno));
+        }
+    }
+
+    // Count this task as a probe, so the cycle does not finish before all reads are posted
+    m_probes_left = probes.size() + 1;
+    for(const auto& probe : probes)
+    {
+        m_workers->post(probe.get(), [this, probe]() { readProbe(probe); });
+    }
+    finishProbe();
+}
+
+void OneWireReader::readProbe(const std::shared_ptr<SysfsFile>& probe)
+{
+    if(m_stopping)
+    {
+        // Do not wait for a conversion when shutting down
+        finishProbe();
+        return;
+    }
+    double temperature = 0;
+    if(readTemperature(probe->fd, temperature))
+    {
+        LOG_DEBUG("Sensor: {} Temp: {}", probe->id, temperature);
+        deliver(probe->id, temperature);
+    }
+    else
+    {
+        if(errno == ENODEV || errno == ENOENT)
+        {
+            m_rediscover = true;
+        }
+        LOG_ERROR("Failed to read temperature from {}", probe->id);
+    }
+    finishProbe();
+}
+
+void OneWireReader::finishProbe()
+{
+    if(--m_probes_left != 0)
+    {
+        return;
+    }
+    ++m_completed_cycles;
+    auto connector = m_connector.lock();
+    if(connector)
+    {
+        // Queued after the readings of the cycle, so it runs after them
+        std::weak_ptr<OneWireReader> weak_self = weak_from_this();
+        connector->callAt(std::chrono::steady_clock::now(), [weak_self]() {
+            auto self = weak_self.lock();
+            if(!self)
+            {
+                return;
+            }
+            std::function<void()> callback;
+            {
+                std::lock_guard<std::mutex> lock(self->m_mutex);
+                callback = self->m_cycle_callback;
+            }
+            if(callback)
+            {
+                callback();
+            }
+        });
+    }
+    m_cycle_running = false;
+}
+
+void OneWireReader::deliver(const std::string& id, double temperature)
+{
+    auto connector = m_connector.lock();
+    if(!connector)
+    {
+        return;
+    }
+    std::weak_ptr<OneWireReader> weak_self = weak_from_this();
+    connector->callAt(std::chrono::steady_clock::now(), [weak_self, id, temperature]() {
+        auto self = weak_self.lock();
+        if(!self)
+        {
+            return;
+        }
+        std::shared_ptr<SensorFunction<double>> sensor;
+        std::function<void(const std::string&, double)> callback;
+        {
+            std::lock_guard<std::mutex> lock(self->m_mutex);
+            auto bound = self->m_sensors.find(id);
+            if(bound != self->m_sensors.end())
+            {
+                sensor = bound->second;
+            }
+            callback = self->m_reading_callback;
+        }
+        if(sensor)
+        {
+            sensor->update(temperature);
+        }
+        if(callback)
+        {
+            callback(id, temperature);
+        }
+    });
+}
+
+bool OneWireReader::readTemperature(int fd, double& temperature)
+{
+    // sysfs makes a fresh reading every time the file is read from the start
+    char buffer[32];
+    auto length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if(length <= 0)
+    {
+        return false;
+    }
+    buffer[length] = '\0';
+
+    char* end = nullptr;
+    errno = 0;
+    long millidegrees = std::strtol(buffer, &end, 10);
+    if(end == buffer || errno != 0)
+    {
+        errno = EINVAL;
+        return false;
+    }
+    if(millidegrees == power_on_reset_millidegrees)
+    {
+        errno = EAGAIN;
+        return false;
+    }
+    temperature = static_cast<double>(millidegrees) / 1000;
+    return true;
+}
@@ -0,0 +1,208 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+// Include the corresponding header file
+#include "hass_mqtt_device/core/slow_pwm.h"
+
+// Include any other necessary headers
+#include "hass_mqtt_device/core/mqtt_connector.h"
+#include "hass_mqtt_device/functions/number.h"
+#include "hass_mqtt_device/logger/logger.hpp" // For logging
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// The fractional part of the golden ratio. Multiples of it spread out evenly over the period for any channel count
+constexpr double phase_spread = 0.6180339887498949;
+
+SlowPwm::SlowPwm(std::shared_ptr<MQTTConnector> connector)
+    : m_connector(connector)
+    , m_epoch(Clock::now())
+{
+}
+
+SlowPwm::~SlowPwm()
+{
+    auto connector = m_connector.lock();
+    if(connector && m_timer != 0)
+    {
+        connector->cancelTimer(m_timer);
+    }
+}
+
+size_t SlowPwm::addChannel(std::function<void(bool)> output,
+                           std::chrono::milliseconds period,
+                           std::optional<std::chrono::milliseconds> phase)
+{
+    if(period <= std::chrono::milliseconds(0))
+    {
+        LOG_ERROR("Period of PWM channel must be above zero");
+        throw std::invalid_argument("Period of PWM channel must be above zero");
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t index = m_channels.size();
+    Channel channel;
+    channel.output = std::move(output);
+    channel.period = period;
+    if(phase)
+    {
+        channel.phase = *phase % period;
+    }
+    else
+    {
+        double fraction = std::fmod(static_cast<double>(index) * phase_spread, 1.0);
+        channel.phase = std::chrono::duration_cast<Clock::duration>(channel.period * fraction);
+    }
+    LOG_DEBUG("Adding PWM channel {} with period {} ms",
+              index,
+              std::chrono::duration_cast<std::chrono::milliseconds>(channel.period).count());
+    m_channels.push_back(std::move(channel));
+
+    // Write the initial off state from the network loop
+    scheduleEdge(index, Clock::now());
+    armTimer();
+    return index;
+}
+
+size_t SlowPwm::bindNumber(const std::shared_ptr<NumberFunction>& number,
+                           std::function<void(bool)> output,
+                           std::chrono::milliseconds period,
+                           std::optional<std::chrono::milliseconds> phase)
+{
+    auto index = addChannel(std::move(output), period, phase);
+    double min = number->getMin();
+    double range = number->getMax() - min;
+    auto toDuty = [min, range](double value) { return range > 0 ? (value - min) / range : 0.0; };
+
+    std::weak_ptr<SlowPwm> weak_self = weak_from_this();
+    number->setValueListener([weak_self, index, toDuty](double value) {
+        if(auto self = weak_self.lock())
+        {
+            self->setDuty(index, toDuty(value));
+        }
+    });
+    setDuty(index, toDuty(number->getNumber()));
+    return index;
+}
+
+void SlowPwm::setDuty(size_t channel, double duty)
+{
+    duty = std::clamp(duty, 0.0, 1.0);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(channel >= m_channels.size())
+    {
+        LOG_ERROR("PWM channel {} does not exist", channel);
+        return;
+    }
+    if(m_channels[channel].duty == duty)
+    {
+        return;
+    }
+    LOG_DEBUG("Setting duty cycle of PWM channel {} to {}", channel, duty);
+    m_channels[channel].duty = duty;
+    scheduleEdge(channel, Clock::now());
+    armTimer();
+}
+
+double SlowPwm::getDuty(size_t channel) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return channel < m_channels.size() ? m_channels[channel].duty : 0.0;
+}
+
+bool SlowPwm::getOutput(size_t channel) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return channel < m_channels.size() && m_channels[channel].state;
+}
+
+size_t SlowPwm::getChannelCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_channels.size();
+}
+
+void SlowPwm::scheduleEdge(size_t channel, Clock::time_point when)
+{
+    m_edges.push(Edge{when, channel, ++m_channels[channel].generation});
+}
+
+void SlowPwm::armTimer()
+{
+    if(m_edges.empty())
+    {
+        return;
+    }
+    auto when = m_edges.top().when;
+    if(m_timer != 0 && m_timer_when <= when)
+    {
+        return;
+    }
+    auto connector = m_connector.lock();
+    if(!connector)
+    {
+        LOG_ERROR("Failed to schedule PWM outputs: MQTTConnector is no longer alive");
+        return;
+    }
+    if(m_timer != 0)
+    {
+        connector->cancelTimer(m_timer);
+    }
+    std::weak_ptr<SlowPwm> weak_self = weak_from_this();
+    m_timer = connector->callAt(when, [weak_self]() {
+        if(auto self = weak_self.lock())
+        {
+            self->onTimer();
+        }
+    });
+    m_timer_when = when;
+}
+
+void SlowPwm::onTimer()
+{
+    std::vector<std::pair<std::function<void(bool)>, bool>> writes;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_timer = 0;
+        auto now = Clock::now();
+        while(!m_edges.empty() && m_edges.top().when <= now)
+        {
+            auto edge = m_edges.top();
+            m_edges.pop();
+            auto& channel = m_channels[edge.channel];
+            if(edge.generation != channel.generation)
+            {
+                continue;
+            }
+
+            // Find where in its cycle the channel is, and switch if it is on the other side of the duty cycle
+            auto into_cycle = (now - m_epoch + channel.phase) % channel.period;
+            auto cycle_start = now - into_cycle;
+            auto on_time = std::chrono::duration_cast<Clock::duration>(channel.period * channel.duty);
+            bool state = into_cycle < on_time;
+            if(state != channel.state || !channel.written)
+            {
+                channel.state = state;
+                channel.written = true;
+                writes.emplace_back(channel.output, state);
+            }
+
+            // Fully on or off never switches, so it only needs a new edge when the duty cycle changes
+            if(channel.duty > 0 && channel.duty < 1)
+            {
+                scheduleEdge(edge.channel, state ? cycle_start + on_time : cycle_start + channel.period);
+            }
+        }
+        armTimer();
+    }
+
+    // Write without the lock, the outputs may take a while. The callbacks were copied, adding channels may move them
+    for(auto& [output, state] : writes)
+    {
+        output(state);
+    }
+}
@@ -0,0 +1,448 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+// Include the corresponding header file
+#include "hass_mqtt_device/core/state_store.h"
+
+// Include any other necessary headers
+#include "hass_mqtt_device/core/helper_functions.hpp"
+#include "hass_mqtt_device/logger/logger.hpp" // For logging
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+// The journal starts with a magic and a version
+constexpr std::array<uint8_t, 8> journal_header = {'H', 'M', 'S', 'J', 1, 0, 0, 0};
+
+// A record is the type, the slot, the payload length, the payload and the CRC-32 of all of those
+enum RecordType : uint8_t
+{
+    RECORD_KEY = 1, // The payload is the key of the slot
+    RECORD_VALUE = 2 // The payload is the value of the slot, as the little endian bits of a double
+};
+constexpr size_t record_overhead = 1 + 2 + 1 + 4;
+
+uint64_t readLittleEndian(const uint8_t* data, size_t size)
+{
+    uint64_t value = 0;
+    for(size_t i = 0; i < size; ++i)
+    {
+        value |= static_cast<uint64_t>(data[i]) << (8 * i);
+    }
+    return value;
+}
+
+void appendLittleEndian(std::vector<uint8_t>& out, uint64_t value, size_t size)
+{
+    for(size_t i = 0; i < size; ++i)
+    {
+        out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+}
+
+void appendRecord(std::vector<uint8_t>& out, RecordType type, uint16_t slot, const uint8_t* payload, uint8_t size)
+{
+    size_t start = out.size();
+    out.push_back(type);
+    appendLittleEndian(out, slot, 2);
+    out.push_back(size);
+    out.insert(out.end(), payload, payload + size);
+    appendLittleEndian(out, crc32(out.data() + start, out.size() - start), 4);
+}
+
+void appendKeyRecord(std::vector<uint8_t>& out, uint16_t slot, const std::string& key)
+{
+    appendRecord(out, RECORD_KEY, slot, reinterpret_cast<const uint8_t*>(key.data()), static_cast<uint8_t>(key.size()));
+}
+
+void appendValueRecord(std::vector<uint8_t>& out, uint16_t slot, double value)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    std::vector<uint8_t> payload;
+    appendLittleEndian(payload, bits, sizeof(bits));
+    appendRecord(out, RECORD_VALUE, slot, payload.data(), static_cast<uint8_t>(payload.size()));
+}
+
+bool writeAll(int fd, const uint8_t* data, size_t size)
+{
+    while(size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+// Sync the folder of a file, so a created or renamed file survives a power loss
+void syncFolder(const std::string& path)
+{
+    auto slash = path.find_last_of('/');
+    std::string folder = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int fd = ::open(folder.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        LOG_WARN("Failed to open {} to sync it: {}", folder, std::strerror(errno));
+        return;
+    }
+    fsync(fd);
+    close(fd);
+}
+
+// Two values are the same if their bits are, so NAN is not written again and again
+bool sameValue(double a, double b)
+{
+    return std::memcmp(&a, &b, sizeof(double)) == 0;
+}
+} // namespace
+
+StateStore::StateStore(std::string path, size_t compact_threshold)
+    : m_path(std::move(path))
+    , m_compact_threshold(compact_threshold)
+{
+}
+
+StateStore::~StateStore()
+{
+    if(m_fd >= 0)
+    {
+        close(m_fd);
+    }
+}
+
+bool StateStore::open()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_fd >= 0)
+    {
+        return true;
+    }
+    bool existed = access(m_path.c_str(), F_OK) == 0;
+    int fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        LOG_ERROR("Failed to open the state journal {}: {}", m_path, std::strerror(errno));
+        return false;
+    }
+    struct stat status;
+    if(fstat(fd, &status) != 0)
+    {
+        LOG_ERROR("Failed to stat the state journal {}: {}", m_path, std::strerror(errno));
+        close(fd);
+        return false;
+    }
+    auto file_size = static_cast<size_t>(status.st_size);
+
+    // Read into new tables, the ones in memory may already have keys set before the journal was opened
+    std::vector<std::string> slots;
+    std::unordered_map<std::string, Entry> values;
+    if(file_size == 0)
+    {
+        if(!writeAll(fd, journal_header.data(), journal_header.size()) || fdatasync(fd) != 0)
+        {
+            LOG_ERROR("Failed to write the state journal {}: {}", m_path, std::strerror(errno));
+            close(fd);
+            return false;
+        }
+        if(!existed)
+        {
+            syncFolder(m_path);
+        }
+        m_journal_size = journal_header.size();
+    }
+    else
+    {
+        m_journal_size = readJournal(fd, slots, values);
+        if(m_journal_size == 0)
+        {
+            // Leave the file alone, it may be something else given the wrong path
+            LOG_ERROR("{} is not a state journal", m_path);
+            close(fd);
+            return false;
+        }
+        if(m_journal_size < file_size)
+        {
+            LOG_WARN("Dropping {} bytes of torn or corrupt records at the end of the state journal {}",
+                     file_size - m_journal_size,
+                     m_path);
+            if(ftruncate(fd, static_cast<off_t>(m_journal_size)) != 0)
+            {
+                LOG_ERROR("Failed to truncate the state journal {}: {}", m_path, std::strerror(errno));
+                close(fd);
+                return false;
+            }
+        }
+        LOG_INFO("Restored {} values from the state journal {}", values.size(), m_path);
+    }
+    lseek(fd, static_cast<off_t>(m_journal_size), SEEK_SET);
+    m_fd = fd;
+
+    // Values set before the journal was opened are newer than the ones in it, so write them on top
+    auto pending = std::move(m_values);
+    m_slots = std::move(slots);
+    m_values = std::move(values);
+    for(const auto& [key, entry] : pending)
+    {
+        setLocked(key, entry.value);
+    }
+
+    if(needsCompaction())
+    {
+        compactLocked();
+    }
+    return true;
+}
+
+size_t StateStore::readJournal(int fd,
+                               std::vector<std::string>& slots,
+                               std::unordered_map<std::string, Entry>& values)
+{
+    std::vector<uint8_t> data;
+    std::array<uint8_t, 4096> buffer;
+    while(true)
+    {
+        ssize_t count = read(fd, buffer.data(), buffer.size());
+        if(count < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            LOG_ERROR("Failed to read the state journal {}: {}", m_path, std::strerror(errno));
+            break;
+        }
+        if(count == 0)
+        {
+            break;
+        }
+        data.insert(data.end(), buffer.begin(), buffer.begin() + count);
+    }
+    if(data.size() < journal_header.size() || !std::equal(journal_header.begin(), journal_header.end(), data.begin()))
+    {
+        return 0;
+    }
+
+    size_t offset = journal_header.size();
+    while(offset + record_overhead <= data.size())
+    {
+        const uint8_t* record = data.data() + offset;
+        size_t payload_size = record[3];
+        size_t record_size = record_overhead + payload_size;
+        if(offset + record_size > data.size() ||
+           crc32(record, record_size - 4) != readLittleEndian(record + record_size - 4, 4))
+        {
+            break;
+        }
+        auto slot = static_cast<uint16_t>(readLittleEndian(record + 1, 2));
+        const uint8_t* payload = record + 4;
+        if(record[0] == RECORD_KEY && slot == slots.size())
+        {
+            slots.emplace_back(reinterpret_cast<const char*>(payload), payload_size);
+        }
+        else if(record[0] == RECORD_VALUE && slot < slots.size() && payload_size == sizeof(double))
+        {
+            uint64_t bits = readLittleEndian(payload, sizeof(double));
+            double value;
+            std::memcpy(&value, &bits, sizeof(value));
+            values[slots[slot]] = Entry{slot, value};
+        }
+        else
+        {
+            // A valid checksum but a record that does not fit, stop here as for a torn one
+            LOG_WARN("Unexpected record of type {} for slot {} in the state journal {}", record[0], slot, m_path);
+            break;
+        }
+        offset += record_size;
+    }
+    return offset;
+}
+
+std::optional<double> StateStore::get(const std::string& key) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto found = m_values.find(key);
+    if(found == m_values.end())
+    {
+        return std::nullopt;
+    }
+    return found->second.value;
+}
+
+bool StateStore::set(const std::string& key, double value)
+{
+    if(key.size() > std::numeric_limits<uint8_t>::max())
+    {
+        LOG_ERROR("The state key {} is too long", key);
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return setLocked(key, value);
+}
+
+bool StateStore::setLocked(const std::string& key, double value)
+{
+    std::vector<uint8_t> records;
+    auto found = m_values.find(key);
+    bool new_key = found == m_values.end();
+    double previous = 0.0;
+    if(!new_key)
+    {
+        if(sameValue(found->second.value, value))
+        {
+            return m_fd >= 0;
+        }
+        previous = found->second.value;
+        found->second.value = value;
+    }
+    else
+    {
+        if(m_slots.size() > std::numeric_limits<uint16_t>::max())
+        {
+            LOG_ERROR("Too many keys in the state journal {}, not storing {}", m_path, key);
+            return false;
+        }
+        auto slot = static_cast<uint16_t>(m_slots.size());
+        m_slots.push_back(key);
+        found = m_values.emplace(key, Entry{slot, value}).first;
+        appendKeyRecord(records, slot, key);
+    }
+    appendValueRecord(records, found->second.slot, value);
+
+    if(m_fd < 0)
+    {
+        return false;
+    }
+    if(!append(records))
+    {
+        // Undo the change, so that a new key is declared again by the next set() instead of its value records
+        // pointing to a slot the journal never declared
+        if(new_key)
+        {
+            m_values.erase(found);
+            m_slots.pop_back();
+        }
+        else
+        {
+            found->second.value = previous;
+        }
+        return false;
+    }
+    if(needsCompaction())
+    {
+        compactLocked();
+    }
+    return true;
+}
+
+bool StateStore::needsCompaction() const
+{
+    // With many keys the compacted journal alone can be past the threshold, let it double before compacting again
+    return m_journal_size > std::max(m_compact_threshold, 2 * m_compacted_size);
+}
+
+bool StateStore::append(const std::vector<uint8_t>& records)
+{
+    if(!writeAll(m_fd, records.data(), records.size()) || fdatasync(m_fd) != 0)
+    {
+        LOG_ERROR("Failed to write the state journal {}: {}", m_path, std::strerror(errno));
+        // Cut off what was written, records after a torn one would never be read
+        if(ftruncate(m_fd, static_cast<off_t>(m_journal_size)) != 0)
+        {
+            LOG_ERROR("Failed to truncate the state journal {}: {}", m_path, std::strerror(errno));
+        }
+        lseek(m_fd, static_cast<off_t>(m_journal_size), SEEK_SET);
+        return false;
+    }
+    m_journal_size += records.size();
+    return true;
+}
+
+bool StateStore::compact()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return compactLocked();
+}
+
+bool StateStore::compactLocked()
+{
+    if(m_fd < 0)
+    {
+        return false;
+    }
+    // Number the slots again, leaving out keys that were never given a value
+    std::vector<std::string> slots;
+    std::vector<uint8_t> data(journal_header.begin(), journal_header.end());
+    for(const auto& [key, entry] : m_values)
+    {
+        auto slot = static_cast<uint16_t>(slots.size());
+        slots.push_back(key);
+        appendKeyRecord(data, slot, key);
+        appendValueRecord(data, slot, entry.value);
+    }
+
+    auto temporary_path = m_path + ".tmp";
+    int fd = ::open(temporary_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        LOG_ERROR("Failed to create {}: {}", temporary_path, std::strerror(errno));
+        return false;
+    }
+    if(!writeAll(fd, data.data(), data.size()) || fsync(fd) != 0)
+    {
+        LOG_ERROR("Failed to write {}: {}", temporary_path, std::strerror(errno));
+        close(fd);
+        unlink(temporary_path.c_str());
+        return false;
+    }
+    if(rename(temporary_path.c_str(), m_path.c_str()) != 0)
+    {
+        LOG_ERROR("Failed to replace the state journal {}: {}", m_path, std::strerror(errno));
+        close(fd);
+        unlink(temporary_path.c_str());
+        return false;
+    }
+    syncFolder(m_path);
+
+    LOG_DEBUG("Compacted the state journal {} from {} to {} bytes", m_path, m_journal_size, data.size());
+    close(m_fd);
+    m_fd = fd;
+    m_journal_size = data.size();
+    m_slots = std::move(slots);
+    m_compacted_size = data.size();
+    for(size_t slot = 0; slot < m_slots.size(); ++slot)
+    {
+        m_values[m_slots[slot]].slot = static_cast<uint16_t>(slot);
+    }
+    return true;
+}
+
+size_t StateStore::size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_values.size();
+}
+
+size_t StateStore::getJournalSize() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_journal_size;
+}
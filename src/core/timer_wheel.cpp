@@ -0,0 +1,172 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+// Include the corresponding header file
+#include "hass_mqtt_device/core/timer_wheel.h"
+
+// Include any other necessary headers
+#include <algorithm>
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick, size_t slot_count)
+    : m_start(Clock::now())
+    , m_tick(std::max(tick, std::chrono::milliseconds(1)))
+    , m_slots(std::max<size_t>(slot_count, 1))
+{
+}
+
+TimerId TimerWheel::add(Clock::time_point when, Clock::duration period, std::function<void()> task)
+{
+    TimerId id = m_next_id++;
+    auto& timer = m_timers[id];
+    timer.when = when;
+    timer.period = std::max(period, Clock::duration::zero());
+    timer.tick = tickOf(when);
+    timer.task = std::make_shared<std::function<void()>>(std::move(task));
+    place(id, timer);
+    return id;
+}
+
+bool TimerWheel::cancel(TimerId id)
+{
+    // The id is left in its slot, and dropped when the slot is visited
+    return m_timers.erase(id) > 0;
+}
+
+std::vector<TimerWheel::DueTimer> TimerWheel::advance(Clock::time_point now)
+{
+    std::vector<TimerId> due;
+
+    // Timers added for ticks already advanced past are due no matter what
+    for(auto id : m_overdue)
+    {
+        if(m_timers.count(id) > 0)
+        {
+            due.push_back(id);
+        }
+    }
+    m_overdue.clear();
+
+    // Visit the slots of the ticks that passed, at most one round of the wheel
+    auto now_tick = now <= m_start ? 0 : static_cast<uint64_t>((now - m_start) / m_tick);
+    if(now_tick > m_current_tick)
+    {
+        auto ticks = std::min<uint64_t>(now_tick - m_current_tick, m_slots.size());
+        for(uint64_t i = 1; i <= ticks; ++i)
+        {
+            auto& slot = m_slots[(m_current_tick + i) % m_slots.size()];
+            auto kept = slot.begin();
+            for(auto id : slot)
+            {
+                auto timer = m_timers.find(id);
+                if(timer == m_timers.end())
+                {
+                    continue;
+                }
+                if(timer->second.tick <= now_tick)
+                {
+                    due.push_back(id);
+                }
+                else
+                {
+                    // Due in a later round of the wheel
+                    *kept++ = id;
+                }
+            }
+            slot.erase(kept, slot.end());
+        }
+        m_current_tick = now_tick;
+    }
+
+    // Ids grow with every timer added, so they keep timers due at the same time in order
+    std::sort(due.begin(), due.end(), [this](TimerId a, TimerId b) {
+        const auto& when_a = m_timers.at(a).when;
+        const auto& when_b = m_timers.at(b).when;
+        return when_a != when_b ? when_a < when_b : a < b;
+    });
+
+    std::vector<DueTimer> result;
+    result.reserve(due.size());
+    for(auto id : due)
+    {
+        auto timer = m_timers.find(id);
+        result.push_back(DueTimer{id, timer->second.task});
+        if(timer->second.period == Clock::duration::zero())
+        {
+            m_timers.erase(timer);
+            continue;
+        }
+
+        // Keep the phase of the period, skipping the periods that were missed
+        auto& periodic = timer->second;
+        auto missed = now >= periodic.when ? (now - periodic.when) / periodic.period : 0;
+        periodic.when += periodic.period * (missed + 1);
+        periodic.tick = tickOf(periodic.when);
+        place(id, periodic);
+    }
+    return result;
+}
+
+TimerWheel::Clock::time_point TimerWheel::nextDue() const
+{
+    if(m_timers.empty())
+    {
+        return Clock::time_point::max();
+    }
+    for(auto id : m_overdue)
+    {
+        if(m_timers.count(id) > 0)
+        {
+            return startOf(m_current_tick);
+        }
+    }
+
+    // The first slot holding a timer for its own tick in this round has the next timer
+    for(uint64_t tick = m_current_tick + 1; tick <= m_current_tick + m_slots.size(); ++tick)
+    {
+        for(auto id : m_slots[tick % m_slots.size()])
+        {
+            auto timer = m_timers.find(id);
+            if(timer != m_timers.end() && timer->second.tick == tick)
+            {
+                return startOf(tick);
+            }
+        }
+    }
+
+    // All timers are more than a round away
+    uint64_t earliest = UINT64_MAX;
+    for(const auto& [id, timer] : m_timers)
+    {
+        earliest = std::min(earliest, timer.tick);
+    }
+    return startOf(earliest);
+}
+
+uint64_t TimerWheel::tickOf(Clock::time_point when) const
+{
+    if(when <= m_start)
+    {
+        return 0;
+    }
+    // Round up, so a timer never fires before it is due
+    auto since_start = when - m_start;
+    return static_cast<uint64_t>((since_start + m_tick - Clock::duration(1)) / m_tick);
+}
+
+TimerWheel::Clock::time_point TimerWheel::startOf(uint64_t tick) const
+{
+    return m_start + m_tick * static_cast<Clock::rep>(tick);
+}
+
+void TimerWheel::place(TimerId id, Timer& timer)
+{
+    if(timer.tick <= m_current_tick)
+    {
+        m_overdue.push_back(id);
+        return;
+    }
+    m_slots[timer.tick % m_slots.size()].push_back(id);
+}
@@ -0,0 +1,204 @@
+/**
+ * @author      Morgan Tørvolt
+ * @contributors somebody, hopefully@someday.com
+ * @copyright   See LICENSE file
+ */
+
+// Include the corresponding header file
+#include "hass_mqtt_device/functions/aggregating_sensor.h"
+#include "hass_mqtt_device/core/device_base.h"
+
+// Include any other necessary headers
+#include "hass_mqtt_device/logger/logger.hpp" // For logging
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// Making sure that the template class is instantiated for the types that we want to use
+template class AggregatingSensorFunction<float>;
+template class AggregatingSensorFunction<double>;
+
+/**
+ * @brief Compute the statistics of a block of samples
+ *
+ * The loops work on four independent lanes, so the compiler can vectorize them (NEON on the Raspberry Pi) and the
+ * additions do not have to wait for each other. The standard deviation is computed in a second pass over the
+ * deviations from the mean, which keeps its precision for signals with a large offset.
+ *
+ * @param data The samples
+ * @param count The number of samples, at least one
+ * @return The statistics of the samples
+ */
+template<typename T>
+static WindowStatistics<T> reduceWindow(const T* data, size_t count)
+{
+    constexpr size_t lanes = 4;
+    T sum[lanes] = {};
+    T low[lanes] = {data[0], data[0], data[0], data[0]};
+    T high[lanes] = {data[0], data[0], data[0], data[0]};
+
+    size_t blocked = count - count % lanes;
+    for(size_t i = 0; i < blocked; i += lanes)
+    {
+        for(size_t lane = 0; lane < lanes; ++lane)
+        {
+            T value = data[i + lane];
+            sum[lane] += value;
+            low[lane] = value < low[lane] ? value : low[lane];
+            high[lane] = value > high[lane] ? value : high[lane];
+        }
+    }
+    for(size_t i = blocked; i < count; ++i)
+    {
+        sum[0] += data[i];
+        low[0] = data[i] < low[0] ? data[i] : low[0];
+        high[0] = data[i] > high[0] ? data[i] : high[0];
+    }
+
+    WindowStatistics<T> statistics;
+    statistics.samples = count;
+    statistics.min = std::min(std::min(low[0], low[1]), std::min(low[2], low[3]));
+    statistics.max = std::max(std::max(high[0], high[1]), std::max(high[2], high[3]));
+    statistics.mean = (static_cast<double>(sum[0]) + sum[1] + sum[2] + sum[3]) / count;
+
+    T mean = static_cast<T>(statistics.mean);
+    T squares[lanes] = {};
+    for(size_t i = 0; i < blocked; i += lanes)
+    {
+        for(size_t lane = 0; lane < lanes; ++lane)
+        {
+            T deviation = data[i + lane] - mean;
+            squares[lane] += deviation * deviation;
+        }
+    }
+    for(size_t i = blocked; i < count; ++i)
+    {
+        T deviation = data[i] - mean;
+        squares[0] += deviation * deviation;
+    }
+    double variance = (static_cast<double>(squares[0]) + squares[1] + squares[2] + squares[3]) / count;
+    statistics.stddev = std::sqrt(variance);
+    return statistics;
+}
+
+template<typename T>
+AggregatingSensorFunction<T>::AggregatingSensorFunction(const std::string& function_name,
+                                                        const SensorAttributes& attributes,
+                                                        size_t window_size,
+                                                        std::chrono::milliseconds window_duration)
+    : SensorFunction<T>(function_name, attributes)
+    , m_samples(window_size)
+    , m_window_duration(window_duration)
+{
+    if(window_size == 0)
+    {
+        LOG_ERROR("Window size of aggregating sensor {} is 0", function_name);
+        throw std::invalid_argument("Window size of aggregating sensor is 0");
+    }
+}
+
+template<typename T>
+json AggregatingSensorFunction<T>::getDiscoveryJson() const
+{
+    json discoveryJson = SensorFunction<T>::getDiscoveryJson();
+    discoveryJson["json_attributes_topic"] = this->getBaseTopic() + "attributes";
+    return discoveryJson;
+}
+
+template<typename T>
+void AggregatingSensorFunction<T>::sendStatus() const
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    SensorFunction<T>::sendStatus();
+    publishAttributes();
+}
+
+template<typename T>
+void AggregatingSensorFunction<T>::publishAttributes() const
+{
+    if(m_statistics.samples == 0)
+    {
+        return;
+    }
+    auto parent = this->m_parent_device.lock();
+    if(!parent || !parent->isRegistered())
+    {
+        return;
+    }
+    m_statistics_published = true;
+
+    json payload;
+    payload["min"] = m_statistics.min;
+    payload["max"] = m_statistics.max;
+    payload["mean"] = m_statistics.mean;
+    payload["stddev"] = m_statistics.stddev;
+    payload["samples"] = m_statistics.samples;
+    auto topic = this->getBaseTopic() + "attributes";
+    if(this->m_attributes.telemetry)
+    {
+        parent->publishTelemetry(topic, payload.dump(), this->getPublishPolicy(TopicKind::TELEMETRY));
+    }
+    else
+    {
+        parent->publishMessage(topic, payload, this->getPublishPolicy(TopicKind::STATE));
+    }
+}
+
+template<typename T>
+void AggregatingSensorFunction<T>::addSample(T value)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    auto now = std::chrono::steady_clock::now();
+    // A sample after the end of a time based window belongs to the next one
+    if(windowExpired(now))
+    {
+        flush();
+    }
+    if(m_count == 0)
+    {
+        m_window_start = now;
+    }
+
+    m_samples[m_next] = value;
+    m_next = (m_next + 1) % m_samples.size();
+    if(m_count < m_samples.size())
+    {
+        m_count++;
+    }
+
+    if(m_window_duration.count() == 0 && m_count == m_samples.size())
+    {
+        flush();
+    }
+}
+
+template<typename T>
+void AggregatingSensorFunction<T>::checkWindow()
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    if(windowExpired(std::chrono::steady_clock::now()))
+    {
+        flush();
+    }
+}
+
+template<typename T>
+void AggregatingSensorFunction<T>::flush()
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    if(m_count == 0)
+    {
+        return;
+    }
+    // The order of the samples does not matter for the statistics, so the ring is reduced as it lies
+    m_statistics = reduceWindow(m_samples.data(), m_count);
+    m_count = 0;
+    m_next = 0;
+    m_statistics_published = false;
+    this->update(static_cast<T>(m_statistics.mean));
+    // The filter of the sensor may hold back the mean, but the statistics of every window are published
+    if(!m_statistics_published)
+    {
+        publishAttributes();
+    }
+}
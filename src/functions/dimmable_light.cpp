@@ -9,6 +9,7 @@
 #include "hass_mqtt_device/core/device_base.h"
 
 // Include any other necessary headers
+#include "hass_mqtt_device/core/command_parser.h"
 #include "hass_mqtt_device/logger/logger.hpp" // For logging
 
 DimmableLightFunction::DimmableLightFunction(const std::string& function_name,
@@ -61,52 +62,86 @@ void DimmableLightFunction::processMessage(const std::string& topic, const std::
     LOG_DEBUG("Processing message for dimmable light function {} with topic {}", getName(), topic);
 
     // Check if the topic is really for us
-    if(topic != getBaseTopic() + "set")
+    if(!isTopic(topic, "set"))
     {
         LOG_DEBUG("State topic is not for us ({} != {}).", topic, getBaseTopic() + "set");
         return;
     }
 
     // Decode the payload
-    json payloadJson;
-    try
+    CommandParser command(payload);
+    if(!command.isValid())
     {
-        payloadJson = json::parse(payload);
-    }
-    catch(const json::exception& e)
-    {
-        LOG_ERROR("JSON error in payload: {}. Error: {}", payload, e.what());
+        LOG_ERROR("JSON error in payload: {}. Error: {}", payload, command.getError());
         return;
     }
 
-    // Handle the sub topics
+    // Handle the sub topics. Without a brightness, keep the one of the command waiting in the mailbox, if any
     double brightness = m_brightness;
-    if(payloadJson.contains("brightness"))
+    if(auto pending = m_mailbox ? m_mailbox->peek() : std::nullopt)
     {
-        brightness = payloadJson["brightness"];
-        brightness /= 255.0;
+        brightness = pending->second;
     }
-    m_control_cb(payloadJson["state"] == "ON", brightness);
-}
-
-void DimmableLightFunction::sendStatus() const
-{
-    auto parent = m_parent_device.lock();
-    if(!parent)
+    if(auto value = command.getNumber("brightness"))
+    {
+        brightness = *value / 255.0;
+    }
+    bool state = command.getString("state") == "ON";
+    if(m_mailbox)
     {
+        dispatchCoalesced(m_mailbox,
+                          std::make_pair(state, brightness),
+                          [control_cb = m_control_cb](const auto& command) {
+                              control_cb(command.first, command.second);
+                          });
         return;
     }
+    dispatchControl([control_cb = m_control_cb, state, brightness]() { control_cb(state, brightness); });
+}
+
+void DimmableLightFunction::setCommandCoalescing(std::chrono::milliseconds min_interval)
+{
+    m_mailbox = std::make_shared<CommandMailbox<std::pair<bool, double>>>(min_interval);
+}
 
-    json payload;
+void DimmableLightFunction::sendStatus() const
+{
     // Convert brightness to int scale 0-255, round to nearest int
     int brightness_int = std::round(m_brightness * 255.0);
     LOG_DEBUG("Sending status for dimmable light function {} with state {} and brightness {}",
               getName(),
               m_state,
               brightness_int);
-    payload["state"] = m_state ? "ON" : "OFF";
-    payload["brightness"] = brightness_int;
-    parent->publishMessage(getBaseTopic() + "state", payload);
+    auto& writer = PayloadWriter::threadLocal();
+    writer.raw(R"({"brightness":)").value(brightness_int).raw(m_state ? R"(,"state":"ON"})" : R"(,"state":"OFF"})");
+    publishState(writer.str());
+}
+
+std::vector<std::string> DimmableLightFunction::getRestoreTopics() const
+{
+    return {getBaseTopic() + "state"};
+}
+
+void DimmableLightFunction::restoreState(const std::string& topic, const std::string& payload)
+{
+    if(!isTopic(topic, "state"))
+    {
+        return;
+    }
+    CommandParser status(payload);
+    auto state = status.getString("state");
+    auto brightness = status.getNumber("brightness");
+    if(!state || (*state != "ON" && *state != "OFF") || !brightness || *brightness < 0 || *brightness > 255)
+    {
+        LOG_WARN("Not restoring dimmable light function {} from payload {}", getName(), payload);
+        return;
+    }
+    LOG_DEBUG("Restoring dimmable light function {} to {} with brightness {}", getName(), *state, *brightness);
+    m_state = *state == "ON";
+    m_brightness = *brightness / 255.0;
+    dispatchControl([control_cb = m_control_cb, state = m_state, brightness = m_brightness]() {
+        control_cb(state, brightness);
+    });
 }
 
 void DimmableLightFunction::update(bool state, double brightness)
@@ -11,8 +11,24 @@
 #include "hass_mqtt_device/functions/hvac.h"
 
 // Include any other necessary headers
+#include "hass_mqtt_device/core/command_parser.h"
 #include "hass_mqtt_device/core/mqtt_connector.h"
 #include "hass_mqtt_device/logger/logger.hpp" // For logging
+#include <array>
+
+namespace
+{
+// The features with a state the hvac can be restored from, and their state topics
+const std::array<std::pair<HvacSupportedFeatures, const char*>, 7> restorable_features = {{
+    {HvacSupportedFeatures::TEMPERATURE_CONTROL_HEATING, "heating_temperature/state"},
+    {HvacSupportedFeatures::TEMPERATURE_CONTROL_COOLING, "cooling_temperature/state"},
+    {HvacSupportedFeatures::HUMIDITY_CONTROL, "humidity/state"},
+    {HvacSupportedFeatures::FAN_MODE, "fan_mode/state"},
+    {HvacSupportedFeatures::SWING_MODE, "swing_mode/state"},
+    {HvacSupportedFeatures::MODE_CONTROL, "mode/state"},
+    {HvacSupportedFeatures::PRESET_SUPPORT, "preset_mode/state"},
+}};
+} // namespace
 
 HvacFunction::HvacFunction(const std::string& function_name,
                            std::function<void(HvacSupportedFeatures, std::string)> control_cb,
@@ -198,78 +214,161 @@ void HvacFunction::processMessage(const std::string& topic, const std::string& p
     }
 
     // Decode the payload
-    json payloadJson;
-    try
+    CommandParser command(payload);
+    if(!command.isValid())
     {
-        payloadJson = json::parse(payload);
+        LOG_ERROR("JSON error in payload: {}. Error: {}", payload, command.getError());
+        return;
     }
-    catch(const json::exception& e)
+
+    auto command_value = command.getString("value");
+    if(!command_value)
     {
-        LOG_ERROR("JSON error in payload: {}. Error: {}", payload, e.what());
+        LOG_ERROR("No string value in payload: {}", payload);
         return;
     }
-
-    auto value = payloadJson["value"].get<std::string>();
+    std::string value(*command_value);
 
     // Handle the sub topics
     if((m_supported_features & HvacSupportedFeatures::TEMPERATURE_CONTROL_HEATING) != 0U)
     {
-        if(topic == getBaseTopic() + "heating_temperature/set")
+        if(isTopic(topic, "heating_temperature/set"))
         {
-            m_control_cb(HvacSupportedFeatures::TEMPERATURE_CONTROL_HEATING, value);
+            dispatchFeatureControl(HvacSupportedFeatures::TEMPERATURE_CONTROL_HEATING, value);
         }
     }
     if((m_supported_features & HvacSupportedFeatures::TEMPERATURE_CONTROL_COOLING) != 0U)
     {
-        if(topic == getBaseTopic() + "cooling_temperature/set")
+        if(isTopic(topic, "cooling_temperature/set"))
         {
-            m_control_cb(HvacSupportedFeatures::TEMPERATURE_CONTROL_COOLING, value);
+            dispatchFeatureControl(HvacSupportedFeatures::TEMPERATURE_CONTROL_COOLING, value);
         }
     }
     if((m_supported_features & HvacSupportedFeatures::HUMIDITY_CONTROL) != 0U)
     {
-        if(topic == getBaseTopic() + "humidity/set")
+        if(isTopic(topic, "humidity/set"))
         {
-            m_control_cb(HvacSupportedFeatures::HUMIDITY_CONTROL, value);
+            dispatchFeatureControl(HvacSupportedFeatures::HUMIDITY_CONTROL, value);
         }
     }
     if((m_supported_features & HvacSupportedFeatures::FAN_MODE) != 0U)
     {
-        if(topic == getBaseTopic() + "fan_mode/set")
+        if(isTopic(topic, "fan_mode/set"))
         {
-            m_control_cb(HvacSupportedFeatures::FAN_MODE, value);
+            dispatchFeatureControl(HvacSupportedFeatures::FAN_MODE, value);
         }
     }
     if((m_supported_features & HvacSupportedFeatures::SWING_MODE) != 0U)
     {
-        if(topic == getBaseTopic() + "swing_mode/set")
+        if(isTopic(topic, "swing_mode/set"))
         {
-            m_control_cb(HvacSupportedFeatures::SWING_MODE, value);
+            dispatchFeatureControl(HvacSupportedFeatures::SWING_MODE, value);
         }
     }
     if((m_supported_features & HvacSupportedFeatures::POWER_CONTROL) != 0U)
     {
-        if(topic == getBaseTopic() + "set")
+        if(isTopic(topic, "set"))
         {
-            m_control_cb(HvacSupportedFeatures::POWER_CONTROL, value);
+            dispatchFeatureControl(HvacSupportedFeatures::POWER_CONTROL, value);
         }
     }
     if((m_supported_features & HvacSupportedFeatures::MODE_CONTROL) != 0U)
     {
-        if(topic == getBaseTopic() + "mode/set")
+        if(isTopic(topic, "mode/set"))
         {
-            m_control_cb(HvacSupportedFeatures::MODE_CONTROL, value);
+            dispatchFeatureControl(HvacSupportedFeatures::MODE_CONTROL, value);
         }
     }
     if((m_supported_features & HvacSupportedFeatures::PRESET_SUPPORT) != 0U)
     {
-        if(topic == getBaseTopic() + "preset_mode/set")
+        if(isTopic(topic, "preset_mode/set"))
+        {
+            dispatchFeatureControl(HvacSupportedFeatures::PRESET_SUPPORT, value);
+        }
+    }
+}
+
+std::vector<std::string> HvacFunction::getRestoreTopics() const
+{
+    std::vector<std::string> topics;
+    for(const auto& [feature, sub_topic] : restorable_features)
+    {
+        if((m_supported_features & feature) != 0U)
+        {
+            topics.push_back(getBaseTopic() + sub_topic);
+        }
+    }
+    return topics;
+}
+
+void HvacFunction::restoreState(const std::string& topic, const std::string& payload)
+{
+    for(const auto& [feature, sub_topic] : restorable_features)
+    {
+        if((m_supported_features & feature) == 0U || !isTopic(topic, sub_topic))
+        {
+            continue;
+        }
+        CommandParser status(payload);
+        std::string value;
+        if(auto number = status.getNumber("value"))
+        {
+            value = PayloadWriter::threadLocal().value(*number).str();
+        }
+        else if(auto text = status.getString("value"))
+        {
+            value = std::string(*text);
+        }
+        else
+        {
+            LOG_WARN("Not restoring hvac function {} from topic {} with payload {}", getName(), topic, payload);
+            return;
+        }
+        LOG_DEBUG("Restoring hvac function {} from topic {} to {}", getName(), topic, value);
+        try
+        {
+            switch(feature)
+            {
+            case HvacSupportedFeatures::TEMPERATURE_CONTROL_HEATING:
+                updateHeatingSetpoint(std::stod(value), false);
+                break;
+            case HvacSupportedFeatures::TEMPERATURE_CONTROL_COOLING:
+                updateCoolingSetpoint(std::stod(value), false);
+                break;
+            case HvacSupportedFeatures::HUMIDITY_CONTROL:
+                updateHumiditySetpoint(std::stod(value), false);
+                break;
+            case HvacSupportedFeatures::FAN_MODE:
+                updateFanMode(value, false);
+                break;
+            case HvacSupportedFeatures::SWING_MODE:
+                updateSwingMode(value, false);
+                break;
+            case HvacSupportedFeatures::MODE_CONTROL:
+                updateDeviceMode(value, false);
+                break;
+            case HvacSupportedFeatures::PRESET_SUPPORT:
+                updatePresetMode(value, false);
+                break;
+            default:
+                break;
+            }
+        }
+        catch(const std::exception& e)
         {
-            m_control_cb(HvacSupportedFeatures::PRESET_SUPPORT, value);
+            LOG_WARN("Not restoring hvac function {} from topic {}: {}", getName(), topic, e.what());
+            return;
         }
+        dispatchFeatureControl(feature, value);
+        return;
     }
 }
 
+void HvacFunction::dispatchFeatureControl(HvacSupportedFeatures feature, const std::string& value) const
+{
+    dispatchControl([control_cb = m_control_cb, feature, value]() { control_cb(feature, value); });
+}
+
 void HvacFunction::sendStatus() const
 {
     sendFunctionStatus(HvacSupportedFeatures::TEMPERATURE);
@@ -296,7 +395,7 @@ void HvacFunction::sendFunctionStatus(const HvacSupportedFeatures& feature) cons
     {
         json payload;
         payload["temperature"] = m_temperature;
-        parent->publishMessage(getBaseTopic() + "temperature/measured", payload);
+        parent->publishMessage(getBaseTopic() + "temperature/measured", payload, getPublishPolicy(TopicKind::STATE));
         return;
     }
     if(feature == HvacSupportedFeatures::TEMPERATURE_CONTROL_HEATING &&
@@ -304,7 +403,8 @@ void HvacFunction::sendFunctionStatus(const HvacSupportedFeatures& feature) cons
     {
         json payload;
         payload["value"] = m_heating_setpoint;
-        parent->publishMessage(getBaseTopic() + "heating_temperature/state", payload);
+        parent->publishMessage(
+            getBaseTopic() + "heating_temperature/state", payload, getPublishPolicy(TopicKind::STATE));
         return;
     }
     if(feature == HvacSupportedFeatures::TEMPERATURE_CONTROL_COOLING &&
@@ -312,14 +412,15 @@ void HvacFunction::sendFunctionStatus(const HvacSupportedFeatures& feature) cons
     {
         json payload;
         payload["value"] = m_cooling_setpoint;
-        parent->publishMessage(getBaseTopic() + "cooling_temperature/state", payload);
+        parent->publishMessage(
+            getBaseTopic() + "cooling_temperature/state", payload, getPublishPolicy(TopicKind::STATE));
         return;
     }
     if(feature == HvacSupportedFeatures::HUMIDITY && (m_supported_features & HvacSupportedFeatures::HUMIDITY) != 0U)
     {
         json payload;
         payload["humidity"] = m_humidity;
-        parent->publishMessage(getBaseTopic() + "humidity/measured", payload);
+        parent->publishMessage(getBaseTopic() + "humidity/measured", payload, getPublishPolicy(TopicKind::STATE));
         return;
     }
     if(feature == HvacSupportedFeatures::HUMIDITY_CONTROL &&
@@ -327,21 +428,21 @@ void HvacFunction::sendFunctionStatus(const HvacSupportedFeatures& feature) cons
     {
         json payload;
         payload["value"] = m_humidity_setpoint;
-        parent->publishMessage(getBaseTopic() + "humidity/state", payload);
+        parent->publishMessage(getBaseTopic() + "humidity/state", payload, getPublishPolicy(TopicKind::STATE));
         return;
     }
     if(feature == HvacSupportedFeatures::FAN_MODE && (m_supported_features & HvacSupportedFeatures::FAN_MODE) != 0U)
     {
         json payload;
         payload["value"] = m_fan_mode;
-        parent->publishMessage(getBaseTopic() + "fan_mode/state", payload);
+        parent->publishMessage(getBaseTopic() + "fan_mode/state", payload, getPublishPolicy(TopicKind::STATE));
         return;
     }
     if(feature == HvacSupportedFeatures::SWING_MODE && (m_supported_features & HvacSupportedFeatures::SWING_MODE) != 0U)
     {
         json payload;
         payload["value"] = m_swing_mode;
-        parent->publishMessage(getBaseTopic() + "swing_mode/state", payload);
+        parent->publishMessage(getBaseTopic() + "swing_mode/state", payload, getPublishPolicy(TopicKind::STATE));
         return;
     }
     if(feature == HvacSupportedFeatures::MODE_CONTROL &&
@@ -349,7 +450,7 @@ void HvacFunction::sendFunctionStatus(const HvacSupportedFeatures& feature) cons
     {
         json payload;
         payload["value"] = m_device_mode;
-        parent->publishMessage(getBaseTopic() + "mode/state", payload);
+        parent->publishMessage(getBaseTopic() + "mode/state", payload, getPublishPolicy(TopicKind::STATE));
         return;
     }
     if(feature == HvacSupportedFeatures::ACTION && (m_supported_features & HvacSupportedFeatures::ACTION) != 0U)
@@ -379,7 +480,7 @@ void HvacFunction::sendFunctionStatus(const HvacSupportedFeatures& feature) cons
                 payload["action"] = nullptr;
                 break;
         }
-        parent->publishMessage(getBaseTopic() + "action/state", payload);
+        parent->publishMessage(getBaseTopic() + "action/state", payload, getPublishPolicy(TopicKind::STATE));
         return;
     }
     if(feature == HvacSupportedFeatures::PRESET_SUPPORT &&
@@ -387,7 +488,7 @@ void HvacFunction::sendFunctionStatus(const HvacSupportedFeatures& feature) cons
     {
         json payload;
         payload["value"] = m_preset_mode;
-        parent->publishMessage(getBaseTopic() + "preset_mode/state", payload);
+        parent->publishMessage(getBaseTopic() + "preset_mode/state", payload, getPublishPolicy(TopicKind::STATE));
         return;
     }
     LOG_DEBUG("Feature {} is not supported for this hvac function", feature);
@@ -9,6 +9,7 @@
 #include "hass_mqtt_device/core/device_base.h"
 
 // Include any other necessary headers
+#include "hass_mqtt_device/core/command_parser.h"
 #include "hass_mqtt_device/logger/logger.hpp" // For logging
 
 NumberFunction::NumberFunction(const std::string& function_name,
@@ -17,6 +18,7 @@ NumberFunction::NumberFunction(const std::string& function_name,
                                double min,
                                double step)
     : FunctionBase(function_name)
+    , m_number(min)
     , m_control_cb(control_cb)
     , m_max(max)
     , m_min(min)
@@ -76,7 +78,7 @@ void NumberFunction::processMessage(const std::string& topic, const std::string&
     LOG_DEBUG("Processing message for number function {} with topic {}", getName(), topic);
 
     // Check if the topic is really for us
-    if(topic != getBaseTopic() + "set")
+    if(!isTopic(topic, "set"))
     {
         LOG_DEBUG("State topic is not for us ({} != {}).", topic, getBaseTopic() + "set");
         return;
@@ -115,27 +117,60 @@ void NumberFunction::processMessage(const std::string& topic, const std::string&
         value = std::round(value / m_step) * m_step;
     }
 
-    if(value != m_number)
+    // Compare against the command waiting in the mailbox, if any, as that is what the callback will get next
+    std::optional<double> pending = m_mailbox ? m_mailbox->peek() : std::nullopt;
+    if(value == pending.value_or(m_number))
     {
-        m_control_cb(value);
+        return;
+    }
+    if(m_mailbox)
+    {
+        dispatchCoalesced(m_mailbox, value, m_control_cb);
+        return;
     }
+    dispatchControl([control_cb = m_control_cb, value]() { control_cb(value); });
+}
+
+void NumberFunction::setCommandCoalescing(std::chrono::milliseconds min_interval)
+{
+    m_mailbox = std::make_shared<CommandMailbox<double>>(min_interval);
 }
 
 void NumberFunction::sendStatus() const
 {
-    auto parent = m_parent_device.lock();
-    if(!parent)
+    auto& writer = PayloadWriter::threadLocal();
+    writer.raw(R"({"value":)").value(m_number).raw("}");
+    publishState(writer.str());
+}
+
+std::vector<std::string> NumberFunction::getRestoreTopics() const
+{
+    return {getBaseTopic() + "state"};
+}
+
+void NumberFunction::restoreState(const std::string& topic, const std::string& payload)
+{
+    if(!isTopic(topic, "state"))
     {
         return;
     }
-
-    json payload;
-    payload["value"] = m_number;
-    parent->publishMessage(getBaseTopic() + "state", payload);
+    auto value = CommandParser(payload).getNumber("value");
+    if(!value || *value < m_min || *value > m_max)
+    {
+        LOG_WARN("Not restoring number function {} from payload {}", getName(), payload);
+        return;
+    }
+    LOG_DEBUG("Restoring number function {} to {}", getName(), *value);
+    m_number = *value;
+    dispatchControl([control_cb = m_control_cb, value = *value]() { control_cb(value); });
 }
 
 void NumberFunction::update(double number)
 {
     m_number = number;
+    if(m_value_listener)
+    {
+        m_value_listener(number);
+    }
     sendStatus();
 }
@@ -9,6 +9,7 @@
 #include "hass_mqtt_device/core/device_base.h"
 
 // Include any other necessary headers
+#include "hass_mqtt_device/core/command_parser.h"
 #include "hass_mqtt_device/core/mqtt_connector.h"
 #include "hass_mqtt_device/logger/logger.hpp" // For logging
 
@@ -60,39 +61,52 @@ void OnOffLightFunction::processMessage(const std::string& topic, const std::str
     LOG_DEBUG("Processing message for on/off light function {} with topic {}", getName(), topic);
 
     // Check if the topic is really for us
-    if(topic != getBaseTopic() + "set")
+    if(!isTopic(topic, "set"))
     {
         LOG_DEBUG("State topic is not for us ({} != {}).", topic, getBaseTopic() + "set");
         return;
     }
 
     // Decode the payload
-    json payloadJson;
-    try
+    CommandParser command(payload);
+    if(!command.isValid())
     {
-        payloadJson = json::parse(payload);
-    }
-    catch(const json::exception& e)
-    {
-        LOG_ERROR("JSON error in payload: {}. Error: {}", payload, e.what());
+        LOG_ERROR("JSON error in payload: {}. Error: {}", payload, command.getError());
         return;
     }
 
     // Handle the sub topics
-    m_control_cb(payloadJson["state"] == "ON");
+    bool state = command.getString("state") == "ON";
+    dispatchControl([control_cb = m_control_cb, state]() { control_cb(state); });
 }
 
 void OnOffLightFunction::sendStatus() const
 {
-    auto parent = m_parent_device.lock();
-    if(!parent)
+    auto& writer = PayloadWriter::threadLocal();
+    writer.raw(m_state ? R"({"state":"ON"})" : R"({"state":"OFF"})");
+    publishState(writer.str());
+}
+
+std::vector<std::string> OnOffLightFunction::getRestoreTopics() const
+{
+    return {getBaseTopic() + "state"};
+}
+
+void OnOffLightFunction::restoreState(const std::string& topic, const std::string& payload)
+{
+    if(!isTopic(topic, "state"))
     {
         return;
     }
-
-    json payload;
-    payload["state"] = m_state ? "ON" : "OFF";
-    parent->publishMessage(getBaseTopic() + "state", payload);
+    auto state = CommandParser(payload).getString("state");
+    if(!state || (*state != "ON" && *state != "OFF"))
+    {
+        LOG_WARN("Not restoring on/off light function {} from payload {}", getName(), payload);
+        return;
+    }
+    LOG_DEBUG("Restoring on/off light function {} to {}", getName(), *state);
+    m_state = *state == "ON";
+    dispatchControl([control_cb = m_control_cb, state = m_state]() { control_cb(state); });
 }
 
 void OnOffLightFunction::update(bool state)
@@ -10,6 +10,9 @@
 
 // Include any other necessary headers
 #include "hass_mqtt_device/logger/logger.hpp" // For logging
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
 
 // Making sure that the template class is instantiated for the types that we want to use
 template class SensorFunction<int>;
@@ -66,15 +69,16 @@ void SensorFunction<T>::sendStatus() const
     {
         return;
     }
-    auto parent = m_parent_device.lock();
-    if(!parent)
+    auto& writer = PayloadWriter::threadLocal();
+    writer.raw(R"({"value":)").value(m_value).raw("}");
+    if(m_attributes.telemetry)
     {
-        return;
+        publishTelemetryState(writer.str());
+    }
+    else
+    {
+        publishState(writer.str());
     }
-
-    json payload;
-    payload["value"] = m_value;
-    parent->publishMessage(getBaseTopic() + "state", payload);
 }
 
 template<typename T>
@@ -82,5 +86,43 @@ void SensorFunction<T>::update(T value)
 {
     m_has_data = true;
     m_value = value;
+
+    auto now = std::chrono::steady_clock::now();
+    if(!shouldPublish(m_value, now))
+    {
+        return;
+    }
+    m_has_published = true;
+    m_last_published = m_value;
+    m_last_publish_time = now;
     sendStatus();
 }
+
+template<typename T>
+bool SensorFunction<T>::shouldPublish(const T& value, std::chrono::steady_clock::time_point now) const
+{
+    if(!m_has_published)
+    {
+        return true;
+    }
+    auto since_last = now - m_last_publish_time;
+    if(since_last < m_attributes.min_publish_interval)
+    {
+        return false;
+    }
+    if(m_attributes.max_silence_interval.count() > 0 && since_last >= m_attributes.max_silence_interval)
+    {
+        return true;
+    }
+    if constexpr(std::is_arithmetic_v<T> && !std::is_same_v<T, bool>)
+    {
+        double last = static_cast<double>(m_last_published);
+        double threshold = std::max(m_attributes.absolute_deadband, m_attributes.relative_deadband * std::abs(last));
+        if(threshold > 0 && std::abs(static_cast<double>(value) - last) <= threshold)
+        {
+            LOG_DEBUG("Change of sensor {} is within the deadband, not publishing", getName());
+            return false;
+        }
+    }
+    return true;
+}
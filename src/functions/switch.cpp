@@ -11,6 +11,7 @@
 #include "hass_mqtt_device/core/device_base.h"
 
 // Include any other necessary headers
+#include "hass_mqtt_device/core/command_parser.h"
 #include "hass_mqtt_device/core/mqtt_connector.h"
 #include "hass_mqtt_device/logger/logger.hpp" // For logging
 
@@ -64,39 +65,52 @@ void SwitchFunction::processMessage(const std::string& topic, const std::string&
     LOG_DEBUG("Processing message for switch function {} with topic {}", getName(), topic);
 
     // Check if the topic is really for us
-    if(topic != getBaseTopic() + "set")
+    if(!isTopic(topic, "set"))
     {
         LOG_DEBUG("State topic is not for us ({} != {}).", topic, getBaseTopic() + "set");
         return;
     }
 
     // Decode the payload
-    json payloadJson;
-    try
+    CommandParser command(payload);
+    if(!command.isValid())
     {
-        payloadJson = json::parse(payload);
-    }
-    catch(const json::exception& e)
-    {
-        LOG_ERROR("JSON error in payload: {}. Error: {}", payload, e.what());
+        LOG_ERROR("JSON error in payload: {}. Error: {}", payload, command.getError());
         return;
     }
 
     // Handle the sub topics
-    m_control_cb(payloadJson["value"] == "ON");
+    bool state = command.getString("value") == "ON";
+    dispatchControl([control_cb = m_control_cb, state]() { control_cb(state); });
 }
 
 void SwitchFunction::sendStatus() const
 {
-    auto parent = m_parent_device.lock();
-    if(!parent)
+    auto& writer = PayloadWriter::threadLocal();
+    writer.raw(m_state ? R"({"value":"ON"})" : R"({"value":"OFF"})");
+    publishState(writer.str());
+}
+
+std::vector<std::string> SwitchFunction::getRestoreTopics() const
+{
+    return {getBaseTopic() + "state"};
+}
+
+void SwitchFunction::restoreState(const std::string& topic, const std::string& payload)
+{
+    if(!isTopic(topic, "state"))
     {
         return;
     }
-
-    json payload;
-    payload["value"] = m_state ? "ON" : "OFF";
-    parent->publishMessage(getBaseTopic() + "state", payload);
+    auto value = CommandParser(payload).getString("value");
+    if(!value || (*value != "ON" && *value != "OFF"))
+    {
+        LOG_WARN("Not restoring switch function {} from payload {}", getName(), payload);
+        return;
+    }
+    LOG_DEBUG("Restoring switch function {} to {}", getName(), *value);
+    m_state = *value == "ON";
+    dispatchControl([control_cb = m_control_cb, state = m_state]() { control_cb(state); });
 }
 
 void SwitchFunction::update(bool state)